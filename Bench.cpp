@@ -0,0 +1,375 @@
+/*
+ *  Bench.cpp
+ *  celldiff
+ *
+ *  microbenchmarks of the model's kernels, each timed on its own over
+ *  fixed synthetic microstructures and several grid sizes:
+ *
+ *    wet    every active cell wet
+ *    front  the upper half of the tablet wet, a dry frontier below it
+ *    poly   as front, with a high polymer fraction
+ *
+ *  every kernel runs a number of repetitions; results are per cell
+ *  visited, as mean, standard deviation and minimum. GB/s is worked out
+ *  from the bytes a kernel references per cell (every neighbor read
+ *  counted), not from measured memory traffic.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+
+#include <vector>
+
+#include <getopt.h>
+
+#include "CellModel.hpp"
+
+using namespace std;
+
+//======= defines
+// default repetitions per kernel
+#define BENCH_REPS 10
+// diameters benchmarked by default
+#define BENCH_NUM_DEFAULT_SIZES 3
+static const f64 defaultSizes[BENCH_NUM_DEFAULT_SIZES] = { 0.016, 0.032, 0.064 };
+
+//======= types
+enum eBenchStructure {
+  eBenchWet,
+  eBenchFront,
+  eBenchPoly,
+  eNumBenchStructures
+};
+static const char* structureNames[eNumBenchStructures] = { "wet", "front", "poly" };
+
+// what a repetition of one kernel covers
+struct BenchResult {
+  const char* kernel;
+  // cells visited per repetition, and bytes referenced per cell
+  u64 cells;
+  f64 bytesPerCell;
+  // seconds per repetition
+  vector<f64> seconds;
+};
+
+//======= functions
+static f64 now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+static void print_result(const char* structure, const u32 cube, const BenchResult& r) {
+  if (r.cells == 0) {
+    // nothing of this kind in the structure
+    printf("%-6s %5d  %-18s %10d %10s %8s %10s %8s\n", structure, (int)cube, r.kernel, 0, "-", "-", "-", "-");
+    return;
+  }
+  const u32 n = r.seconds.size();
+  f64 mean = 0.0;
+  f64 lo = r.seconds[0];
+  for(u32 i=0; i<n; i++) {
+    mean += r.seconds[i];
+    lo = min(lo, r.seconds[i]);
+  }
+  mean /= (f64)n;
+  f64 var = 0.0;
+  for(u32 i=0; i<n; i++) {
+    var += (r.seconds[i] - mean) * (r.seconds[i] - mean);
+  }
+  const f64 sd = (n > 1) ? sqrt(var / (f64)(n - 1)) : 0.0;
+  const f64 cells = (f64)r.cells;
+  printf("%-6s %5d  %-18s %10llu %10.2f %8.2f %10.2f %8.2f\n",
+         structure, (int)cube, r.kernel, (unsigned long long)r.cells,
+         mean * 1e9 / cells, sd * 1e9 / cells, lo * 1e9 / cells,
+         r.bytesPerCell * cells / mean * 1e-9);
+}
+
+//------ the benchmarks, with access to the model's private steps
+class CellBench {
+public:
+  CellBench(const eBenchStructure s, const f64 diameter, const u32 reps, const u8 simd, const u8 layout,
+            const u8 stencil);
+  ~CellBench(void);
+  void run(void);
+private:
+  // set up the model and rewrite it into the structure
+  void build(void);
+  // slots of the frontier in the given states
+  void collect(vector<u32>& list, const u8* states, const u32 numStates);
+  void time(BenchResult& r, void (*fn)(CellBench* b));
+  template<class S> static void bench_diffuse(CellBench* b);
+  static void bench_diffuse_wet(CellBench* b);
+  template<class S> static void bench_dissolve(CellBench* b);
+  static void bench_continue(CellBench* b);
+  static void bench_drug_mass(CellBench* b);
+  static void bench_find(CellBench* b);
+  static void bench_distribute(CellBench* b);
+  static void bench_compress(CellBench* b);
+private:
+  eBenchStructure structure;
+  u32 reps;
+  CellModel* model;
+  // frontier slots per kernel
+  vector<u32> wetList;
+  vector<u32> diffuseList;
+  vector<u32> dryList;
+  // distributed states before compression
+  vector<u8> distributed;
+  // keeps results from being optimized away
+  f64 sink;
+};
+
+CellBench::CellBench(const eBenchStructure s, const f64 diameter, const u32 reps, const u8 simd, const u8 layout,
+                     const u8 stencil) :
+structure(s),
+reps(reps),
+sink(0.0)
+{
+  // cube width as celldiff works it out
+  const u32 n = (u32)(((f32)diameter / 0.001) + 0.5);
+  const f64 pp = (s == eBenchPoly) ? 0.7 : 0.3;
+  model = new CellModel(n, 0.23, 0.1, pp, 0.001, 0.000001, 0.000001, 47,
+                        1.0, 1.0, 1, 1.0, 0.9, 1.0, 1, 1, simd, layout, stencil);
+  build();
+}
+
+CellBench::~CellBench(void) {
+  delete model;
+}
+
+void CellBench::build(void) {
+  CellModel* m = model;
+  m->distribute();
+  distributed.assign(m->cells.state, m->cells.state + m->numCells);
+  m->setup();
+
+  // wet cells get a fixed concentration pattern
+  const u32 zWet = (structure == eBenchWet) ? 0 : (m->cubeLength >> 1);
+  for(u32 p=0; p<m->numCellsToProcess; p++) {
+    const u32 idx = m->cellsToProcess[p];
+    u32 x, y, z;
+    m->idxToSub(idx, &x, &y, &z);
+    if ((m->cells.state[idx] != eStateBound) && (m->cells.state[idx] != eStatePoly) && (z >= zWet)) {
+      m->cells.state[idx] = eStateWet;
+      m->cells.concentration[eStateDrug][idx] = (f64)(idx % 7) / 7.0;
+      m->cells.concentration[eStateEx][idx] = (f64)(idx % 5) / 5.0;
+    }
+  }
+  m->initFrontier();
+  memcpy(m->cellsUpdate.state, m->cells.state, m->numCells * sizeof(u8));
+  memcpy(m->cellsUpdate.concentration[0], m->cells.concentration[0], m->numCells * sizeof(conc_t));
+  memcpy(m->cellsUpdate.concentration[1], m->cells.concentration[1], m->numCells * sizeof(conc_t));
+
+  const u8 wet[] = { eStateWet };
+  const u8 diffusing[] = { eStateWet, eStateBound };
+  const u8 dry[] = { eStateDrug, eStateEx, eStateVoid };
+  collect(wetList, wet, 1);
+  collect(diffuseList, diffusing, 2);
+  collect(dryList, dry, 3);
+}
+
+void CellBench::collect(vector<u32>& list, const u8* states, const u32 numStates) {
+  list.clear();
+  for(u32 f=0; f<model->numFrontier; f++) {
+    const u32 p = model->frontier[f];
+    const u8 s = model->cells.state[model->cellsToProcess[p]];
+    for(u32 i=0; i<numStates; i++) {
+      if (s == states[i]) { list.push_back(p); }
+    }
+  }
+}
+
+void CellBench::time(BenchResult& r, void (*fn)(CellBench* b)) {
+  // one untimed pass to warm the caches
+  fn(this);
+  r.seconds.clear();
+  for(u32 i=0; i<reps; i++) {
+    const f64 t0 = now();
+    fn(this);
+    r.seconds.push_back(now() - t0);
+  }
+}
+
+//------ kernels
+template<class S> void CellBench::bench_diffuse(CellBench* b) {
+  f64 mass = 0.0;
+  for(u32 k=0; k<b->diffuseList.size(); k++) {
+    b->model->diffuse<S>(b->diffuseList[k], &mass);
+  }
+  b->sink += mass;
+}
+
+void CellBench::bench_diffuse_wet(CellBench* b) {
+  CellModel* m = b->model;
+  f64 mass = 0.0;
+  for(u32 k=0; k<b->wetList.size(); k+=WET_BATCH) {
+    const u32 n = min((u32)WET_BATCH, (u32)(b->wetList.size() - k));
+    mass += (m->*(m->diffuseWet))(&(b->wetList[k]), n);
+  }
+  b->sink += mass;
+}
+
+template<class S> void CellBench::bench_dissolve(CellBench* b) {
+  f64 mass = 0.0;
+  for(u32 k=0; k<b->dryList.size(); k++) {
+    b->sink += b->model->dissolve<S>(b->dryList[k], &mass);
+  }
+  b->sink += mass;
+}
+
+void CellBench::bench_continue(CellBench* b) {
+  f64 mass = 0.0;
+  for(u32 k=0; k<b->dryList.size(); k++) {
+    b->sink += b->model->continueDissolve(b->dryList[k], &mass);
+  }
+  b->sink += mass;
+}
+
+void CellBench::bench_drug_mass(CellBench* b) {
+  b->sink += b->model->calcDrugMass(0, b->model->numCellsToProcess);
+}
+
+void CellBench::bench_find(CellBench* b) {
+  b->model->findCellsToProcess();
+}
+
+void CellBench::bench_distribute(CellBench* b) {
+  b->model->distribute();
+}
+
+void CellBench::bench_compress(CellBench* b) {
+  CellModel* m = b->model;
+  // compression works in place, so every pass starts from the distribution;
+  // the copy is small next to the pass and is timed with it
+  memcpy(m->cells.state, &(b->distributed[0]), m->numCells);
+  m->compress();
+}
+
+void CellBench::run(void) {
+  CellModel* m = model;
+  const u32 cube = m->cubeLength;
+  const char* name = structureNames[structure];
+  const f64 perCell = sizeof(u8) + 2 * sizeof(conc_t);
+  const f64 neighbors = m->numNeighbors * perCell;
+  const bool s26 = (m->stencil == eStencil26);
+  BenchResult r;
+
+  // the frontier kernels write only the update buffer (and dissolution
+  // counters), so repetitions see the same input
+  r.kernel = "diffuse";
+  r.cells = diffuseList.size();
+  r.bytesPerCell = 2 * sizeof(u32) + 2 * perCell + neighbors;
+  time(r, s26 ? &CellBench::bench_diffuse<Stencil26> : &CellBench::bench_diffuse<Stencil6>);
+  print_result(name, cube, r);
+
+  static const char* simdNames[] = { "diffuseWet:auto", "diffuseWet:scalar", "diffuseWet:avx2", "diffuseWet:avx512" };
+  r.kernel = simdNames[m->simdLevel];
+  r.cells = wetList.size();
+  time(r, &CellBench::bench_diffuse_wet);
+  print_result(name, cube, r);
+
+  r.kernel = "dissolve";
+  r.cells = dryList.size();
+  r.bytesPerCell = 2 * sizeof(u32) + 2 * perCell + sizeof(f64) + neighbors;
+  time(r, s26 ? &CellBench::bench_dissolve<Stencil26> : &CellBench::bench_dissolve<Stencil6>);
+  print_result(name, cube, r);
+
+  // dry frontier cells, relabeled as dissolving for the duration
+  vector<u8> saved(dryList.size());
+  for(u32 k=0; k<dryList.size(); k++) {
+    u8* const s = &(m->cells.state[m->cellsToProcess[dryList[k]]]);
+    saved[k] = *s;
+    *s = (*s == eStateEx) ? eStateDissEx : eStateDissDrug;
+  }
+  r.kernel = "continueDissolve";
+  r.bytesPerCell = 2 * sizeof(u32) + 2 * perCell + 2 * sizeof(u16) + sizeof(u16) + sizeof(f64);
+  time(r, &CellBench::bench_continue);
+  print_result(name, cube, r);
+  for(u32 k=0; k<dryList.size(); k++) {
+    m->cells.state[m->cellsToProcess[dryList[k]]] = saved[k];
+  }
+
+  r.kernel = "calcDrugMass";
+  r.cells = m->numCellsToProcess;
+  r.bytesPerCell = sizeof(u32) + sizeof(u8) + sizeof(conc_t);
+  time(r, &CellBench::bench_drug_mass);
+  print_result(name, cube, r);
+
+  // setup steps run over the whole grid
+  r.kernel = "findCellsToProcess";
+  r.cells = m->numCells;
+  r.bytesPerCell = (1 + m->numNeighbors) * sizeof(u8);
+  time(r, &CellBench::bench_find);
+  print_result(name, cube, r);
+
+  r.kernel = "distribute";
+  r.bytesPerCell = sizeof(u8);
+  time(r, &CellBench::bench_distribute);
+  print_result(name, cube, r);
+
+  r.kernel = "compress";
+  r.bytesPerCell = 2 * sizeof(u8);
+  time(r, &CellBench::bench_compress);
+  print_result(name, cube, r);
+}
+
+//------ main
+int main(const int argc, char* const* argv) {
+  static struct option long_options[] = {
+    {"diameter", required_argument, 0, 'n'},
+    {"reps",     required_argument, 0, 'r'},
+    {"simd",     required_argument, 0, 'm'},
+    {"layout",   required_argument, 0, 'L'},
+    {"stencil",  required_argument, 0, 'N'},
+    {0, 0, 0, 0}
+  };
+  vector<f64> sizes;
+  u32 reps = BENCH_REPS;
+  u8 simd = eSimdAuto;
+  u8 layout = eLayoutLinear;
+  u8 stencil = eStencil6;
+  int opt_idx = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:r:m:L:N:", long_options, &opt_idx)) != -1) {
+    switch(opt) {
+      case 'n':
+        sizes.push_back(atof(optarg));
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'm':
+        simd = atoi(optarg);
+        break;
+      case 'L':
+        layout = atoi(optarg);
+        break;
+      case 'N':
+        stencil = atoi(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+  if (sizes.empty()) {
+    sizes.assign(defaultSizes, defaultSizes + BENCH_NUM_DEFAULT_SIZES);
+  }
+  if (reps < 1) { reps = 1; }
+
+  static const char* layoutNames[] = { "linear", "brick", "morton", "sparse" };
+  printf("%d repetitions per kernel, %s layout, %d neighbors; times in ns per cell visited\n", (int)reps,
+         layoutNames[layout <= eLayoutSparse ? layout : (u8)eLayoutLinear], (stencil == eStencil26) ? 26 : 6);
+  printf("%-6s %5s  %-18s %10s %10s %8s %10s %8s\n",
+         "struct", "cube", "kernel", "cells", "mean", "sd", "min", "GB/s");
+  for(u32 i=0; i<sizes.size(); i++) {
+    for(u32 s=0; s<eNumBenchStructures; s++) {
+      CellBench bench((eBenchStructure)s, sizes[i], reps, simd, layout, stencil);
+      bench.run();
+    }
+  }
+  return 0;
+}
@@ -5,26 +5,16 @@
  *  Created by Ezra Buchla on 10/6/11.
  */
 
-#if USE_BOOST
-#include <boost/thread.hpp>
-#endif
-
 #include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include "CellModel.hpp"
+#include "Profile.hpp"
+#include "Slab.hpp"
 
-//================================================================
-//================================================================
-//======= Cell
-Cell::Cell(u32 i) {
-  state = eStateDummy;
-  idx = i;
-  concentration[0] = 0.0;
-  concentration[1] = 0.0;
-}
-
-Cell::~Cell() {
-}
+using namespace std;
 
 //================================================================
 //================================================================
@@ -40,48 +30,287 @@ const f64 CellModel::dissNSteps[7] = {
 	10, 10, 10, 10, 10, 10, 10
 };
 
+// spread the low 21 bits of v to every third bit, and back
+static u64 spread3(u64 v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x1f00000000ffffULL;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+  v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+  v = (v | (v << 2)) & 0x1249249249249249ULL;
+  return v;
+}
+
+static u64 compact3(u64 v) {
+  v &= 0x1249249249249249ULL;
+  v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+  v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+  v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+  v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+  v = (v ^ (v >> 32)) & 0x1fffff;
+  return v;
+}
+
+// per-axis index offsets: every layout is a sum of one term per axis
+void CellModel::initLayout(void) {
+  if (layout > eLayoutSparse) { layout = eLayoutLinear; }
+  storageLength = cubeLength;
+  if ((layout == eLayoutBrick) || (layout == eLayoutSparse)) {
+    storageLength = (cubeLength + BRICK_LENGTH - 1) & ~(BRICK_LENGTH - 1);
+  }
+  if (layout == eLayoutMorton) {
+    storageLength = 1;
+    while (storageLength < cubeLength) { storageLength <<= 1; }
+  }
+  const u32 bricks = storageLength >> BRICK_BITS;
+  for(u8 a=0; a<3; a++) {
+    layoutIdx[a] = new u32 [cubeLength];
+    for(u32 v=0; v<cubeLength; v++) {
+      switch(layout) {
+        case eLayoutBrick:
+        case eLayoutSparse: {
+          // brick coordinate, and coordinate within the brick
+          u64 brick = v >> BRICK_BITS;
+          for(u8 b=0; b<a; b++) { brick *= bricks; }
+          layoutIdx[a][v] = (u32)((brick << (3 * BRICK_BITS)) + ((u64)(v & (BRICK_LENGTH - 1)) << (a * BRICK_BITS)));
+          break;
+        }
+        case eLayoutMorton:
+          layoutIdx[a][v] = (u32)(spread3(v) << a);
+          break;
+        default: {
+          u64 stride = 1;
+          for(u8 b=0; b<a; b++) { stride *= cubeLength; }
+          layoutIdx[a][v] = (u32)(v * stride);
+          break;
+        }
+      }
+    }
+  }
+  // neighbor strides
+  u64 stride = 1;
+  u64 brick = (u64)1 << (3 * BRICK_BITS);
+  for(u8 a=0; a<3; a++) {
+    nbrOffset[2 * a] = (u32)stride;
+    nbrOffset[2 * a + 1] = (u32)0 - (u32)stride;
+    stride *= cubeLength;
+    brickStep[a] = (u32)brick;
+    brick *= bricks;
+    mortonMask[a] = 0x9249249249249249ULL << a;
+  }
+  for(u8 i=0; i<Stencil26::size; i++) {
+    const u8 j = i + (i >= 13);
+    diagOffset[i] = nbrOffset[0] * (u32)((j % 3) - 1) + nbrOffset[2] * (u32)(((j / 3) % 3) - 1)
+      + nbrOffset[4] * (u32)((j / 9) - 1);
+  }
+  brickSlot = NULL;
+  slotBrick = NULL;
+  slotNeighbor = NULL;
+  numSlotBricks = 0;
+  if (layout == eLayoutSparse) {
+    initSparseBricks(bricks);
+  }
+}
+
+// closest coordinate in [lo, hi] to v
+static u32 clampTo(const u32 v, const u32 lo, const u32 hi) {
+  return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+// store the bricks that may hold tablet cells (the cylinder of distribute()),
+// and a halo of one brick around them; the others share stored brick 0
+void CellModel::initSparseBricks(const u32 bricks) {
+  const u32 cX = cubeLength >> 1;
+  const u32 cubeR2 = (cX-1) * (cX-1);
+  const u32 boundH = cylinderHeight * cubeLength;
+  const u32 loBoundH = max((u32)1, cX - (boundH >> 1));
+  const u32 hiBoundH = cX + (boundH >> 1);
+  const u32 numBricks = bricks * bricks * bricks;
+
+  // bricks with a cell inside the cylinder
+  vector<u8> tablet(numBricks, 0);
+  for(u32 bz=0; bz<bricks; bz++) {
+    const u32 z0 = bz << BRICK_BITS;
+    const u32 z1 = z0 + BRICK_LENGTH - 1;
+    if ((z1 < loBoundH) || (z0 > hiBoundH)) { continue; }
+    for(u32 by=0; by<bricks; by++) {
+      const u32 y0 = by << BRICK_BITS;
+      const u32 dy = clampTo(cX - 1, y0, y0 + BRICK_LENGTH - 1) - (cX - 1);
+      for(u32 bx=0; bx<bricks; bx++) {
+        const u32 x0 = bx << BRICK_BITS;
+        const u32 dx = clampTo(cX - 1, x0, x0 + BRICK_LENGTH - 1) - (cX - 1);
+        tablet[(bz * bricks + by) * bricks + bx] = ((dx * dx) + (dy * dy) < cubeR2);
+      }
+    }
+  }
+
+  // tablet bricks and their neighbors (all 26) are stored, in brick order
+  brickSlot = new u32 [numBricks];
+  vector<u32> stored(1, 0);
+  for(u32 bz=0; bz<bricks; bz++) {
+    for(u32 by=0; by<bricks; by++) {
+      for(u32 bx=0; bx<bricks; bx++) {
+        const u32 b = (bz * bricks + by) * bricks + bx;
+        bool keep = false;
+        for(u32 z=(bz ? bz-1 : 0); z<=min(bz+1, bricks-1) && !keep; z++) {
+          for(u32 y=(by ? by-1 : 0); y<=min(by+1, bricks-1) && !keep; y++) {
+            for(u32 x=(bx ? bx-1 : 0); x<=min(bx+1, bricks-1) && !keep; x++) {
+              keep = tablet[(z * bricks + y) * bricks + x];
+            }
+          }
+        }
+        brickSlot[b] = keep ? stored.size() : 0;
+        if (keep) { stored.push_back(b); }
+      }
+    }
+  }
+  numSlotBricks = stored.size();
+  slotBrick = new u32 [numSlotBricks];
+  memcpy(slotBrick, &(stored[0]), numSlotBricks * sizeof(u32));
+
+  // the exterior brick is its own neighbor, as is anything past the cube
+  slotNeighbor = new u32 [numSlotBricks * NUM_FACES];
+  for(u8 i=0; i<NUM_FACES; i++) {
+    slotNeighbor[i] = 0;
+  }
+  for(u32 s=1; s<numSlotBricks; s++) {
+    const u32 b = slotBrick[s];
+    const u32 c[3] = { b % bricks, (b / bricks) % bricks, b / (bricks * bricks) };
+    u32 stride = 1;
+    for(u8 a=0; a<3; a++) {
+      slotNeighbor[s * NUM_FACES + 2 * a] = (c[a] + 1 < bricks) ? brickSlot[b + stride] : 0;
+      slotNeighbor[s * NUM_FACES + 2 * a + 1] = (c[a] > 0) ? brickSlot[b - stride] : 0;
+      stride *= bricks;
+    }
+  }
+}
+
 // index <-> coordinate conversion
 u32 CellModel::subToIdx(const u32 x,
                         const u32 y, 
                         const u32 z) {
-  return cubeLength*(z*cubeLength + y) + x;
+  const u32 idx = layoutIdx[0][x] + layoutIdx[1][y] + layoutIdx[2][z];
+  if (layout == eLayoutSparse) {
+    return (brickSlot[idx / BRICK_CELLS] * BRICK_CELLS) | (idx & (BRICK_CELLS - 1));
+  }
+  return idx;
 }
 
 void CellModel::idxToSub(u32 idx, 
                          u32* pX, 
                          u32* pY, 
-                         u32* pZ) {
-  *pX = idx % cubeLength;
-  *pY = (idx / cubeLength) % cubeLength;
-  *pZ = (idx / cubeLength2) % cubeLength;
+                         u32* pZ) const {
+  if (layout == eLayoutSparse) {
+    // (cells of the exterior brick get the coordinates of brick 0)
+    idx = (slotBrick[idx / BRICK_CELLS] * BRICK_CELLS) | (idx & (BRICK_CELLS - 1));
+  }
+  switch(layout) {
+    case eLayoutBrick:
+    case eLayoutSparse: {
+      const u32 bricks = storageLength >> BRICK_BITS;
+      const u32 brick = idx >> (3 * BRICK_BITS);
+      const u32 inner = idx & ((1 << (3 * BRICK_BITS)) - 1);
+      *pX = ((brick % bricks) << BRICK_BITS) | (inner & (BRICK_LENGTH - 1));
+      *pY = (((brick / bricks) % bricks) << BRICK_BITS) | ((inner >> BRICK_BITS) & (BRICK_LENGTH - 1));
+      *pZ = ((brick / (bricks * bricks)) << BRICK_BITS) | (inner >> (2 * BRICK_BITS));
+      break;
+    }
+    case eLayoutMorton:
+      *pX = (u32)compact3(idx);
+      *pY = (u32)compact3(idx >> 1);
+      *pZ = (u32)compact3(idx >> 2);
+      break;
+    default:
+      *pX = idx % cubeLength;
+      *pY = (idx / cubeLength) % cubeLength;
+      *pZ = (idx / cubeLength2) % cubeLength;
+      break;
+  }
+}
+
+u32 CellModel::linearIdx(const u32 idx) {
+  if (layout == eLayoutLinear) { return idx; }
+  u32 x, y, z;
+  idxToSub(idx, &x, &y, &z);
+  return cubeLength * (z * cubeLength + y) + x;
+}
+
+void CellModel::copyLinear(u8* state, f64* drug, f64* ex) {
+  if ((layout == eLayoutLinear) && (sizeof(conc_t) == sizeof(f64))) {
+    memcpy(state, cells.state, numCells * sizeof(u8));
+    memcpy(drug, cells.concentration[eStateDrug], numCells * sizeof(f64));
+    memcpy(ex, cells.concentration[eStateEx], numCells * sizeof(f64));
+    return;
+  }
+  u64 i = 0;
+  for(u32 z=0; z<cubeLength; z++) {
+    for(u32 y=0; y<cubeLength; y++) {
+      const u32 yz = layoutIdx[1][y] + layoutIdx[2][z];
+      for(u32 x=0; x<cubeLength; x++, i++) {
+        const u32 idx = (layout == eLayoutSparse) ? subToIdx(x, y, z) : (layoutIdx[0][x] + yz);
+        state[i] = cells.state[idx];
+        drug[i] = cells.concentration[eStateDrug][idx];
+        ex[i] = cells.concentration[eStateEx][idx];
+      }
+    }
+  }
 }
 
 
 // populate neighbor index array
-void CellModel::findNeighbors(Cell* cell) {
+void CellModel::findNeighbors(const u32 idx, u32* nIdx) const {
   u32 x, y, z;
-  idxToSub(cell->idx, &x, &y, &z);
+  idxToSub(idx, &x, &y, &z);
   if ( (x==0) || (y==0) || (z==0)
       || (x > (cubeLength-2))
       || (y > (cubeLength-2))
       || (z > (cubeLength-2)) ) {
-    // these are cells on the extreme boundary of the cube...
-    // hopefully their neighbor indices should not be used
-    for(u8 i=0; i<NUM_NEIGHBORS; i++) {
-      cell->neighborIdx[i] = 0;
+    // these are cells on the extreme boundary of the cube,
+    // which are bound and never active: point them all at cell 0
+    for(u8 i=0; i<numNeighbors; i++) {
+      nIdx[i] = 0;
     }
-  } else { 
-#if DIAG_NEIGHBORS
-		//...
-#else
-    cell->neighborIdx[0] = subToIdx(x+1,  y,    z);
-    cell->neighborIdx[1] = subToIdx(x-1,  y,    z);
-    cell->neighborIdx[2] = subToIdx(x,    y+1,  z);
-    cell->neighborIdx[3] = subToIdx(x,    y-1,  z);
-    cell->neighborIdx[4] = subToIdx(x,    y,    z+1);
-    cell->neighborIdx[5] = subToIdx(x,    y,    z-1);
-  }
-#endif
+  } else if (stencil == eStencil26) {
+    neighbors<Stencil26>(idx, nIdx);
+  } else {
+    neighbors<Stencil6>(idx, nIdx);
+  }
+}
+
+// allocate a cell buffer with one plane per field
+void CellModel::allocBuffer(CellBuffer* buf) {
+  // padded so vector gathers may load a whole word at the last state
+  buf->state = new u8 [numCells + STATE_PAD];
+  buf->concentration[0] = new conc_t [numCells];
+  buf->concentration[1] = new conc_t [numCells];
+  // first touched by the threads that will work on it
+  runSetup(&CellModel::clearCells, buf);
+}
+
+// (a slab's buffers start at slabLo)
+void CellModel::freeBuffer(CellBuffer* buf) {
+  delete[] (buf->state + slabLo);
+  delete[] (buf->concentration[0] + slabLo);
+  delete[] (buf->concentration[1] + slabLo);
+}
+
+// bytes of cell data: both buffers plus per-active-cell data
+u64 CellModel::cellMemory(void) {
+  const u64 perCell = sizeof(u8) + 2 * sizeof(conc_t);
+  u64 perActive = sizeof(u32) * 2
+    + 2 * sizeof(u16) + 3 * sizeof(f64);
+  if (stepMultiple > 1) {
+    perActive += 4 * sizeof(u32) + numNeighbors * sizeof(u32) + sizeof(u8) + 16 * sizeof(f64);
+  }
+  u64 bricks = 0;
+  if (sleepTol > 0.0) {
+    perActive += 2 * sizeof(u32);
+    bricks = (u64)numSleepBricks * (3 * sizeof(u8) + threads->numThreads * sizeof(f64)
+                                   + sizeof(u64) + sizeof(u32));
+  }
+  const u64 rows = (stepMultiple > 1) ? sizeof(u32) * (u64)numCells : 0;
+  const u64 held = (slabs != NULL) ? (u64)(slabHi - slabLo) : (u64)numCells;
+  return (2 * perCell * held) + (perActive * (u64)numCellsToProcess) + bricks + rows;
 }
 
 //------ c-tor
@@ -100,11 +329,14 @@ CellModel::CellModel(
                      f64 polyshellbalance,
                      f64 bounddiffrate,
                      f64 dissScale,
-		     u8 compressflag
+		     u8 compressflag,
+                     u32 numthreads,
+                     u8 simd,
+                     u8 gridlayout,
+                     u8 nbrstencil,
+                     f64 sleeptol,
+                     u32 stepmultiple
                      ) :
-#if USE_BOOST
-rngEngine(), rngDist(0.f, 1.f),
-#endif
 cubeLength(n),
 cylinderHeight(h),
 cellLength(cl),
@@ -122,10 +354,15 @@ boundDiff(bounddiffrate),
 dissratescale(dissScale),
 dissProbDrug(dprobdrug),
 dissProbEx(dprobex),
-compressFlag(compressflag)
+compressFlag(compressflag),
+sleepTol((sleeptol > 0.0) ? sleeptol : 0.0),
+stepMultiple((stepmultiple > 1) ? stepmultiple : 1),
+rngSeed(seed),
+iterationNum(0)
 {
 
-  
+  layout = (eGridLayout)gridlayout;
+  stencil = (nbrstencil == eStencil26) ? eStencil26 : eStencil6;
 
   if(this->compressFlag) {
     cellLength *= 0.5;
@@ -134,241 +371,542 @@ compressFlag(compressflag)
  
   
   cubeLength2 = cubeLength * cubeLength;
-  numCells = cubeLength * cubeLength * cubeLength;
+  numNeighbors = stencil;
+  // implicit steps update every wet cell together, so none of them sleep
+  if (stepMultiple > 1) {
+    sleepTol = 0.0;
+  }
+  // padded to whole bricks, or to a power of two for z-order
+  initLayout();
+  numCells = storageLength * storageLength * storageLength;
+  if (layout == eLayoutSparse) {
+    numCells = numSlotBricks * BRICK_CELLS;
+  }
+  // sleeping bricks, if turned on
+  sleepBricks = 0;
+  numSleepBricks = 0;
+  brickAwake = NULL;
+  brickChange = NULL;
+  brickNear = NULL;
+  brickSleptAt = NULL;
+  sleepSlotStart = NULL;
+  numSleepCells = 0;
+  sleepSkipped = 0;
+  sleepVisited = 0;
+  sleepBound = 0.0;
+  sleepMaxSteps = 0;
   
+  // start the iteration threads (setup runs on them too)
+  threads = new ThreadPool(numthreads);
   // allocate cell memory 
-  cells =				new Cell* [numCells];
-  cellsUpdate =		new Cell* [numCells];
-  cellsToProcess =	new u32 [numCells];
-  
-  for(u32 i=0; i<numCells; i++) {
-    cells[i] =			new Cell(i);
-    cellsUpdate[i] =	new Cell(i);
-  }
-  // seed the random number engine
-#if USE_BOOST
-  rngEngine.seed(seed);
-  rngGen = new boost::variate_generator<rng_t, dist_t> (rngEngine, rngDist);
-#else
-  srand((u32)seed);
-#endif
+  allocBuffer(&cells);
+  allocBuffer(&cellsUpdate);
+  // the shared exterior brick reads as boundary, with no concentration
+  for(u32 i=0; isExterior(i); i++) {
+    cells.state[i] = eStateBound;
+    cellsUpdate.state[i] = eStateBound;
+  }
+  // per-active-cell data is allocated once the active cells are known
+  cellsToProcess = NULL;
+  rngIdx = NULL;
+  dissCount = NULL;
+  dissSteps = NULL;
+  dissInc = NULL;
+  diffMul = NULL;
+  dissProb = NULL;
+  slotSleepBrick = NULL;
+  sleepSlots = NULL;
+  rowSlot = NULL;
+  cellRow = NULL;
+  rowNbr = NULL;
+  rowNw = NULL;
+  rowDecay = NULL;
+  cgX = NULL;
+  cgR = NULL;
+  cgR0 = NULL;
+  cgP = NULL;
+  cgPHat = NULL;
+  cgV = NULL;
+  cgSHat = NULL;
+  cgT = NULL;
+  cgPartial = NULL;
+  rowMass = NULL;
+  wetAt = NULL;
+  numSpreadAdd = 0;
+  spreadMass = 0.0;
+  numRows = 0;
+  numRowChunks = 0;
+  implicitSolves = 0;
+  implicitIters = 0;
+  massPartial = NULL;
+  numMassChunks = 0;
+  frontier = NULL;
+  frontierAdd = NULL;
+  inFrontier = NULL;
+  numFrontier = 0;
+  profile = NULL;
+  slabs = NULL;
+  slabZ0 = 0;
+  slabZ1 = cubeLength;
+  slabLo = 0;
+  slabHi = numCells;
+  slabBuf = NULL;
+  // pick the diffusion kernel for this CPU
+  selectDiffuseKernel(simd);
+  frontierKept = new u32 [threads->numThreads];
+  frontierStart = new u32 [threads->numThreads];
+  wakeList = new vector<u32> [threads->numThreads];
+  implicitRows = new vector<u32> [threads->numThreads];
+  if (sleepTol > 0.0) {
+    allocSleep();
+  }
 }
 
 //------ d-tor
 CellModel::~CellModel() {
-  for(u32 i=0; i<numCells; i++) {
-    delete(cells[i]);
-    delete(cellsUpdate[i]);
-  }
-  delete cells;
-  delete cellsUpdate;
-  delete cellsToProcess;
-#if USE_BOOST
-  delete rngGen;
-#endif
+  freeBuffer(&cells);
+  freeBuffer(&cellsUpdate);
+  freeSlots();
+  for(u8 a=0; a<3; a++) {
+    delete[] layoutIdx[a];
+  }
+  delete[] brickSlot;
+  delete[] slotBrick;
+  delete[] slotNeighbor;
+  delete[] brickAwake;
+  delete[] brickChange;
+  delete[] brickNear;
+  delete[] brickSleptAt;
+  delete[] sleepSlotStart;
+  delete threads;
+  delete[] frontierKept;
+  delete[] frontierStart;
+  delete[] wakeList;
+  delete[] implicitRows;
+  delete[] slabBuf;
 }
 
 //------- dissolve
-eCellState CellModel::dissolve(const Cell* const cell) {
-  u8 nw = 0;      // number of wet neighbors
-  u8 np = 0;      // number of polymer neighbors 
-  f64 sumC = 0.f; // sum of neighbor concentrations
+template<class S> bool CellModel::dissolve(const u32 p, f64* pMass) {
+  const u32 idx = cellsToProcess[p];
+  u32 nIdx[S::size];
+  neighbors<S>(idx, nIdx);
+  const u8 state = cells.state[idx];
+  u8 nw = 0;         // number of wet neighbors
+  calc_t sumC = 0.f; // sum of neighbor concentrations
   
-	// count the wet/boundary neighbors
-  for(u8 i = 0; i < NUM_NEIGHBORS; i++) {
-    if ((cells[cell->neighborIdx[i]]->state == eStateWet) || (cells[cell->neighborIdx[i]]->state == eStateBound)) {
-      nw++;
-    }
-  }
-  // return early if there are no wet neighbors
+  // dry cells carry their data over unless they start dissolving
+  cellsUpdate.state[idx] = state;
+  cellsUpdate.concentration[0][idx] = cells.concentration[0][idx];
+  cellsUpdate.concentration[1][idx] = cells.concentration[1][idx];
+
+	// count the wet/boundary face neighbors; the dissolution chance only
+	// looks at faces, so it doesn't change with the stencil
+  const u32 classes = neighborClasses<S>(nIdx);
+  const u32 wet = classMask<S>(classes, eClassWet) & S::faceLowBits();
+  nw = __builtin_popcountl(wet | (classMask<S>(classes, eClassBound) & S::faceLowBits()));
+  // return early if there are no wet neighbors;
+  // nothing can happen here until one of them gets wet
   if (nw == 0) {
-    return cellsUpdate[cell->idx]->state;
+    return false;
   }
 	
   // compare dry-neighbor states with this cell's state
-  for(u8 i = 0; i < NUM_NEIGHBORS; i++) {
-    if (cells[cell->neighborIdx[i]]->state == eStateWet) {
-      sumC += cells[cell->neighborIdx[i]]->concentration[cell->state];
+  // (void cells have no matching species, so they see zero concentration)
+  if (state <= eStateEx) {
+    for(u8 i = 0; i < S::size; i++) {
+      if ((wet >> (CLASS_BITS * i)) & 1) {
+        sumC += cells.concentration[state][nIdx[i]];
+      }
     }
   }
   
-  // dissolve randomly
-  if (getRand() < ((1 - (sumC / (f64)nw)) * cell->dissProb)) {
-    if (cell->state == eStateDrug) {
-      cellsUpdate[cell->idx]->state = eStateDissDrug;
-      cellsUpdate[cell->idx]->dissCount = 0;
+  // dissolve randomly; an implicit step gets stepMultiple chances
+  const f64 prob = (1 - (sumC / (f64)nw)) * dissProb[p];
+  if (stepMultiple > 1) {
+    dissolveFrom(p, prob, 0, pMass);
+    return true;
+  }
+  if (getRand(eRandDissolve, iterationNum, rngIdx[p]) < prob) {
+    if (state == eStateDrug) {
+      cellsUpdate.state[idx] = eStateDissDrug;
+      dissCount[p] = 0;
     }
-    if (cell->state == eStateEx) {
-      cellsUpdate[cell->idx]->state = eStateDissEx;
-      cellsUpdate[cell->idx]->dissCount = 0;
+    if (state == eStateEx) {
+      cellsUpdate.state[idx] = eStateDissEx;
+      dissCount[p] = 0;
     }
-    if (cell->state == eStateVoid) {
-      cellsUpdate[cell->idx]->state = eStateWet;
+    if (state == eStateVoid) {
+      cellsUpdate.state[idx] = eStateWet;
+      // wet cells count their drug concentration
+      *pMass += cells.concentration[eStateDrug][idx];
     }		
   }
-  return cellsUpdate[cell->idx]->state;
+  return true;
 }
 
 
 // continue dissolution for partially-wetted cells
-eCellState CellModel::continueDissolve(const Cell* const cell) {
-  cellsUpdate[cell->idx]->dissCount++;
+eCellState CellModel::continueDissolve(const u32 p, f64* pMass) {
+  const u32 idx = cellsToProcess[p];
+  const u8 state = cells.state[idx];
   // FIXME: (?) careful, this concentration index is a nasty enum hack
-  cellsUpdate[cell->idx]->concentration[cell->state - 2] = cells[cell->idx]->concentration[cell->state - 2] + cell->dissInc;
-  if(cellsUpdate[cell->idx]->dissCount >= cell->dissSteps) {
-    cellsUpdate[cell->idx]->state = eStateWet;
+  const u8 species = state - 2;
+  // an implicit step covers stepMultiple steps of dissolution
+  const u16 n = ((stepMultiple > 1) && (dissSteps[p] > dissCount[p]))
+    ? (u16)min((u32)(dissSteps[p] - dissCount[p]), stepMultiple) : 1;
+  dissCount[p] += n;
+  cellsUpdate.concentration[species ^ 1][idx] = cells.concentration[species ^ 1][idx];
+  cellsUpdate.concentration[species][idx] = cells.concentration[species][idx] + n * dissInc[p];
+  cellsUpdate.state[idx] = (dissCount[p] >= dissSteps[p]) ? (u8)eStateWet : state;
+  if ((stepMultiple > 1) && (cellsUpdate.state[idx] == eStateWet)) {
+    wetAt[p] = n;
   }
-  return cellsUpdate[cell->idx]->state;
+  if (cellsUpdate.state[idx] == eStateWet) {
+    // dissolving drug counts as a whole cell, wet cells count their drug concentration
+    *pMass += cellsUpdate.concentration[eStateDrug][idx] - ((state == eStateDissDrug) ? 1.0 : 0.0);
+  }
+  return (eCellState)cellsUpdate.state[idx];
 }
 
 
+// exponentially decayed boundary concentration, saturating low
+inline calc_t CellModel::decayBound(const calc_t c) {
+  const calc_t d = c * (calc_t)boundDiff;
+  // denormal and saturate low
+  return (d < (calc_t)0.000000000001) ? (calc_t)0.0 : d;
+}
+
 // calculate diffusion for fully-dissolved cells
-void CellModel::diffuse(const Cell* const cell) {
-  f64 cSumDrug = 0.f;
-  f64 cSumEx = 0.f;
+template<class S> bool CellModel::diffuse(const u32 p, f64* pMass) {
+  const u32 idx = cellsToProcess[p];
+  u32 nIdx[S::size];
+  neighbors<S>(idx, nIdx);
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  calc_t cSumDrug = 0.f;
+  calc_t cSumEx = 0.f;
   u8 nw = 0;
+
+  // wet and boundary cells never change state
+  cellsUpdate.state[idx] = cells.state[idx];
 	
-	if (cell->state == eStateBound) {
-	  for(u8 i=0; i<NUM_NEIGHBORS; i++) {
-      if ((cells[cell->neighborIdx[i]]->state == eStateWet)) {
+	if (cells.state[idx] == eStateBound) {
+	  UNROLL_NEIGHBORS
+	  for(u8 i=0; i<S::size; i++) {
+      if ((cells.state[nIdx[i]] == eStateWet)) {
         nw++;
-        cSumDrug += cells[cell->neighborIdx[i]]->concentration[eStateDrug];
-        cSumEx += cells[cell->neighborIdx[i]]->concentration[eStateEx];
+        cSumDrug += cDrug[nIdx[i]];
+        cSumEx += cEx[nIdx[i]];
       }
 	  }
 	} else {
-	  for(u8 i=0; i<NUM_NEIGHBORS; i++) {
-      if ((cells[cell->neighborIdx[i]]->state == eStateWet) || (cells[cell->neighborIdx[i]]->state == eStateBound)) {
+	  UNROLL_NEIGHBORS
+	  for(u8 i=0; i<S::size; i++) {
+      if (cells.state[nIdx[i]] == eStateWet) {
+        nw++;
+        cSumDrug += cDrug[nIdx[i]];
+        cSumEx += cEx[nIdx[i]];
+      } else if (cells.state[nIdx[i]] == eStateBound) {
         nw++;
-        cSumDrug += cells[cell->neighborIdx[i]]->concentration[eStateDrug];
-        cSumEx += cells[cell->neighborIdx[i]]->concentration[eStateEx];
+        // boundary cells behind this one (-x, -y, -z for the faces)
+        // are seen after their exponential decay, as in a serial sweep
+        // in index order; the decay itself is never stored.
+        if (S::behind(i)) {
+          cSumDrug += decayBound(cDrug[nIdx[i]]);
+          cSumEx += decayBound(cEx[nIdx[i]]);
+        } else {
+          cSumDrug += cDrug[nIdx[i]];
+          cSumEx += cEx[nIdx[i]];
+        }
       }
 	  }
    }
   
-  // no wet neighbors => no effect
-  if (nw == 0) { return; }
-  
-  cellsUpdate[cell->idx]->concentration[eStateDrug] = cell->concentration[eStateDrug]
-    + ((cSumDrug - (nw * cell->concentration[eStateDrug])) * dDrug);
+  // no wet neighbors => no effect, until one of them gets wet
+  if (nw == 0) {
+    cellsUpdate.concentration[eStateDrug][idx] = cDrug[idx];
+    cellsUpdate.concentration[eStateEx][idx] = cEx[idx];
+    return false;
+  }
   
-  cellsUpdate[cell->idx]->concentration[eStateEx] = cell->concentration[eStateEx]
-    + ((cSumEx - (nw * cell->concentration[eStateEx])) * dEx);
+  // c + (sum - nw*c) * d, fused exactly as in the SIMD kernels (Diffuse.cpp)
+  cellsUpdate.concentration[eStateDrug][idx] =
+    std::fma(std::fma(-(calc_t)nw, (calc_t)cDrug[idx], cSumDrug), (calc_t)dDrug, (calc_t)cDrug[idx]);
   
-  ////// DEBUG
-  if (cellsUpdate[cell->idx]->concentration[eStateDrug] > 1.0) {
-    const f64 conc = cellsUpdate[cell->idx]->concentration[eStateDrug];
-    f64 theconc = conc;
+  cellsUpdate.concentration[eStateEx][idx] =
+    std::fma(std::fma(-(calc_t)nw, (calc_t)cEx[idx], cSumEx), (calc_t)dEx, (calc_t)cEx[idx]);
+
+  // only wet cells count toward the remaining drug mass
+  if (cells.state[idx] == eStateWet) {
+    *pMass += (f64)cellsUpdate.concentration[eStateDrug][idx] - cDrug[idx];
   }
-  /////////////
-  
-  // old: 
-  /*
-   cMeanDrug /= nw;
-   cMeanEx /= nw;
-   
-   //   cellsUpdate[cell->idx]->concentration[eStateDrug] = cell->concentration[eStateDrug]
-   //   + (dDrug * nw / cellLength2 * (cMeanDrug - cell->concentration[eStateDrug]) * dt);
-   
-   //    cellsUpdate[cell->idx]->concentration[eStateEx] = cell->concentration[eStateEx]
-   //   + (dEx * nw / cellLength2 * (cMeanEx - cell->concentration[eStateEx]) * dt);
-   
-   // refactored:
-   const f64 tmp = nw * dt_l2;
-   const f64 drugDiff = (dDrug * tmp * (cMeanDrug - cell->concentration[eStateDrug] * cell->diffMul));  
-   
-   cellsUpdate[cell->idx]->concentration[eStateDrug] = cell->concentration[eStateDrug] + drugDiff;
-   
-   cellsUpdate[cell->idx]->concentration[eStateEx] = cell->concentration[eStateEx]
-   + (dEx * tmp * (cMeanEx - cell->concentration[eStateEx]  * cell->diffMul));
-   */   
+  return true;
+}
+
+// exchange current and update buffers
+void CellModel::swapBuffers(void) {
+  CellBuffer tmp = cells;
+  cells = cellsUpdate;
+  cellsUpdate = tmp;
 }
 
 //---------- iterate!!
 f64 CellModel::iterate(void) {
-  Cell* cell;
-  
-  /////// TODO: incorporate threading engine. debugging single-threaded version first...
-	
-  for (u32 i=0; i<numCellsToProcess; i++) {
-    cell = cells[cellsToProcess[i]];
-    switch(cell->state) {
-              case eStateWet:
-        diffuse(cell);
-        break;
-      case eStateVoid:
-        // void cells: dissolve (FIXME?)
-        dissolve(cell);
-        break;
-      case eStateEx:
-      case eStateDrug:
-        // drug or excipient: 
-        dissolve(cell);
-        break;
-      case eStateDissDrug:
-      case eStateDissEx:
-        continueDissolve(cell);
-        break;
-      case eStateBound:
-        diffuse(cell);
-        cell->concentration[0] *= boundDiff; // exponential decay
-        cell->concentration[1] *= boundDiff;
-        // denormal and saturate low
-        if(cell->concentration[0] < 0.000000000001) cell->concentration[0] = 0.0;
-        if(cell->concentration[1] < 0.000000000001) cell->concentration[1] = 0.0;
-        break;
-      case eStatePoly:
-        // shouldn't get here!
-        // polymer cells: no change
-        break;        
-      default:
-        break;
+  // chunks of the frontier, fixed before the frontier changes
+  numMassChunks = (numFrontier + massChunkSize - 1) / massChunkSize;
+  // cells held by sleeping bricks skip this step
+  if (sleepTol > 0.0) {
+    sleepSkipped += numSleepCells;
+    sleepVisited += numFrontier;
+    sleepBound += sleepTol * (f64)numSleepCells;
+  }
+  threads->run(&CellModel::iterate_thr, this);
+  iterationNum++;
+
+  // reduce the change in mass in chunk order
+  const f64 t0 = profile ? Profile::now() : 0.0;
+  for(u32 c=0; c<numMassChunks; c++) {
+    drugMass += massPartial[c];
+  }
+  // then the front carried on through the step, and the implicit step of
+  // the wet cells in row order
+  if (stepMultiple > 1) {
+    drugMass += spreadMass;
+    for(u32 c=0; c<numRowChunks; c++) {
+      drugMass += rowMass[c];
     }
   }
-  
-  ///// TODO: synchronize udpate threads here
-	
-  // update the cell data
-  // FIXME: memcpy() in this function is eating 20% of CPU time.
-  // should be able to just swap pointers
-  // (why doesn't this work?)
-  /*
-   Cell** cellsTmp = cells;
-   cells = cellsUpdate;
-   cellsUpdate = cellsTmp;
-   */
-  
-  for(u32 i=0; i<numCellsToProcess; i++) {
-    *(cells[cellsToProcess[i]]) = *(cellsUpdate[cellsToProcess[i]]);
+  if (profile) { profile->add(eProfMass, Profile::now() - t0); }
+
+  // slabs: bring in the halo, and add up the mass of all slabs in slab order
+  if (slabs != NULL) {
+    const f64 t1 = profile ? Profile::now() : 0.0;
+    exchangeHalo();
+    const f64 mass = slabs->sum(drugMass);
+    if (profile) { profile->add(eProfHalo, Profile::now() - t1); }
+    return drugMassTotal - mass;
   }
-	
-  ///// TODO: synchronize copy threads here
-	
-  calcDrugMass();
   
   return drugMassTotal - drugMass;
   //  return drugMass;
 }
 
-void CellModel::calcDrugMass(void) {
-  // calculate current drug mass
-  // FIXME: this is the slow way to do it.
-  // better to update during the diffusion step, and save a loop
-  Cell* cell;	
-  drugMass = trappedDrugMass;
+void CellModel::iterate_thr(void* ctx, const u32 thr, const u32 numThr) {
+  ((CellModel*)ctx)->iterateThread(thr, numThr);
+}
+
+// each thread owns a contiguous range of whole chunks of the frontier
+void CellModel::iterateThread(const u32 thr, const u32 numThr) {
+  u32 c0, c1;
+  ThreadPool::range(numMassChunks, thr, numThr, &c0, &c1);
+  frontierStart[thr] = min(c0 * massChunkSize, numFrontier);
+
+  // thread 0 times the phases, waits included
+  const bool timed = (profile != NULL) && (thr == 0);
+  f64 t0 = timed ? Profile::now() : 0.0;
+  frontierKept[thr] = (this->*updateCells)(thr, c0, c1);
+  // wait for all updates before committing
+  threads->sync();
+  if (timed) {
+    const f64 t1 = Profile::now();
+    profile->add(eProfUpdate, t1 - t0);
+    t0 = t1;
+  }
+  // implicit steps carry the front on, then diffuse the wet and boundary
+  // cells the update collected. (the solve starts with a sync, so the
+  // other threads wait for the front there)
+  if (stepMultiple > 1) {
+    if (stencil == eStencil26) {
+      if (thr == 0) { spreadFront<Stencil26>(); }
+      solveImplicit<Stencil26>(thr, numThr);
+    } else {
+      if (thr == 0) { spreadFront<Stencil6>(); }
+      solveImplicit<Stencil6>(thr, numThr);
+    }
+    threads->sync();
+    if (timed) {
+      const f64 t1 = Profile::now();
+      profile->add(eProfSolve, t1 - t0);
+      t0 = t1;
+    }
+  }
+  
+  // commit the update: every visited cell has written all of its fields
+  // into the update buffer, so the buffers can simply trade places.
+  // (other cells are identical in both buffers.)
+  if (thr == 0) {
+    swapBuffers();
+    updateFrontier(numThr);
+  }
+  threads->sync();
+  if (timed) { profile->add(eProfCommit, Profile::now() - t0); }
+}
+
+// update frontier chunks [c0, c1), summing the change in drug mass of
+// each chunk and compacting the entries that stay active to the front
+// of the range; returns how many stayed
+template<class S> u32 CellModel::updateCellsStencil(const u32 thr, const u32 c0, const u32 c1) {
+  u32 idx, p;
+  u32 kept = frontierStart[thr];
+  bool keep;
+  // wet cells are batched for the vectorized diffusion kernel
+  u32 wet[WET_BATCH];
+  u32 nWet;
+  f64 dMass;
+  for (u32 c=c0; c<c1; c++) {
+    const u32 f1 = min((c + 1) * massChunkSize, numFrontier);
+    const u32 k0 = kept;
+    nWet = 0;
+    dMass = 0.0;
+    for (u32 f=c*massChunkSize; f<f1; f++) {
+      p = frontier[f];
+      idx = cellsToProcess[p];
+      keep = true;
+      switch(cells.state[idx]) {
+                case eStateWet:
+          if (stepMultiple > 1) {
+            implicitRows[thr].push_back(p);
+            break;
+          }
+          wet[nWet++] = p;
+          if (nWet == WET_BATCH) {
+            dMass += (this->*diffuseWet)(wet, nWet);
+            nWet = 0;
+          }
+          break;
+        case eStateVoid:
+          // void cells: dissolve (FIXME?)
+        case eStateEx:
+        case eStateDrug:
+          // drug or excipient: 
+          keep = dissolve<S>(p, &dMass);
+          if (cellsUpdate.state[idx] == eStateWet) {
+            wakeList[thr].push_back(p);
+          }
+          break;
+        case eStateDissDrug:
+        case eStateDissEx:
+          if (continueDissolve(p, &dMass) == eStateWet) {
+            wakeList[thr].push_back(p);
+          }
+          break;
+        case eStateBound:
+          // exponential decay is applied where neighbors read this cell
+          // (see diffuse()), so the update only depends on the current buffer
+          keep = diffuse<S>(p, &dMass);
+          // implicit steps replace the explicit value after the solve
+          if (keep && (stepMultiple > 1)) {
+            implicitRows[thr].push_back(p);
+          }
+          break;
+        case eStatePoly:
+          // shouldn't get here!
+          // polymer cells: no change
+          break;        
+        default:
+          break;
+      }
+      if (keep) {
+        frontier[kept++] = p;
+      } else {
+        inFrontier[p] = 0;
+      }
+    }
+    // batches end with the chunk, so its sum doesn't depend on threading
+    if (nWet > 0) {
+      dMass += (this->*diffuseWet)(wet, nWet);
+    }
+    massPartial[c] = dMass;
+    // sleeping bricks: how much the chunk's cells changed, while they're in cache
+    if (sleepTol > 0.0) {
+      measureSleep(thr, k0, kept);
+    }
+  }
+  return kept - frontierStart[thr];
+}
+
+// rebuild the frontier after a step: gather the compacted ranges of
+// each thread, then add neighbors of cells that just got wet
+void CellModel::updateFrontier(const u32 numThr) {
+  u32 n = 0;
+  for(u32 t=0; t<numThr; t++) {
+    if (n != frontierStart[t]) {
+      memmove(frontier + n, frontier + frontierStart[t], frontierKept[t] * sizeof(u32));
+    }
+    n += frontierKept[t];
+  }
+
+  // wake candidate neighbors of newly wet cells
+  // (implicit steps: spreadFront() has woken them already)
+  u32 nAdd = numSpreadAdd;
+  numSpreadAdd = 0;
+  u32 nIdx[MAX_NEIGHBORS];
+  for(u32 t=0; t<numThr; t++) {
+    for(u32 w=0; w<wakeList[t].size(); w++) {
+      const u32 idx = cellsToProcess[wakeList[t][w]];
+      if (sleepTol > 0.0) {
+        // keeps the bricks around it awake
+        brickChange[slotSleepBrick[wakeList[t][w]]] = HUGE_VAL;
+      }
+      if (stencil == eStencil26) {
+        neighbors<Stencil26>(idx, nIdx);
+      } else {
+        neighbors<Stencil6>(idx, nIdx);
+      }
+      for(u8 i=0; i<numNeighbors; i++) {
+        const u32 q = findSlot(nIdx[i]);
+        if ((q < numCellsToProcess) && !inFrontier[q]) {
+          inFrontier[q] = 1;
+          frontierAdd[nAdd++] = q;
+        }
+      }
+    }
+    wakeList[t].clear();
+  }
+  if (sleepTol > 0.0) {
+    n = updateSleep(n, &nAdd);
+  }
+
+  numFrontier = mergeFrontier(n, nAdd);
+}
+
+// merge the (sorted) additions, keeping the frontier in slot order
+u32 CellModel::mergeFrontier(const u32 n, const u32 nAdd) {
+  if (nAdd == 0) { return n; }
+  sort(frontierAdd, frontierAdd + nAdd);
+  memcpy(frontier + n, frontierAdd, nAdd * sizeof(u32));
+  inplace_merge(frontier, frontier + n, frontier + n + nAdd);
+  return n + nAdd;
+}
+
+// slot of a cell in cellsToProcess, or numCellsToProcess if it has none
+u32 CellModel::findSlot(const u32 idx) {
+  const u32* const it = lower_bound(cellsToProcess, cellsToProcess + numCellsToProcess, idx);
+  if ((it == cellsToProcess + numCellsToProcess) || (*it != idx)) {
+    return numCellsToProcess;
+  }
+  return it - cellsToProcess;
+}
+
+f64 CellModel::calcDrugMass(const u32 p0, const u32 p1) {
+  // calculate current drug mass from scratch.
+  // (iterate() keeps drugMass up to date from the per-cell changes.)
+  u32 idx;
+  f64 mass = 0.0;
 	
-  for (u32 i=0; i<numCellsToProcess; i++) {
-    cell = cells[cellsToProcess[i]];
-    switch(cell->state) {
+  for (u32 p=p0; p<p1; p++) {
+    idx = cellsToProcess[p];
+    switch(cells.state[idx]) {
       case eStateDrug:
-        drugMass += 1.0;
+        mass += 1.0;
         break;
       case eStateDissDrug:
-        // drugMass += 1.f - (cell->dissInc * cell->dissCount) + cell->concentration[eStateDrug];
-        drugMass += 1.0;
+        // mass += 1.f - (dissInc[p] * dissCount[p]) + cells.concentration[eStateDrug][idx];
+        mass += 1.0;
         break;
       case eStateWet:
-        drugMass += cell->concentration[eStateDrug];
+        mass += cells.concentration[eStateDrug][idx];
         break;
       case eStateDissEx:
         break;
@@ -376,13 +914,19 @@ void CellModel::calcDrugMass(void) {
         break;
     }
   }
+  return mass;
 }
 
 /// random number generation
-f64 CellModel::getRand(void) {
-#if USE_BOOST
-  return (*rngGen)(); 
-#else
-  return (float)rand() / (float)RAND_MAX;
-#endif
+f64 CellModel::getRand(const eRandStream stream, const u64 counter, const u64 index) {
+  return Random::uniform(rngSeed, stream, counter, index);
 }
+
+//------- stencil instances of the per-cell kernels
+// (the wet kernels and the update loop are chosen in Diffuse.cpp)
+template bool CellModel::dissolve<Stencil6>(const u32 p, f64* pMass);
+template bool CellModel::dissolve<Stencil26>(const u32 p, f64* pMass);
+template bool CellModel::diffuse<Stencil6>(const u32 p, f64* pMass);
+template bool CellModel::diffuse<Stencil26>(const u32 p, f64* pMass);
+template u32 CellModel::updateCellsStencil<Stencil6>(const u32 thr, const u32 c0, const u32 c1);
+template u32 CellModel::updateCellsStencil<Stencil26>(const u32 thr, const u32 c0, const u32 c1);
@@ -6,37 +6,72 @@
  *
  */
 
-#ifndef _CELLDIFF_CELLMODEL_H
+#ifndef _CELLDIFF_CELLMODEL_H_
 #define _CELLDIFF_CELLMODEL_H_
 
-#define USE_BOOST 0
-
-#if USE_BOOST
-#include <boost/random/mersenne_twister.hpp>
-#include <boost/random/linear_congruential.hpp>
-#include <boost/random/uniform_int.hpp>
-#include <boost/random/uniform_real.hpp>
-#include <boost/random/variate_generator.hpp>
-#else
-#include <cstdlib>
-#endif
-
+#include <vector>
 #include "types.h"
+#include "Threads.hpp"
+#include "Random.hpp"
+
+class Profile;
+class SlabTransport;
 
 //======= defines
 
 //------- neighbors
-// use diagonal neighbors?
-#define DIAG_NEIGHBORS 0
-// neighbors per cell
-#if DIAG_NEIGHBORS
-#define NUM_NEIGHBORS 26
-#else
-#define NUM_NEIGHBORS 6
-#define NUM_NEIGHBORS_R 0.16666666666666666
-#endif 
+// face neighbors per cell (+x, -x, +y, -y, +z, -z)
+#define NUM_FACES 6
+// neighbors per cell in the largest stencil
+#define MAX_NEIGHBORS 26
+// unroll a loop over a stencil's neighbors completely
+#define UNROLL_NEIGHBORS _Pragma("GCC unroll 26")
+// time step in units of cellLength^2 / D: the stable step of the face stencil,
+// used with either stencil (dissolution goes by steps, so its rate stays put)
+#define TIME_STEP_SCALE 0.16666666666666666
+
+//------- setup
+// buckets of the parallel shuffle: elements are dealt to them at random,
+// then each is shuffled on its own (a fixed count, so the permutation
+// doesn't depend on the thread count)
+#define SHUFFLE_BUCKETS 1024
+
+//------- vector kernels
+// wet cells collected per call of the diffusion kernel
+#define WET_BATCH 256
+// padding after the state plane, for vector gathers of whole words
+#define STATE_PAD 8
+
+//------- sleeping bricks
+// side of the cubes of cells that sleep and wake together
+#define SLEEP_BRICK_BITS 2
+#define SLEEP_BRICK_LENGTH (1 << SLEEP_BRICK_BITS)
+
+//------- implicit diffusion
+// the solver stops at this residual, relative to the right-hand side
+#define IMPLICIT_TOL 1e-6
+#define IMPLICIT_MAX_ITER 1000
+// partial sums kept per chunk of rows
+#define IMPLICIT_PARTIALS 4
+
+//------- precision
+// store concentrations as f32 (make f32), and do the neighbor sums and the
+// diffusion update in f32 (8 cells per AVX2 vector, 16 ensemble replicas).
+// drug mass, the dissolution chances and the implicit solver stay f64
+#ifndef CELLDIFF_F32
+#define CELLDIFF_F32 0
+#endif
 
 //======= types
+// stored concentration, and the type of the neighbor sums and updates
+#if CELLDIFF_F32
+typedef f32 conc_t;
+typedef f32 calc_t;
+#else
+typedef f64 conc_t;
+typedef f64 calc_t;
+#endif
+
 // enumeration of cell states
 enum eCellState {
   eStateDrug      = 0,    // DON'T CHANGE THESE FIRST FOUR VALUES (stupid hack reasons)
@@ -50,36 +85,87 @@ enum eCellState {
   eStateDummy
 };
 
+// diffusion kernel selection
+enum eSimdLevel {
+  eSimdAuto     = 0,
+  eSimdScalar   = 1,
+  eSimdAvx2     = 2,
+  eSimdAvx512   = 3
+};
+
+// grid layouts: the order of cells in memory
+enum eGridLayout {
+  eLayoutLinear = 0,  // x fastest, then y, then z
+  eLayoutBrick  = 1,  // bricks of BRICK_LENGTH^3 cells, each linear inside, bricks in linear order
+  eLayoutMorton = 2,  // z-order: the bits of x, y and z interleaved, x lowest
+  eLayoutSparse = 3   // bricks, storing only those within a brick of the tablet;
+                      // all others read as one shared boundary brick
+};
+#define BRICK_BITS 3
+#define BRICK_LENGTH (1 << BRICK_BITS)
+#define BRICK_CELLS (1 << (3 * BRICK_BITS))
+
+// neighbor stencils, chosen at runtime; the kernels are instantiated for each
+enum eStencil {
+  eStencil6     = 6,    // face neighbors
+  eStencil26    = 26    // face, edge and corner neighbors
+};
+
+// compile-time stencils. a neighbor is "behind" a cell if it comes first
+// in a serial sweep in linear index order. the diffusion weight per
+// neighbor makes one step of TIME_STEP_SCALE match the diffusion rate
+struct Stencil6 {
+  enum { size = 6 };
+  // +x, -x, +y, -y, +z, -z
+  static bool behind(const u8 i) { return i & 1; }
+  static f64 weight(void) { return 0.16666666666666666; }
+  // low bit of each neighbor's class in a packed neighbor word
+  static u32 classLowBits(void) { return 0x555UL; }
+  // the same, for the neighbors sharing a face (dissolution counts only these)
+  static u32 faceLowBits(void) { return 0x555UL; }
+};
+
+struct Stencil26 {
+  enum { size = 26 };
+  // offsets in {-1, 0, 1}^3 but (0, 0, 0), x fastest, then y, then z:
+  // in order of linear offset, so the first 13 are behind
+  static bool behind(const u8 i) { return i < 13; }
+  // the neighbor sum is 9 cellLength^2 times the laplacian
+  static f64 weight(void) { return 1.0 / 54.0; }
+  static u32 classLowBits(void) { return 0x5555555555555UL; }
+  // faces are neighbors 4 (-z), 10 (-y), 12 (-x), 13 (+x), 15 (+y), 21 (+z)
+  static u32 faceLowBits(void) { return 0x40045100100UL; }
+};
+
+// what a neighbor query needs of a cell's state, in 2 bits
+enum eStateClass {
+  eClassDry     = 0,  // drug, excipient, void or dissolving
+  eClassWet     = 1,
+  eClassBound   = 2,
+  eClassPoly    = 3
+};
+#define CLASS_BITS 2
+// class of each eCellState, packed CLASS_BITS per state
+#define STATE_CLASSES (((u32)eClassWet << (CLASS_BITS * eStateWet)) \
+                       | ((u32)eClassPoly << (CLASS_BITS * eStatePoly)) \
+                       | ((u32)eClassBound << (CLASS_BITS * eStateBound)))
+
 //======= classes
-class Cell {
-public:
-  // c-tor
-  Cell(u32 idx); 
-  // d-tor
-  ~Cell();
-public:
-  // state
-  eCellState state; 
-  // index
-  u32 idx;
-  // array of neighbor indices
-  u32 neighborIdx[NUM_NEIGHBORS];
-  // concentration of drug, excipient
-  f64 concentration[2];
-  // counter for gradual dissolution
-  u16 dissCount;
-  // maximum count for gradual dissolution
-  u16 dissSteps;
-  // dissolution increment
-  f64 dissInc;
-  // diffusion multiplier
-  f64 diffMul;
-	// dissolution probability for this cell (function of NPN)
-	f64 dissProb;
-  
+// structure-of-arrays cell storage: one contiguous plane per field
+struct CellBuffer {
+  // packed cell states (eCellState values)
+  u8* state;
+  // concentration planes of drug, excipient
+  conc_t* concentration[2];
 };
 
+class CellModel;
+// a setup phase: run by every thread of the pool on its own range of the work
+typedef void (CellModel::*setup_phase_t)(void* work, const u32 thr, const u32 numThr);
+
 class CellModel {
+  // kernel microbenchmarks (Bench.cpp) time the private steps directly
+  friend class CellBench;
 public:
   CellModel(
             u32 n,
@@ -96,41 +182,195 @@ public:
             f64 polyshellbalance = 1.0,
             f64 bounddiffrate = 0.02,
             f64 dissratescale=1.0,
-	    u8 compressflag=1
+	    u8 compressflag=1,
+            u32 numthreads=1,
+            u8 simd=eSimdAuto,
+            u8 gridlayout=eLayoutLinear,
+            u8 nbrstencil=eStencil6,
+            f64 sleeptol=0.0,
+            u32 stepmultiple=1
             );
   ~CellModel(void);
   // set initial values, tablet shape, etc
   void setup(void);
   // advance time in the model by one step
   f64 iterate(void);
+  ///// checkpoints (CellModelCheckpoint.cpp)
+  // bytes of the model's part of a checkpoint
+  u64 checkpointSize(void);
+  // copy the model's state into a checkpoint (checkpointSize() bytes at dst)
+  void checkpointPack(u8* dst);
+  // initialize from a checkpoint instead of calling setup();
+  // returns 0 on success, -1 if it doesn't fit this model's parameters
+  int checkpointRestore(const u8* src, const u64 size);
+  ///// grid layout
+  // index <-> coordinates conversion
+  u32 subToIdx(const u32 x, const u32 y, const u32 z);
+  void idxToSub(u32 idx, u32* pX, u32* pY, u32* pZ) const;
+  // index of a cell in linear order (the same for every layout)
+  u32 linearIdx(const u32 idx);
+  // index of face neighbor i of a cell off the outer face, from strides alone
+  inline u32 neighbor(const u32 idx, const u8 i) const;
+  // indices of all neighbors of a cell off the outer face, in stencil order
+  template<class S> inline void neighbors(const u32 idx, u32* nIdx) const;
+  // neighbors in this model's stencil (zeros on the outer face)
+  void findNeighbors(const u32 idx, u32* nIdx) const;
+  // copy the current planes out in linear order (cubeLength^3 cells each)
+  void copyLinear(u8* state, f64* drug, f64* ex);
+  ///// sleeping bricks
+  // bound on how far any cell has drifted while asleep
+  f64 sleepCellBound(void);
+  ///// implicit diffusion
+  // mean solver iterations per step so far
+  f64 implicitIterations(void);
+  ///// compression check
+  // distribute and compress a fresh model, by parallel wavefronts or
+  // (serial != 0) the serial sweep, and histogram the polymer face neighbors
+  // of the tablet's cells: hist[np] for polymer cells, hist[NUM_FACES + 1 + np]
+  // for the others
+  void compressHistogram(const u8 serial, u64* hist);
+  ///// slabs (CellModelSlab.cpp; linear layout only)
+  // split the cube along z into n slabs of about equal active cells, after
+  // setup(); -1 if the layout isn't linear or n is more than the planes of active cells
+  int splitSlabs(const u32 n);
+  // keep only the transport's slab of the model; iterate() then exchanges
+  // halos and sums the drug mass of all slabs each step
+  void setSlab(SlabTransport* transport);
+  // bytes of a plane sent between slabs
+  u64 slabPlaneBytes(void);
 private:
   ///// more setup funxtions...
   // initial distribution of particles
   void distribute(void);
-  // compression step
+  // compression step: by wavefronts on the threads / the serial sweep
   void compress(void);
-  // find cells that need processing
+  void compressSerial(void);
+  // swap of one polymer block (draws: sequential draw counter, or NULL for
+  // draws keyed on the block), and a thread's share of every wavefront
+  void compressBlock(const u32 i, const u32 j, const u32 k, u64* draws);
+  void compressBlocks(void* work, const u32 thr, const u32 numThr);
+  // shuffle a list of indices (pass selects the random counter)
+  void shuffle(std::vector<u32>& v, const u64 pass);
+  // parallel setup (CellModelSetup.cpp): run a phase on every thread, and
+  // the phases. each works on a range given by its thread; what they
+  // gather is put together in range order, so the model doesn't depend
+  // on the thread count
+  void runSetup(setup_phase_t phase, void* work);
+  static void setup_thr(void* ctx, const u32 thr, const u32 numThr);
+  // sort blocks into exterior (set), shell and tablet
+  void classifyBlocks(void* work, const u32 thr, const u32 numThr);
+  // deal to buckets and shuffle each (see SHUFFLE_BUCKETS)
+  void shuffleBuckets(void* work, const u32 thr, const u32 numThr);
+  // set the states of the chosen polymer, drug and excipient blocks
+  void assignBlocks(void* work, const u32 thr, const u32 numThr);
+  // active cells of a range of planes, and the per-slot data of a range of slots
+  template<class S> void findCellsRange(void* work, const u32 thr, const u32 numThr);
+  void fillSlots(void* work, const u32 thr, const u32 numThr);
+  // which slots start in the frontier
+  void frontierFlags(void* work, const u32 thr, const u32 numThr);
+  // fill a cell buffer with dummy cells / copy the current buffer into it
+  void clearCells(void* work, const u32 thr, const u32 numThr);
+  void copyCells(void* work, const u32 thr, const u32 numThr);
+  // find cells that need processing (in the model's stencil)
   void findCellsToProcess(void);
-  // paopulate neighbor index array for a given cell
-  void findNeighbors(Cell* cell);
-  // decide whether to dissolve given cell; return new state
-  eCellState dissolve(const Cell* const cell);
-  // continue dissolving this cell; return new states
-  eCellState continueDissolve(const Cell* const cell);
-  // calculate diffusion on this cell
-  void diffuse(const Cell* const cell);
-  // calculate the current mass of drug remaining 
-  // FIXME: this is rather inefficient
-  void calcDrugMass(void);
-  // index / coordinates conversion
-  u32 subToIdx(const u32 x, const u32 y, const u32 z);
-  void idxToSub(u32 idx, u32* pX, u32* pY, u32* pZ);
+  template<class S> void findCellsToProcess(void);
+  // count of a cell's neighbors that are polymer
+  template<class S> u8 polyNeighbors(const u32 idx);
+  // classes of a cell's neighbors packed in one word, neighbor i at bit CLASS_BITS*i
+  template<class S> inline u32 neighborClasses(const u32* nIdx) const;
+  // state class of a cell in the current buffer
+  inline u8 stateClass(const u32 idx) const;
+  // allocate / free the per-active-cell data
+  void allocSlots(void);
+  void freeSlots(void);
+  // time step and diffusion weights from the diffusion rates
+  void setTimeStep(void);
+  // decide whether to dissolve given active cell;
+  // return false if it has no wet neighbors (and so can't change)
+  // (changes in remaining drug mass are added to *pMass)
+  template<class S> bool dissolve(const u32 p, f64* pMass);
+  // continue dissolving this active cell; return new states
+  eCellState continueDissolve(const u32 p, f64* pMass);
+  // calculate diffusion on this active cell;
+  // return false if it has no wet neighbors (and so can't change)
+  template<class S> bool diffuse(const u32 p, f64* pMass);
+  // boundary concentration after exponential decay
+  calc_t decayBound(const calc_t c);
+  // diffuse a batch of wet active cells (Diffuse.cpp);
+  // return the change in drug mass, summed in list order
+  template<class S> f64 diffuseWetScalar(const u32* pList, const u32 n);
+  template<class S> f64 diffuseWetAvx2(const u32* pList, const u32 n);
+  template<class S> f64 diffuseWetAvx512(const u32* pList, const u32 n);
+  // choose the wet diffusion kernel (eSimdAuto picks the best supported)
+  // and the update loop for the model's stencil
+  void selectDiffuseKernel(const u8 level);
+  template<class S> void selectKernels(void);
+  // update frontier chunks [c0, c1) into the update buffer;
+  // compacts the range in place and returns the number still active
+  template<class S> u32 updateCellsStencil(const u32 thr, const u32 c0, const u32 c1);
+  // rebuild the frontier from the compacted ranges and woken cells
+  void updateFrontier(const u32 numThr);
+  // merge the nAdd slots in frontierAdd into the first n entries of the
+  // frontier, keeping slot order; returns the new count
+  u32 mergeFrontier(const u32 n, const u32 nAdd);
+  // build the initial frontier (cells with a wet or boundary neighbor)
+  void initFrontier(void);
+  // slot of a cell in cellsToProcess, numCellsToProcess if none
+  u32 findSlot(const u32 idx);
+  // sleeping bricks: allocate the brick flags / build the per-slot tables
+  void allocSleep(void);
+  void initSleep(void);
+  // largest change of each brick over frontier entries [f0, f1), per thread
+  void measureSleep(const u32 thr, const u32 f0, const u32 f1);
+  // implicit diffusion step of the wet and boundary cells collected by the
+  // update (Implicit.cpp); every thread calls it
+  template<class S> void solveImplicit(const u32 thr, const u32 numThr);
+  // implicit steps: carry the front on through the step, from the cells the
+  // update wet, in the order they got wet, and add them and the boundary
+  // cells they reach to the rows (Implicit.cpp); thread 0 only
+  template<class S> void spreadFront(void);
+  // dissolution chance per explicit step of dry slot p, seeing the cells
+  // wet by explicit step t0 of this step
+  template<class S> f64 spreadProb(const u32 p, const u32 t0);
+  // dry slot p gets the chances of explicit steps t0+1 .. stepMultiple of
+  // this step to dissolve with probability prob each, and goes on
+  // dissolving for the rest of the step once it does
+  void dissolveFrom(const u32 p, const f64 prob, const u32 t0, f64* pMass);
+  // put quiet bricks to sleep and wake bricks next to active ones,
+  // adding woken slots to frontierAdd; returns the frontier count left
+  u32 updateSleep(const u32 n, u32* pAdd);
+  // one thread's share of an iteration: update, commit, mass
+  void iterateThread(const u32 thr, const u32 numThr);
+  static void iterate_thr(void* ctx, const u32 thr, const u32 numThr);
+  // exchange current and update buffers after a step
+  void swapBuffers(void);
+  // calculate the mass of drug remaining in active cells [p0, p1)
+  // from scratch (iterate() tracks it incrementally)
+  f64 calcDrugMass(const u32 p0, const u32 p1);
+  // slabs: copy a plane of the current buffer out / into a halo plane of
+  // both buffers (waking slots next to newly wet cells), and trade the
+  // edge planes with the neighboring slabs after a step
+  void packPlane(const u32 z, u8* dst);
+  u32 unpackPlane(const u32 z, const u8* src, u32 nAdd);
+  void exchangeHalo(void);
+  // index tables for the grid layout
+  void initLayout(void);
+  // sparse layout: choose the stored bricks
+  void initSparseBricks(const u32 bricks);
+  // cell of the shared exterior brick (sparse layout), which stays boundary
+  bool isExterior(const u32 idx) const { return (layout == eLayoutSparse) && (idx < BRICK_CELLS); }
   // set state of a 2x2x2 block of cells
   void setBlockState(const u32 idx, eCellState state);
   // set state of a single cell
   void setCellState(const u32 idx, eCellState state);
-  // random number generation
-  f64 getRand(void);
+  // allocate / free a cell buffer
+  void allocBuffer(CellBuffer* buf);
+  void freeBuffer(CellBuffer* buf);
+  // arrays saved in a checkpoint, in order; returns the count
+  u32 checkpointArrays(void** ptr, u64* bytes);
+  // random number generation: uniform in [0, 1),
+  // a pure function of (seed, stream, counter, index)
+  f64 getRand(const eRandStream stream, const u64 counter, const u64 index);
   public: // FIXME: many of these could be privatized
 	// cell type distribution
   //  u32 nDrug;
@@ -152,7 +392,13 @@ private:
   u32 shellN;
   // cylinder height as fraction of cube height
   f64 cylinderHeight;
-  // number of total cells
+  // cell order in memory, and the side of the (padded) cube it indexes
+  eGridLayout layout;
+  u32 storageLength;
+  // neighbors each cell exchanges with
+  eStencil stencil;
+  u8 numNeighbors;
+  // number of total cells, including any padding of the layout
   u32 numCells;
   // initial total mass of drug
   f64 drugMassTotal;
@@ -176,26 +422,253 @@ private:
   static const f64 diffNMul[7];
   // dissolution steps given number of polymer neighbors
   static const f64 dissNSteps[7];
-  // flattened array of all cells
-  Cell**        cells;         
+  // bytes of cell data currently allocated
+  u64 cellMemory(void);
+  // flattened planes of all cells
+  CellBuffer    cells;
   // copy for updating after iteration
-  Cell**        cellsUpdate;
-  // cells-to-process (drug, excip, water, diffusing, or immediate boundary) 
+  CellBuffer    cellsUpdate;
+  // cells-to-process (drug, excip, water, diffusing, or immediate boundary),
+  // in index order. positions in this list are the "slots" of active cells.
   u32* cellsToProcess;
   u32 numCellsToProcess;
+  //------ frontier: slots that can change this step, in slot order.
+  // dry cells join when a neighbor becomes wet; cells that can't change
+  // until that happens are dropped.
+  u32* frontier;
+  u32 numFrontier;
+  // flag per slot: currently in the frontier
+  u8* inFrontier;
+  // scratch for cells joining the frontier
+  u32* frontierAdd;
+  // per-thread start of the frontier range, and count of entries kept
+  u32* frontierStart;
+  u32* frontierKept;
+  // per-thread slots that just became wet
+  std::vector<u32>* wakeList;
+  //------ per-active-cell data, indexed in parallel with cellsToProcess
+  // linear index of the cell, which keys its random streams in any layout
+  u32* rngIdx;
+  // counter for gradual dissolution
+  u16* dissCount;
+  // maximum count for gradual dissolution
+  u16* dissSteps;
+  // dissolution increment
+  f64* dissInc;
+  // diffusion multiplier
+  f64* diffMul;
+  // dissolution probability (function of NPN)
+  f64* dissProb;
   // compression flag
   u8 compressFlag;
+  // wet diffusion kernel and update loop in use
+  f64 (CellModel::*diffuseWet)(const u32* pList, const u32 n);
+  u32 (CellModel::*updateCells)(const u32 thr, const u32 c0, const u32 c1);
+  eSimdLevel simdLevel;
+  // iteration worker threads
+  ThreadPool* threads;
+  // change in drug mass per fixed-size chunk of the frontier,
+  // reduced in chunk order so the sum doesn't depend on thread count
+  f64* massPartial;
+  u32 numMassChunks;
+  static const u32 massChunkSize = 4096;
+  // per axis: index offset of each coordinate (subToIdx sums them)
+  u32* layoutIdx[3];
+  //------ neighbor strides (set by initLayout)
+  // index offset of each face neighbor, and of each neighbor of the 26-stencil,
+  // in the linear layout (negative ones wrap)
+  u32 nbrOffset[NUM_FACES];
+  u32 diagOffset[MAX_NEIGHBORS];
+  // brick layout: index distance between neighboring bricks along each axis
+  u32 brickStep[3];
+  // sparse layout: stored brick of each brick of the cube (0 for the shared
+  // exterior brick), the brick of each stored brick, and per stored brick
+  // the stored bricks next to it (NUM_FACES each)
+  u32* brickSlot;
+  u32* slotBrick;
+  u32* slotNeighbor;
+  u32 numSlotBricks;
+  // z-order: the index bits of each axis
+  u64 mortonMask[3];
+  //------ sleeping bricks: cubes of SLEEP_BRICK_LENGTH^3 cells (by coordinates,
+  // so the same in every layout) leave the frontier while the largest change
+  // of their cells stays within sleepTol, and both buffers hold their values.
+  // a brick wakes when one next to it (or itself) changes by more than that.
+  // sleepTol == 0 turns this off
+  f64 sleepTol;
+  // bricks along each side, and in all
+  u32 sleepBricks;
+  u32 numSleepBricks;
+  // per brick: awake flag, largest change this step (one array per
+  // thread), next to a changing brick (and scratch for finding those),
+  // and the iteration it went to sleep
+  u8* brickAwake;
+  f64* brickChange;
+  u8* brickNear;
+  u64* brickSleptAt;
+  // brick of each slot, and the slots of each brick (in slot order)
+  u32* slotSleepBrick;
+  u32* sleepSlotStart;
+  u32* sleepSlots;
+  // wet and boundary cells in sleeping bricks
+  u32 numSleepCells;
+  // skipped and visited cell updates, the bound on the drug mass the skipped
+  // updates could have moved (sleepTol per update), and the longest sleep
+  u64 sleepSkipped;
+  u64 sleepVisited;
+  f64 sleepBound;
+  u64 sleepMaxSteps;
+  //------ implicit diffusion: with stepMultiple > 1 the time step is that many
+  // explicit steps, and wet and boundary cells take one backward Euler step
+  // together, solved by BiCGSTAB (Implicit.cpp). 1 == the explicit update
+  u32 stepMultiple;
+  // per thread: wet and boundary slots met by the update, in frontier order
+  std::vector<u32>* implicitRows;
+  // then the cells spreadFront() met: those wet during the step, in the
+  // order they got wet, and the boundary cells next to them
+  std::vector<u32> spreadRows;
+  // rows of the system: slot of each row, and row of each cell, valid where
+  // the row's slot holds that cell
+  u32 numRows;
+  u32 numRowChunks;
+  u32* rowSlot;
+  u32* cellRow;
+  // per row: rows of the neighbors (numRows for none), count of neighbors
+  // it exchanges with, and which of them are seen decayed
+  u32* rowNbr;
+  u8* rowNw;
+  u32* rowDecay;
+  // per row, drug and excipient interleaved, plus a zero entry past the last row:
+  // solution, residual, initial residual, search direction, and the
+  // preconditioned vectors and products of the iteration
+  f64* cgX;
+  f64* cgR;
+  f64* cgR0;
+  f64* cgP;
+  f64* cgPHat;
+  f64* cgV;
+  f64* cgSHat;
+  f64* cgT;
+  // per chunk of rows: partial dot products (two sets), and change in drug mass
+  f64* cgPartial;
+  f64* rowMass;
+  // per slot: explicit steps into the step when it got wet; slots woken by
+  // spreadFront() waiting for the frontier, and the change in drug mass
+  u32* wetAt;
+  u32 numSpreadAdd;
+  f64 spreadMass;
+  // steps solved and iterations spent
+  u64 implicitSolves;
+  u64 implicitIters;
+  //------ slabs: the transport to the other slabs (NULL for the whole model),
+  // the first plane of each slab (and cubeLength), this slab's planes
+  // [slabZ0, slabZ1), the cells held [slabLo, slabHi) (the slab and one
+  // plane either side), and the planes in flight
+  SlabTransport* slabs;
+  std::vector<u32> slabStart;
+  u32 slabZ0;
+  u32 slabZ1;
+  u32 slabLo;
+  u32 slabHi;
+  u8* slabBuf;
+  // setup phase running on the pool, and its work
+  setup_phase_t setupPhase;
+  void* setupWork;
+  // phase timing, or NULL when profiling is off
+  Profile* profile;
   //====== random number stuff
-#if USE_BOOST
-  // randomization algorithm
-  typedef boost::mt19937 rng_t; // mersenne twister
-  // distribution (maps algorithm to data type and range)
-  typedef boost::uniform_real<f64> dist_t;
-  rng_t   rngEngine;
-  dist_t  rngDist;
-  // generator (functor) for streams of values
-  boost::variate_generator<rng_t, dist_t>* rngGen;
-#endif
+  // seed for all counter-based random streams
+  u32 rngSeed;
+  // count of completed iterations (counter for the dissolution stream)
+  u64 iterationNum;
 };
 
+// neighbors are even/odd pairs along x, y, z: +x, -x, +y, -y, +z, -z.
+// the outer face is never active, so the step can't leave the grid
+inline u32 CellModel::neighbor(const u32 idx, const u8 i) const {
+  const u8 a = i >> 1;
+  switch(layout) {
+    case eLayoutBrick: {
+      // within the brick unless the coordinate is on the brick's edge
+      const u32 shift = a * BRICK_BITS;
+      const u32 v = (idx >> shift) & (BRICK_LENGTH - 1);
+      if (i & 1) {
+        return (v != 0) ? (idx - ((u32)1 << shift))
+          : (idx + ((u32)(BRICK_LENGTH - 1) << shift) - brickStep[a]);
+      }
+      return (v != (BRICK_LENGTH - 1)) ? (idx + ((u32)1 << shift))
+        : (idx - ((u32)(BRICK_LENGTH - 1) << shift) + brickStep[a]);
+    }
+    case eLayoutSparse: {
+      // as bricks, with the next brick looked up
+      const u32 shift = a * BRICK_BITS;
+      const u32 v = (idx >> shift) & (BRICK_LENGTH - 1);
+      if (v != ((i & 1) ? 0 : (BRICK_LENGTH - 1))) {
+        return (i & 1) ? (idx - ((u32)1 << shift)) : (idx + ((u32)1 << shift));
+      }
+      const u32 next = slotNeighbor[(idx / BRICK_CELLS) * NUM_FACES + i] * BRICK_CELLS;
+      const u32 inner = (idx & (BRICK_CELLS - 1)) ^ ((u32)(BRICK_LENGTH - 1) << shift);
+      return next + inner;
+    }
+    case eLayoutMorton: {
+      // step the axis bits with the carry running through the other axes' bits
+      const u64 m = mortonMask[a];
+      const u64 v = (i & 1) ? (((idx & m) - 1) & m) : (((idx | ~m) + 1) & m);
+      return (u32)(v | (idx & ~m));
+    }
+    default:
+      return idx + nbrOffset[i];
+  }
+}
+
+inline u8 CellModel::stateClass(const u32 idx) const {
+  return (STATE_CLASSES >> (CLASS_BITS * cells.state[idx])) & 3;
+}
+
+template<> inline void CellModel::neighbors<Stencil6>(const u32 idx, u32* nIdx) const {
+  for(u8 i=0; i<NUM_FACES; i++) {
+    nIdx[i] = neighbor(idx, i);
+  }
+}
+
+// face steps along z, then y, then x: one step per neighbor. in the sparse
+// layout a path may cross the shared exterior brick, which never leads
+// back; from a cell within one cell of the tablet, any neighbor reached
+// that way is boundary without concentration, as the exterior reads
+template<> inline void CellModel::neighbors<Stencil26>(const u32 idx, u32* nIdx) const {
+  if (layout == eLayoutLinear) {
+    for(u8 i=0; i<Stencil26::size; i++) {
+      nIdx[i] = idx + diagOffset[i];
+    }
+    return;
+  }
+  u8 i = 0;
+  for(u8 z=0; z<3; z++) {
+    const u32 cz = (z == 1) ? idx : neighbor(idx, (z == 0) ? 5 : 4);
+    for(u8 y=0; y<3; y++) {
+      const u32 cy = (y == 1) ? cz : neighbor(cz, (y == 0) ? 3 : 2);
+      nIdx[i++] = neighbor(cy, 1);
+      if ((z != 1) || (y != 1)) { nIdx[i++] = cy; }
+      nIdx[i++] = neighbor(cy, 0);
+    }
+  }
+}
+
+template<class S> inline u32 CellModel::neighborClasses(const u32* nIdx) const {
+  u32 w = 0;
+  UNROLL_NEIGHBORS
+  for(u8 i=0; i<S::size; i++) {
+    w |= (u32)stateClass(nIdx[i]) << (CLASS_BITS * i);
+  }
+  return w;
+}
+
+// neighbors of a packed neighbor word in class c, as its low class bits:
+// count them with popcount, neighbor i of a set bit b is b / CLASS_BITS
+template<class S> inline u32 classMask(const u32 w, const eStateClass c) {
+  const u32 lo = (c & 1) ? w : ~w;
+  const u32 hi = (c & 2) ? (w >> 1) : ~(w >> 1);
+  return lo & hi & S::classLowBits();
+}
+
 #endif // header guard
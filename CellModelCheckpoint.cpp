@@ -0,0 +1,215 @@
+/*
+ *  CellModelCheckpoint.cpp
+ *  celldiff
+ *
+ *  saving and restoring the complete model state, so a run can be
+ *  stopped and continued with bit-identical results.
+ *
+ *  layout (native byte order): a ModelCheckpoint, then the arrays listed
+ *  by checkpointArrays(), each starting on an 8-byte boundary. cell planes
+ *  are saved in the model's grid layout and precision, which must match
+ *  on restore. the update buffer and random-stream indices aren't saved; cells outside the
+ *  frontier are equal in both buffers, and frontier cells overwrite all
+ *  of their update data before reading it, so a copy of the current
+ *  buffer continues exactly.
+ */
+
+#include <cstring>
+#include <stdint.h>
+#include "CellModel.hpp"
+
+// fixed part of the model's checkpoint
+struct ModelCheckpoint {
+  // parameters, which must match on restore
+  uint64_t  cubeLength;
+  uint64_t  numCells;
+  uint64_t  wShell;
+  uint32_t  seed;
+  uint32_t  compress;
+  uint32_t  layout;
+  // concentrations stored as f32 (0 in the default build)
+  uint32_t  concF32;
+  uint32_t  stencil;
+  uint32_t  stepMultiple;
+  f64       cylinderHeight;
+  f64       cellLength;
+  f64       pDrug;
+  f64       pPoly;
+  f64       pShellBalance;
+  f64       dissProbDrug;
+  f64       dissProbEx;
+  f64       boundDiff;
+  f64       dissratescale;
+  f64       dt;
+  f64       dDrug;
+  f64       dEx;
+  f64       sleepTol;
+  // progress
+  uint64_t  iterationNum;
+  uint64_t  numCellsToProcess;
+  uint64_t  numFrontier;
+  f64       drugMassTotal;
+  f64       drugMass;
+  f64       trappedDrugMass;
+  // sleeping bricks
+  uint64_t  sleepSkipped;
+  uint64_t  sleepVisited;
+  uint64_t  sleepMaxSteps;
+  f64       sleepBound;
+  // implicit steps
+  uint64_t  implicitSolves;
+  uint64_t  implicitIters;
+};
+
+// most arrays in a checkpoint
+#define CHECKPOINT_ARRAYS 14
+
+static u64 align8(const u64 n) {
+  return (n + 7) & ~((u64)7);
+}
+
+// parameters of this model, as they appear in its checkpoint
+static void fill_params(ModelCheckpoint* ck, const CellModel* m) {
+  ck->cubeLength = m->cubeLength;
+  ck->numCells = m->numCells;
+  ck->wShell = m->wShell;
+  ck->seed = m->rngSeed;
+  ck->compress = m->compressFlag;
+  ck->layout = m->layout;
+  ck->concF32 = CELLDIFF_F32;
+  ck->stencil = m->stencil;
+  ck->stepMultiple = m->stepMultiple;
+  ck->cylinderHeight = m->cylinderHeight;
+  ck->cellLength = m->cellLength;
+  ck->pDrug = m->pDrug;
+  ck->pPoly = m->pPoly;
+  ck->pShellBalance = m->pShellBalance;
+  ck->dissProbDrug = m->dissProbDrug;
+  ck->dissProbEx = m->dissProbEx;
+  ck->boundDiff = m->boundDiff;
+  ck->dissratescale = m->dissratescale;
+  ck->dt = m->dt;
+  ck->dDrug = m->dDrug;
+  ck->dEx = m->dEx;
+  ck->sleepTol = m->sleepTol;
+}
+
+u32 CellModel::checkpointArrays(void** ptr, u64* bytes) {
+  u32 n = 0;
+  ptr[n] = cells.state;                 bytes[n++] = numCells * sizeof(u8);
+  ptr[n] = cells.concentration[0];      bytes[n++] = numCells * sizeof(conc_t);
+  ptr[n] = cells.concentration[1];      bytes[n++] = numCells * sizeof(conc_t);
+  ptr[n] = cellsToProcess;              bytes[n++] = numCellsToProcess * sizeof(u32);
+  ptr[n] = dissCount;                   bytes[n++] = numCellsToProcess * sizeof(u16);
+  ptr[n] = dissSteps;                   bytes[n++] = numCellsToProcess * sizeof(u16);
+  ptr[n] = dissInc;                     bytes[n++] = numCellsToProcess * sizeof(f64);
+  ptr[n] = diffMul;                     bytes[n++] = numCellsToProcess * sizeof(f64);
+  ptr[n] = dissProb;                    bytes[n++] = numCellsToProcess * sizeof(f64);
+  ptr[n] = frontier;                    bytes[n++] = numFrontier * sizeof(u32);
+  if (sleepTol > 0.0) {
+    ptr[n] = brickAwake;                bytes[n++] = numSleepBricks * sizeof(u8);
+    ptr[n] = brickSleptAt;              bytes[n++] = numSleepBricks * sizeof(u64);
+  }
+  if (stepMultiple > 1) {
+    // the step before, which the implicit solver starts from
+    ptr[n] = cellsUpdate.concentration[0]; bytes[n++] = numCells * sizeof(conc_t);
+    ptr[n] = cellsUpdate.concentration[1]; bytes[n++] = numCells * sizeof(conc_t);
+  }
+  return n;
+}
+
+u64 CellModel::checkpointSize(void) {
+  void* ptr[CHECKPOINT_ARRAYS];
+  u64 bytes[CHECKPOINT_ARRAYS];
+  const u32 n = checkpointArrays(ptr, bytes);
+  u64 size = align8(sizeof(ModelCheckpoint));
+  for(u32 i=0; i<n; i++) {
+    size += align8(bytes[i]);
+  }
+  return size;
+}
+
+void CellModel::checkpointPack(u8* dst) {
+  ModelCheckpoint ck;
+  memset(&ck, 0, sizeof(ModelCheckpoint));
+  fill_params(&ck, this);
+  ck.iterationNum = iterationNum;
+  ck.numCellsToProcess = numCellsToProcess;
+  ck.numFrontier = numFrontier;
+  ck.drugMassTotal = drugMassTotal;
+  ck.drugMass = drugMass;
+  ck.trappedDrugMass = trappedDrugMass;
+  ck.sleepSkipped = sleepSkipped;
+  ck.sleepVisited = sleepVisited;
+  ck.sleepMaxSteps = sleepMaxSteps;
+  ck.sleepBound = sleepBound;
+  ck.implicitSolves = implicitSolves;
+  ck.implicitIters = implicitIters;
+
+  void* ptr[CHECKPOINT_ARRAYS];
+  u64 bytes[CHECKPOINT_ARRAYS];
+  const u32 n = checkpointArrays(ptr, bytes);
+  u64 off = align8(sizeof(ModelCheckpoint));
+  memset(dst, 0, off);
+  memcpy(dst, &ck, sizeof(ModelCheckpoint));
+  for(u32 i=0; i<n; i++) {
+    memcpy(dst + off, ptr[i], bytes[i]);
+    memset(dst + off + bytes[i], 0, align8(bytes[i]) - bytes[i]);
+    off += align8(bytes[i]);
+  }
+}
+
+int CellModel::checkpointRestore(const u8* src, const u64 size) {
+  ModelCheckpoint ck, mine;
+  if (size < sizeof(ModelCheckpoint)) { return -1; }
+  memcpy(&ck, src, sizeof(ModelCheckpoint));
+
+  // the parameters (and the time step derived from them) must match exactly
+  this->setTimeStep();
+  memset(&mine, 0, sizeof(ModelCheckpoint));
+  fill_params(&mine, this);
+  if (memcmp(&ck, &mine, (const u8*)&mine.iterationNum - (const u8*)&mine) != 0) { return -1; }
+  if ((ck.numCellsToProcess > numCells) || (ck.numFrontier > ck.numCellsToProcess)) { return -1; }
+
+  iterationNum = ck.iterationNum;
+  numCellsToProcess = ck.numCellsToProcess;
+  numFrontier = ck.numFrontier;
+  drugMassTotal = ck.drugMassTotal;
+  drugMass = ck.drugMass;
+  trappedDrugMass = ck.trappedDrugMass;
+  sleepSkipped = ck.sleepSkipped;
+  sleepVisited = ck.sleepVisited;
+  sleepMaxSteps = ck.sleepMaxSteps;
+  sleepBound = ck.sleepBound;
+  implicitSolves = ck.implicitSolves;
+  implicitIters = ck.implicitIters;
+  if (checkpointSize() != size) { return -1; }
+  this->allocSlots();
+
+  void* ptr[CHECKPOINT_ARRAYS];
+  u64 bytes[CHECKPOINT_ARRAYS];
+  const u32 n = checkpointArrays(ptr, bytes);
+  u64 off = align8(sizeof(ModelCheckpoint));
+  for(u32 i=0; i<n; i++) {
+    memcpy(ptr[i], src + off, bytes[i]);
+    off += align8(bytes[i]);
+  }
+
+  // rebuild what wasn't saved
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    rngIdx[p] = linearIdx(cellsToProcess[p]);
+    inFrontier[p] = 0;
+  }
+  for(u32 f=0; f<numFrontier; f++) {
+    if (frontier[f] >= numCellsToProcess) { return -1; }
+    inFrontier[frontier[f]] = 1;
+  }
+  memcpy(cellsUpdate.state, cells.state, numCells * sizeof(u8));
+  if (stepMultiple <= 1) {
+    memcpy(cellsUpdate.concentration[0], cells.concentration[0], numCells * sizeof(conc_t));
+    memcpy(cellsUpdate.concentration[1], cells.concentration[1], numCells * sizeof(conc_t));
+  }
+  // sleeping bricks hold their cells in both buffers, as the copy does
+  initSleep();
+  return 0;
+}
@@ -6,17 +6,13 @@
  *
  *  Created by Ezra Buchla on 03/05/2012
  */
+#include <cstring>
 #include <vector>
 #include <algorithm>
 #include "CellModel.hpp"
+#include "Profile.hpp"
 
 using namespace std;
-	
-  // offset coordinates to get diagonals in 2x2x2
-static const u8 diags[4][3]	= { {0, 0, 0}, {0, 1, 1}, {1, 0, 1}, {1, 1, 0} };
-  // complementary diagonals
-static const u8 diagsNot[4][3]	= { {1, 1, 1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
-  u8 diag = 0;
 
 //// top-level setup function. initializes cell type data
 void CellModel::setup(void) {
@@ -33,14 +29,20 @@ void CellModel::setup(void) {
   
   
   ///---- DISTRIBUTE
+  f64 t0 = profile ? Profile::now() : 0.0;
   this->distribute();
+  if (profile) {
+    const f64 t1 = Profile::now();
+    profile->add(eProfDistribute, t1 - t0);
+    t0 = t1;
+  }
   
   ////////// DEBUG
   /*
    // another loop over all cells to verify final cell distribution count
    for(u8 s=0; s<8; s++) { stateCount[s] = 0; }
    for (u32 n=0; n<numCells; n++) {
-   stateCount[cells[n]->state]++;
+   stateCount[cells.state[n]]++;
    }
    // easier-to-read totals
    cellsInTablet   = stateCount[eStateDrug] + stateCount[eStateEx] + stateCount[eStatePoly] + stateCount[eStateVoid];
@@ -57,31 +59,26 @@ void CellModel::setup(void) {
   if(this->compressFlag) {
     this->compress();
   }
-	
-  // offset coordinates to get diagonals in 2x2x2
-  const u8 diags[4][3]	= { {0, 0, 0}, {0, 1, 1}, {1, 0, 1}, {1, 1, 0} };
-  // complementary diagonals
-  const u8 diagsNot[4][3]	= { {1, 1, 1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
-  u8 diag = 0;
+  if (profile) {
+    const f64 t1 = Profile::now();
+    profile->add(eProfCompress, t1 - t0);
+    t0 = t1;
+  }
 	
   // find cels tht need processing and intialize their state
   this->findCellsToProcess();
+  if (profile) { profile->add(eProfFindCells, Profile::now() - t0); }
+  // start the frontier at the cells that can dissolve right away
+  this->initFrontier();
+  // sleeping bricks (if on) start awake
+  this->initSleep();
 	
   // initialize the update data
-  for(u32 i=0; i<numCells; i++) {
-    *(cellsUpdate[i]) = *(cells[i]);
-  }
+  runSetup(&CellModel::copyCells, &cellsUpdate);
   drugMass = drugMassTotal;
   
   // calculate time step for user-supplied diffusion rates
-  
-  const f64 maxDiff = max(dDrug, dEx);
-  dt = cellLength * cellLength / maxDiff;
-  dt *= NUM_NEIGHBORS_R;
-  dDrug /= maxDiff;
-  dEx /= maxDiff;
-  dDrug *= NUM_NEIGHBORS_R;
-  dEx *= NUM_NEIGHBORS_R;
+  this->setTimeStep();
   
   ////// debug hook
   int dum = 0;
@@ -93,7 +90,7 @@ void CellModel::setup(void) {
    // another loop over all cells to verify final cell distribution count
    for(u8 s=0; s<8; s++) { stateCount[s] = 0; }
    for (u32 n=0; n<numCells; n++) {
-   stateCount[cells[n]->state]++;
+   stateCount[cells.state[n]]++;
    }
    // easier-to-read totals
    cellsInTablet   = stateCount[eStateDrug] + stateCount[eStateEx] + stateCount[eStatePoly] + stateCount[eStateVoid];
@@ -110,122 +107,225 @@ void CellModel::setup(void) {
 
 
 
+//// time step and per-step diffusion weights from the user-supplied diffusion rates
+void CellModel::setTimeStep(void) {
+  const f64 maxDiff = max(dDrug, dEx);
+  const f64 weight = (stencil == eStencil26) ? Stencil26::weight() : Stencil6::weight();
+  dt = cellLength * cellLength / maxDiff;
+  dt *= TIME_STEP_SCALE;
+  dDrug /= maxDiff;
+  dEx /= maxDiff;
+  dDrug *= weight;
+  dEx *= weight;
+  // an implicit step is stepMultiple explicit steps long
+  dt *= stepMultiple;
+  dDrug *= stepMultiple;
+  dEx *= stepMultiple;
+}
+
+//------ parallel setup
+// work of the distribution phases
+struct DistributeWork {
+  // block side (2 with compression), cylinder center and squared radii,
+  // and vertical bounds of the cylinder and of the inside of the shell
+  u32 step;
+  u32 cX, cY;
+  u32 cubeR2, shellR2;
+  u32 loBoundH, hiBoundH;
+  u32 loShellH, hiShellH;
+  // per thread: blocks of the shell and inside it, in index order of its planes
+  vector<u32>* shell;
+  vector<u32>* tablet;
+  // lists of polymer, drug and excipient blocks
+  const u32* list[3];
+  u32 count[3];
+};
+
+// work of a shuffle
+struct ShuffleWork {
+  vector<u32>* v;
+  u64 pass;
+  // shuffled list
+  vector<u32> out;
+  // bucket of each element
+  vector<u16> bucket;
+  // per thread and bucket: count, then next place in out
+  vector<u32> place;
+  // start of each bucket in out
+  u32 start[SHUFFLE_BUCKETS + 1];
+};
+
+void CellModel::runSetup(setup_phase_t phase, void* work) {
+  setupPhase = phase;
+  setupWork = work;
+  threads->run(&CellModel::setup_thr, this);
+}
+
+void CellModel::setup_thr(void* ctx, const u32 thr, const u32 numThr) {
+  CellModel* const m = (CellModel*)ctx;
+  (m->*(m->setupPhase))(m->setupWork, thr, numThr);
+}
+
+//// shuffle driven by the counter-based distribution stream; each pass of
+//// the setup uses its own counters. every element goes to a random bucket
+//// (keeping list order within it), then each bucket gets a fisher-yates
+//// shuffle. bucket sizes come out multinomial, so the permutation is uniform
+void CellModel::shuffle(vector<u32>& v, const u64 pass) {
+  ShuffleWork w;
+  w.v = &v;
+  w.pass = pass;
+  w.out.resize(v.size());
+  w.bucket.resize(v.size());
+  w.place.resize((u64)threads->numThreads * SHUFFLE_BUCKETS);
+  runSetup(&CellModel::shuffleBuckets, &w);
+  v.swap(w.out);
+}
+
+void CellModel::shuffleBuckets(void* work, const u32 thr, const u32 numThr) {
+  ShuffleWork* const w = (ShuffleWork*)work;
+  const vector<u32>& v = *(w->v);
+  u32* const place = &(w->place[(u64)thr * SHUFFLE_BUCKETS]);
+  u32 e0, e1;
+  ThreadPool::range(v.size(), thr, numThr, &e0, &e1);
+  for(u32 b=0; b<SHUFFLE_BUCKETS; b++) {
+    place[b] = 0;
+  }
+  for(u32 e=e0; e<e1; e++) {
+    const u16 b = (u16)Random::below(SHUFFLE_BUCKETS, rngSeed, eRandDistribute, w->pass, e);
+    w->bucket[e] = b;
+    place[b]++;
+  }
+  threads->sync();
+  // buckets in order, each holding the threads' elements in thread order
+  if (thr == 0) {
+    u32 sum = 0;
+    for(u32 b=0; b<SHUFFLE_BUCKETS; b++) {
+      w->start[b] = sum;
+      for(u32 t=0; t<numThr; t++) {
+        const u32 c = w->place[(u64)t * SHUFFLE_BUCKETS + b];
+        w->place[(u64)t * SHUFFLE_BUCKETS + b] = sum;
+        sum += c;
+      }
+    }
+    w->start[SHUFFLE_BUCKETS] = sum;
+  }
+  threads->sync();
+  for(u32 e=e0; e<e1; e++) {
+    w->out[place[w->bucket[e]]++] = v[e];
+  }
+  threads->sync();
+  u32 b0, b1;
+  ThreadPool::range(SHUFFLE_BUCKETS, thr, numThr, &b0, &b1);
+  for(u32 b=b0; b<b1; b++) {
+    u32* const o = &(w->out[0]) + w->start[b];
+    const u64 counter = ((w->pass + 1) << 32) | b;
+    for(u32 i=w->start[b + 1] - w->start[b]; i>1; i--) {
+      const u32 j = (u32)Random::below(i, rngSeed, eRandDistribute, counter, i);
+      swap(o[i-1], o[j]);
+    }
+  }
+}
+
+// blocks of a range of planes: set the exterior to boundary, and list
+// the others as shell or tablet
+void CellModel::classifyBlocks(void* work, const u32 thr, const u32 numThr) {
+  DistributeWork* const w = (DistributeWork*)work;
+  const u32 step = w->step;
+  vector<u32>& shell = w->shell[thr];
+  vector<u32>& tablet = w->tablet[thr];
+  u32 k0, k1;
+  ThreadPool::range(cubeLength / step, thr, numThr, &k0, &k1);
+  for(u32 k=k0*step; k<k1*step; k += step) {
+    for(u32 j=0; j<cubeLength; j += step) {
+      for(u32 i=0; i<cubeLength; i += step) {
+        const u32 idx = subToIdx(i, j, k);
+        const u32 dcX = i - w->cX + 1;
+        const u32 dcY = j - w->cY + 1;
+        const u32 r2 = (dcX * dcX) + (dcY * dcY);
+        if ((i < 1)
+            || (j < 1)
+            || (k < 1)
+            || (i > (cubeLength-1-step))
+            || (j > (cubeLength-1-step))
+            || (k < w->loBoundH)
+            || (k > w->hiBoundH)
+            || (r2 >= w->cubeR2) ) {
+          // exterior cells
+          if (step == 2) {
+            this->setBlockState(idx, eStateBound);
+          } else {
+            this->setCellState(idx, eStateBound);
+          }
+        } else if ((r2 > w->shellR2) || (k < w->loShellH) || (k > w->hiShellH)) {
+          shell.push_back(idx);
+        } else {
+          tablet.push_back(idx);
+        }
+      }
+    }
+  }
+}
+
+// blocks don't overlap, so any thread can set any of them
+void CellModel::assignBlocks(void* work, const u32 thr, const u32 numThr) {
+  DistributeWork* const w = (DistributeWork*)work;
+  static const eCellState states[3] = { eStatePoly, eStateDrug, eStateEx };
+  for(u8 l=0; l<3; l++) {
+    u32 b0, b1;
+    ThreadPool::range(w->count[l], thr, numThr, &b0, &b1);
+    for(u32 b=b0; b<b1; b++) {
+      if (w->step == 2) {
+        this->setBlockState(w->list[l][b], states[l]);
+      } else {
+        this->setCellState(w->list[l][b], states[l]);
+      }
+    }
+  }
+}
+
 //// cell type distribution (on 8-cell blocks)
 void CellModel::distribute(void) {
-  u32 i, j, k;      // temp cartesian coordinates
-  u32 cX, cY, cZ;   // center of cylinder
-  u32 cubeR2;       // squared radius of cylinder
-  u32 shellR2;      // squared radius at the inner edge of the shell
-  u32 r2;           // temp squared radius
-  u32 dcX, dcY;     // temp distance from center, cartesian
-  u32 idx;          // temp idx
+  u32 cZ;                 // center of cylinder
   u32 boundH;             // cylinder height in cells
-  u32 loBoundH, hiBoundH; // cylinder vertical bounds
-  u32 loShellH, hiShellH; // shell vertical bounds
-  
   u32 nPolyBlocks, nDrugBlocks;
-  
+  DistributeWork w;
+
+  // with compression, blocks are 2x2x2 and distances count double
+  w.step = this->compressFlag ? 2 : 1;
+  const u32 wS = wShell * w.step;
+
+  // cylinder dimensions
+  w.cX = cubeLength >> 1;
+  w.cY = w.cX;
+  cZ = w.cX;
+  w.cubeR2 = (w.cX-1) * (w.cX-1);
+  w.shellR2 = (w.cX-1-wS) * (w.cX-1-wS);
+
+  // number of cells in cylinder height
+  boundH = cylinderHeight * cubeLength;
+  w.loBoundH = cZ - (boundH >> 1);
+  w.hiBoundH = cZ + (boundH >> 1);
+  w.loShellH = w.loBoundH + wS;
+  w.hiShellH = w.hiBoundH - wS;
+
+  // divide the space: interior, exterior, shell
+  vector<vector<u32> > shells(threads->numThreads);
+  vector<vector<u32> > tablets(threads->numThreads);
+  w.shell = &(shells[0]);
+  w.tablet = &(tablets[0]);
+  runSetup(&CellModel::classifyBlocks, &w);
   vector<u32> shellIdx;   // cell idx's adjoining boundary
   vector<u32> tabletIdx;  // cell idx's inside cylinder
-  vector<u32> polyIdx;    
-  vector<u32> drugIdx;    
-  vector<u32> exIdx;   
-  
-  if (this->compressFlag) {
-
-    // cylinder dimensions
-    cX = cubeLength >> 1;
-    cY = cX;
-    cZ = cX;
-    cubeR2 = (cX-1) * (cX-1);
-    shellR2 = (cX-1-(wShell*2)) * (cX-1-(wShell*2));
-  
-    // number of cells in cylinder height
-    boundH = cylinderHeight * cubeLength;
-    loBoundH = cZ - (boundH >> 1);
-    hiBoundH = cZ + (boundH >> 1);
-    loShellH = loBoundH + (wShell*2);
-    hiShellH = hiBoundH - (wShell*2);
-  
-    // divide the space: interior, exterior, shell
-    for(u32 i=0; i<cubeLength; i += 2) {
-      for(u32 j=0; j<cubeLength; j += 2) {
-	for(u32 k=0; k<cubeLength; k += 2) {
-	  idx = subToIdx(i, j, k);
-	  dcX = i-cX+1;
-	  dcY = j-cY+1;
-	  r2 = (dcX * dcX) + (dcY * dcY);
-	  if ((i < 1) 
-	      || (j < 1) 
-	      || (k < 1)
-	      || (i > (cubeLength-3))
-	      || (j > (cubeLength-3))
-	      || (k < loBoundH)
-	      || (k > hiBoundH)
-	      || (r2 >= cubeR2) ) {
-	    // exterior cells
-	    this->setBlockState(idx, eStateBound);
-	  } // end outside-cylinder
-	  else { 
-	    if((r2 > shellR2) || (k < loShellH) || (k > hiShellH)) {
-	      shellIdx.push_back(idx);
-	    } else {
-	      tabletIdx.push_back(idx);
-	    }
-	  } // end outside-cylinder test
-	} // k
-      } // j
-    } // i
-  
-  } else { // no compression
-    // cylinder dimensions
-    cX = cubeLength >> 1;
-    cY = cX;
-    cZ = cX;
-    cubeR2 = (cX-1) * (cX-1);
-    shellR2 = (cX-1-(wShell)) * (cX-1-(wShell));
-  
-    // number of cells in cylinder height
-    boundH = cylinderHeight * cubeLength;
-    loBoundH = cZ - (boundH >> 1);
-    hiBoundH = cZ + (boundH >> 1);
-    loShellH = loBoundH + (wShell);
-    hiShellH = hiBoundH - (wShell);
-  
-    // divide the space: interior, exterior, shell
-    for(u32 i=0; i<cubeLength; i ++) {
-      for(u32 j=0; j<cubeLength; j ++) {
-	for(u32 k=0; k<cubeLength; k ++) {
-	  idx = subToIdx(i, j, k);
-	  dcX = i-cX+1;
-	  dcY = j-cY+1;
-	  r2 = (dcX * dcX) + (dcY * dcY);
-	  if ((i < 1) 
-	      || (j < 1) 
-	      || (k < 1)
-	      || (i > (cubeLength-2))
-	      || (j > (cubeLength-2))
-	      || (k < loBoundH)
-	      || (k > hiBoundH)
-	      || (r2 >= cubeR2) ) {
-	    // exterior cells
-	    this->setCellState(idx, eStateBound);
-	  } // end outside-cylinder
-	  else { 
-	    if((r2 > shellR2) || (k < loShellH) || (k > hiShellH)) {
-	      shellIdx.push_back(idx);
-	    } else {
-	      tabletIdx.push_back(idx);
-	    }
-	  } // end outside-cylinder test
-	} // k
-      } // j
-    } // i
+  for(u32 t=0; t<threads->numThreads; t++) {
+    shellIdx.insert(shellIdx.end(), shells[t].begin(), shells[t].end());
+    tabletIdx.insert(tabletIdx.end(), tablets[t].begin(), tablets[t].end());
+    vector<u32>().swap(shells[t]);
+    vector<u32>().swap(tablets[t]);
   }
 
   // shuffle the shell and tablet idx's 
-  random_shuffle(shellIdx.begin(), shellIdx.end());
-  random_shuffle(tabletIdx.begin(), tabletIdx.end());
+  shuffle(shellIdx, 0);
+  shuffle(tabletIdx, 1);
   
   ///// distribute polymer cells
   u32 nBlocks = shellIdx.size() + tabletIdx.size();
@@ -251,75 +351,81 @@ void CellModel::distribute(void) {
   u32 nPolyInTablet = nPolyBlocks - nPolyInShell;
   nPolyInTablet = min((unsigned int)nPolyInTablet, (unsigned int)(tabletIdx.size()));
   
-  ///// DEBUG
-  /*
-   if ((nPolyInShell + nPolyInTablet) != nPolyBlocks) {
-   int dum = 0;
-   dum++;
-   }
-   */
-  /////////////
-  
-  u32 n;
-  for(n=0; n < nPolyInShell; n++) {
-    polyIdx.push_back(shellIdx.back());
-    shellIdx.pop_back();
-  }
-  
-  for(n=0; n < nPolyInTablet; n++) {
-    polyIdx.push_back(tabletIdx.back());
-    tabletIdx.pop_back();
-  }
+  // polymer: the last of the shell and the last of the tablet
+  vector<u32> polyIdx(shellIdx.end() - nPolyInShell, shellIdx.end());
+  polyIdx.insert(polyIdx.end(), tabletIdx.end() - nPolyInTablet, tabletIdx.end());
+  shellIdx.resize(shellIdx.size() - nPolyInShell);
+  tabletIdx.resize(tabletIdx.size() - nPolyInTablet);
   
   // reassign all remaining shell idx's to tablet
-  const u32 shells = shellIdx.size();
-  for(n=0; n<shells; n++) {
-    tabletIdx.push_back(shellIdx.back());
-    shellIdx.pop_back();
-  }
+  tabletIdx.insert(tabletIdx.end(), shellIdx.begin(), shellIdx.end());
 	
   // re-shuffle
-  random_shuffle(tabletIdx.begin(), tabletIdx.end());
+  shuffle(tabletIdx, 2);
 	
-  //// distribute drug cells (shell and tablet);
-  for(n=0; n<nDrugBlocks; n++) {
-    drugIdx.push_back(tabletIdx.back());
-    tabletIdx.pop_back();
-  }
+  //// drug cells (shell and tablet) are the last of the tablet,
   //// everything else becomes excipient
-  const u32 tablets = tabletIdx.size();
-  for( n=0; n<tablets; n++) {
-    exIdx.push_back(tabletIdx.back());
-    tabletIdx.pop_back();
-  }
-  
-  // iterate over index vectors and fill 2x2x2 blocks
-  vector<u32>::iterator it;
-  if (this->compressFlag) {
-    for(it=polyIdx.begin(); it != polyIdx.end(); it++) {
-      this->setBlockState(*it, eStatePoly);
-    }
-    for(it=drugIdx.begin(); it != drugIdx.end(); it++) {
-    this->setBlockState(*it, eStateDrug);
-    }
-    for(it=exIdx.begin(); it != exIdx.end(); it++) {
-      this->setBlockState(*it, eStateEx);
-    }
-  } else {
-  for(it=polyIdx.begin(); it != polyIdx.end(); it++) {
-      this->setCellState(*it, eStatePoly);
-    }
-    for(it=drugIdx.begin(); it != drugIdx.end(); it++) {
-    this->setCellState(*it, eStateDrug);
+  const u32 nExBlocks = tabletIdx.size() - nDrugBlocks;
+  w.list[0] = polyIdx.empty() ? NULL : &(polyIdx[0]);
+  w.count[0] = polyIdx.size();
+  w.list[1] = tabletIdx.empty() ? NULL : &(tabletIdx[0]) + nExBlocks;
+  w.count[1] = nDrugBlocks;
+  w.list[2] = tabletIdx.empty() ? NULL : &(tabletIdx[0]);
+  w.count[2] = nExBlocks;
+  
+  // fill the blocks
+  runSetup(&CellModel::assignBlocks, &w);
+}
+
+/// compression step: each whole polymer block swaps its diagonal with the
+/// complementary diagonal of a random face neighbor block that is neither
+/// polymer nor swapped already. the blocks go in x-major order, and a block's
+/// swap only depends on blocks before it within two face steps (the ones that
+/// could take the same neighbor). in block coordinates every one of those has
+/// a smaller t = 3x + 2y + z, and no two blocks of the same t are that close,
+/// so the blocks of each t swap in parallel, one t after another, with the
+/// result of the serial sweep
+void CellModel::compress(void) {
+  runSetup(&CellModel::compressBlocks, NULL);
+}
+
+// each thread takes a range of x of every wavefront
+void CellModel::compressBlocks(void* /*work*/, const u32 thr, const u32 numThr) {
+  const u32 last = (cubeLength >> 1) - 1;
+  for(u32 t=0; t<=6*last; t++) {
+    // x with a block on the wavefront: 2y + z = t - 3x in [0, 3 last]
+    const u32 x0 = (t > 3*last) ? (t - 3*last + 2) / 3 : 0;
+    const u32 x1 = min(t / 3, last) + 1;
+    u32 i0, i1;
+    ThreadPool::range(x1 - x0, thr, numThr, &i0, &i1);
+    for(u32 x=x0+i0; x<x0+i1; x++) {
+      const u32 r = t - 3*x;
+      const u32 y0 = (r > last) ? (r - last + 1) / 2 : 0;
+      const u32 y1 = min(r / 2, last) + 1;
+      for(u32 y=y0; y<y1; y++) {
+        compressBlock(x << 1, y << 1, (r - 2*y) << 1, NULL);
+      }
     }
-    for(it=exIdx.begin(); it != exIdx.end(); it++) {
-      this->setCellState(*it, eStateEx);
+    threads->sync();
+  }
+}
+
+// the serial sweep, in x-major order, drawing its swaps from one sequential
+// stream like the original code did (compressHistogram() compares with it)
+void CellModel::compressSerial(void) {
+  u64 draws = 0;
+  for(u32 i=0; i<cubeLength; i += 2) {
+    for(u32 j=0; j<cubeLength; j += 2) {
+      for(u32 k=0; k<cubeLength; k += 2) {
+        compressBlock(i, j, k, &draws);
+      }
     }
   }
 }
 
-/// compression step
-void CellModel::compress(void) {
+// swap of the block at (i, j, k), if it is whole polymer. the swap is drawn
+// keyed on the block, or from the sequential stream if draws is given
+void CellModel::compressBlock(const u32 i, const u32 j, const u32 k, u64* draws) {
   u32 idx;
   u32 nIdx;
   u32 nIdx2;
@@ -331,94 +437,121 @@ void CellModel::compress(void) {
   // complementary diagonals
   const u8 diagsNot[4][3]	= { {1, 1, 1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
   
-  // each polymer block randomly swaps diagonal complements with neighbors
-  for(u32 i=0; i<cubeLength; i += 2) {
-    for(u32 j=0; j<cubeLength; j += 2) {
-      for(u32 k=0; k<cubeLength; k += 2) {
-        idx = subToIdx(i, j, k);
-        if( (cells[idx]->state == eStatePoly) && (cells[idx+1]->state == eStatePoly) ) {
-          u32 nIdxBase[3] = {i, j, k};
-          // only want to swap with neighbor meta-cells that are not poly...
-          // array for storing neighbor idx's which meet this criterion.
-          u64 notPolyN[6] = { 0, 0, 0, 0, 0, 0 };
-          u8 numNotPolyN = 0;
-          u8 swapN;
-          
-          for (u8 n=0; n < NUM_NEIGHBORS; n++) {
-            switch(n) { 
-              case 0:
-                nIdxBase[0] = i+2;
-                nIdxBase[1] = j;
-                nIdxBase[2] = k;
-                break;
-              case 1:
-                nIdxBase[0] = i-2;
-                nIdxBase[1] = j;
-                nIdxBase[2] = k;
-                break;
-              case 2:
-                nIdxBase[0] = i;
-                nIdxBase[1] = j+2;
-                nIdxBase[2] = k;
-                break;
-              case 3:
-                nIdxBase[0] = i;
-                nIdxBase[1] = j-2;
-                nIdxBase[2] = k;
-                break;
-              case 4:
-                nIdxBase[0] = i;
-                nIdxBase[1] = j;
-                nIdxBase[2] = k+2;
-                break;
-              case 5:
-                nIdxBase[0] = i;
-                nIdxBase[1] = j;
-                nIdxBase[2] = k-2;
-                break;
-              default:
-                nIdxBase[0] = i;
-                nIdxBase[1] = j;
-                nIdxBase[2] = k;
-                break;
-            }
-            nIdx = subToIdx(nIdxBase[0], nIdxBase[1], nIdxBase[2]);
-            if( (cells[nIdx]->state != eStatePoly)
-               && (cells[nIdx+1]->state != eStatePoly)
-               && (cells[nIdx+1]->state != eStateBound)) {
-              // this neighbor is not polymer, and has not been swapped, so add it to the swappable list
-              notPolyN[numNotPolyN] = nIdx;
-              numNotPolyN++;
-            }
-          }
-          
-          // continue loop if there are no non-poly neighors,
-          // otherwise randomly choose between them and swap diagonals
-          if (numNotPolyN == 0) { continue; } 
-          else {
-            swapN = (u8)(getRand() * ((f64)numNotPolyN  - 0.5f));
-            idxToSub(notPolyN[swapN], &(nIdxBase[0]), &(nIdxBase[1]), &(nIdxBase[2]));
-            for(diag = 0; diag<4; diag++) {
-              nIdx = subToIdx(i+diags[diag][0], j+diags[diag][1], k+diags[diag][2]);
-              nIdx2 = subToIdx(nIdxBase[0]+diagsNot[diag][0], nIdxBase[1]+diagsNot[diag][1], nIdxBase[2]+diagsNot[diag][2]);
-              swapstate = cells[nIdx2]->state;
-              if (swapstate != eStateBound) {
-                cells[nIdx2]->state = cells[nIdx]->state;
-                cells[nIdx]->state = swapstate;
-              }
-            }
-          }
+  idx = subToIdx(i, j, k);
+  if( (cells.state[idx] == eStatePoly) && (cells.state[subToIdx(i+1, j, k)] == eStatePoly) ) {
+    u32 nIdxBase[3] = {i, j, k};
+    // only want to swap with neighbor meta-cells that are not poly...
+    // array for storing neighbor idx's which meet this criterion.
+    u64 notPolyN[6] = { 0, 0, 0, 0, 0, 0 };
+    u8 numNotPolyN = 0;
+    u8 swapN;
+    
+    for (u8 n=0; n < NUM_FACES; n++) {
+      switch(n) { 
+        case 0:
+          nIdxBase[0] = i+2;
+          nIdxBase[1] = j;
+          nIdxBase[2] = k;
+          break;
+        case 1:
+          nIdxBase[0] = i-2;
+          nIdxBase[1] = j;
+          nIdxBase[2] = k;
+          break;
+        case 2:
+          nIdxBase[0] = i;
+          nIdxBase[1] = j+2;
+          nIdxBase[2] = k;
+          break;
+        case 3:
+          nIdxBase[0] = i;
+          nIdxBase[1] = j-2;
+          nIdxBase[2] = k;
+          break;
+        case 4:
+          nIdxBase[0] = i;
+          nIdxBase[1] = j;
+          nIdxBase[2] = k+2;
+          break;
+        case 5:
+          nIdxBase[0] = i;
+          nIdxBase[1] = j;
+          nIdxBase[2] = k-2;
+          break;
+        default:
+          nIdxBase[0] = i;
+          nIdxBase[1] = j;
+          nIdxBase[2] = k;
+          break;
+      }
+      nIdx = subToIdx(nIdxBase[0], nIdxBase[1], nIdxBase[2]);
+      nIdx2 = subToIdx(nIdxBase[0] + 1, nIdxBase[1], nIdxBase[2]);
+      if( (cells.state[nIdx] != eStatePoly)
+         && (cells.state[nIdx2] != eStatePoly)
+         && (cells.state[nIdx2] != eStateBound)) {
+        // this neighbor is not polymer, and has not been swapped, so add it to the swappable list
+        notPolyN[numNotPolyN] = nIdx;
+        numNotPolyN++;
+      }
+    }
+    
+    // nothing to do if there are no non-poly neighors,
+    // otherwise randomly choose between them and swap diagonals
+    if (numNotPolyN == 0) { return; } 
+    else {
+      const f64 rnd = draws ? getRand(eRandCompress, 1, (*draws)++)
+                            : getRand(eRandCompress, 0, linearIdx(idx));
+      swapN = (u8)(rnd * ((f64)numNotPolyN  - 0.5f));
+      idxToSub(notPolyN[swapN], &(nIdxBase[0]), &(nIdxBase[1]), &(nIdxBase[2]));
+      for(diag = 0; diag<4; diag++) {
+        nIdx = subToIdx(i+diags[diag][0], j+diags[diag][1], k+diags[diag][2]);
+        nIdx2 = subToIdx(nIdxBase[0]+diagsNot[diag][0], nIdxBase[1]+diagsNot[diag][1], nIdxBase[2]+diagsNot[diag][2]);
+        swapstate = (eCellState)cells.state[nIdx2];
+        if (swapstate != eStateBound) {
+          cells.state[nIdx2] = cells.state[nIdx];
+          cells.state[nIdx] = swapstate;
         }
       }
     }
   }
 }
 
+// distribute and compress (by wavefronts or serially), then count polymer face
+// neighbors of the tablet's cells
+void CellModel::compressHistogram(const u8 serial, u64* hist) {
+  distribute();
+  if (compressFlag) {
+    if (serial) {
+      compressSerial();
+    } else {
+      compress();
+    }
+  }
+  for(u32 h=0; h<2 * (NUM_FACES + 1); h++) {
+    hist[h] = 0;
+  }
+  u32 nIdx[NUM_FACES];
+  for(u32 z=1; z<cubeLength-1; z++) {
+    for(u32 y=1; y<cubeLength-1; y++) {
+      for(u32 x=1; x<cubeLength-1; x++) {
+        const u32 idx = subToIdx(x, y, z);
+        const u8 state = cells.state[idx];
+        if ((state == eStateBound) || isExterior(idx)) { continue; }
+        neighbors<Stencil6>(idx, nIdx);
+        const u8 np = __builtin_popcountl(classMask<Stencil6>(neighborClasses<Stencil6>(nIdx), eClassPoly));
+        hist[((state == eStatePoly) ? 0 : (NUM_FACES + 1)) + np]++;
+      }
+    }
+  }
+}
+
 // set state of a 2x2x2 block of cells
 void CellModel::setBlockState(const u32 idx, eCellState state) {
   u32 i, j, k;
   u32 nIdx;
   u8 l, m, n, diag;
+  // the exterior brick is boundary already
+  if (isExterior(idx)) { return; }
   idxToSub(idx, &i, &j, &k);
   
   static const u8 diags[4][3]	= { {0, 0, 0}, {0, 1, 1}, {1, 0, 1}, {1, 1, 0} };
@@ -438,7 +571,7 @@ void CellModel::setBlockState(const u32 idx, eCellState state) {
         for(m=0; m<2; m++) {
           for(n=0; n<2; n++) {
             nIdx = subToIdx(i+l, j+m, k+n);
-            cells[nIdx]->state = state;
+            cells.state[nIdx] = state;
           }
         }
       }
@@ -447,26 +580,28 @@ void CellModel::setBlockState(const u32 idx, eCellState state) {
       // drug cells: fill diagonals
       for(diag = 0; diag<4; diag++) {
         nIdx = subToIdx(i+diags[diag][0], j+diags[diag][1], k+diags[diag][2]);
-        cells[nIdx]->state = eStateDrug;
+        cells.state[nIdx] = eStateDrug;
       }
       // opposite diagonals are empty
       for(diag = 0; diag<4; diag++) {
         nIdx = subToIdx(i+diagsNot[diag][0], j+diagsNot[diag][1], k+diagsNot[diag][2]);
-        cells[nIdx]->state = eStateVoid;
+        cells.state[nIdx] = eStateVoid;
       }
       break;
     case eStateEx:
       // excipient cells: fill diagonals
       for(diag = 0; diag<4; diag++) {
         u32	nIdx = subToIdx(i+diags[diag][0], j+diags[diag][1], k+diags[diag][2]);
-        cells[nIdx]->state = eStateEx;
+        cells.state[nIdx] = eStateEx;
       }
       // opposite diagonals are empty
       for(diag = 0; diag<4; diag++) {
         nIdx = subToIdx(i+diagsNot[diag][0], j+diagsNot[diag][1], k+diagsNot[diag][2]);
-        cells[nIdx]->state = eStateVoid;
+        cells.state[nIdx] = eStateVoid;
       }
       break;
+    default:
+      break;
   }
 }
 
@@ -474,6 +609,8 @@ void CellModel::setBlockState(const u32 idx, eCellState state) {
 // set state of a single cell
 void CellModel::setCellState(const u32 idx, eCellState state) {
   u32 i, j, k;
+  // the exterior brick is boundary already
+  if (isExterior(idx)) { return; }
   idxToSub(idx, &i, &j, &k);
   
   // force border cells to assume boundary state
@@ -482,45 +619,98 @@ void CellModel::setCellState(const u32 idx, eCellState state) {
     state = eStateBound;
   }
 
-  cells[idx]->state = state;
+  cells.state[idx] = state;
 }
 
 void CellModel::findCellsToProcess(void) {
-  /// find cells to process
-  numCellsToProcess = 0;
+  if (stencil == eStencil26) {
+    findCellsToProcess<Stencil26>();
+  } else {
+    findCellsToProcess<Stencil6>();
+  }
+}
+
+// work of the active cell search
+struct FindCellsWork {
+  // per thread: active cells of its planes in index order, and counts of
+  // drug cells and of drug cells trapped by polymer
+  vector<u32>* proc;
+  u64* drug;
+  u64* trapped;
+  // all active cells
+  const u32* procIdx;
+};
+
+template<class S> void CellModel::findCellsToProcess(void) {
+  FindCellsWork w;
+  vector<vector<u32> > proc(threads->numThreads);
+  vector<u64> drug(threads->numThreads, 0);
+  vector<u64> trapped(threads->numThreads, 0);
+  w.proc = &(proc[0]);
+  w.drug = &(drug[0]);
+  w.trapped = &(trapped[0]);
+  runSetup(&CellModel::findCellsRange<S>, &w);
+
+  // put the threads' cells together; slots are kept in index order
+  drugMassTotal = 0.0;
+  vector<u32> procIdx;
+  for(u32 t=0; t<threads->numThreads; t++) {
+    const u32 n0 = procIdx.size();
+    procIdx.insert(procIdx.end(), proc[t].begin(), proc[t].end());
+    vector<u32>().swap(proc[t]);
+    if (layout != eLayoutLinear) {
+      inplace_merge(procIdx.begin(), procIdx.begin() + n0, procIdx.end());
+    }
+    drugMassTotal += (f64)drug[t];
+    trappedDrugMass += (f64)trapped[t];
+  }
+
+  // allocate and fill the per-active-cell data
+  numCellsToProcess = procIdx.size();
+  this->allocSlots();
+  w.procIdx = procIdx.empty() ? NULL : &(procIdx[0]);
+  runSetup(&CellModel::fillSlots, &w);
+}
+
+// active cells of a range of planes
+template<class S> void CellModel::findCellsRange(void* work, const u32 thr, const u32 numThr) {
+  FindCellsWork* const w = (FindCellsWork*)work;
+  vector<u32>& procIdx = w->proc[thr];
   u8 proc = 0;
+  u32 nIdx[S::size];
   eCellState tmpState;
-  
-  drugMassTotal = 0.0;
-  
-  for(u32 i=0; i<numCells; i++) {
-    findNeighbors(cells[i]);
+  u32 z0, z1;
+  ThreadPool::range(cubeLength - 2, thr, numThr, &z0, &z1);
+  
+  // the outer face is bound and can't be active, so only the interior is
+  // visited, and every neighbor step stays inside the grid
+  for(u32 z=z0+1; z<z1+1; z++) {
+  for(u32 y=1; y<cubeLength-1; y++) {
+  for(u32 x=1; x<cubeLength-1; x++) {
+    const u32 i = subToIdx(x, y, z);
+    if (isExterior(i)) { continue; }
     proc=0;
-    switch (cells[i]->state) {
+    switch (cells.state[i]) {
       case eStatePoly:
         proc = 0;
         break;
       case eStateDrug:
         proc = 1;
-        drugMassTotal += 1.0;
+        w->drug[thr]++;
         break;
       case eStateEx:
         proc = 1;
         break;
       case eStateVoid:
         proc = 1;
-        // printf("{ %d, %d } ; ", (int)numCellsToProcess, (int)cells[i]->idx);
         break;
       case eStateBound:
         // want to process boundary cells only if they adjoin a non-boundary, non-poly
-        for(u8 ni = 0; ni<NUM_NEIGHBORS; ni++) {
-          tmpState = cells[cells[i]->neighborIdx[ni]]->state;
+        neighbors<S>(i, nIdx);
+        for(u8 ni = 0; ni<S::size; ni++) {
+          tmpState = (eCellState)cells.state[nIdx[ni]];
           proc |= ((tmpState == eStateDrug) || (tmpState == eStateEx) || (tmpState == eStateVoid));
         }
-        ////// DEBUG:
-        // if(proc) { cellsAdjoining++; }
-        //  dum++;
-        /////////
         break;
       default:
         proc = 0;
@@ -528,39 +718,184 @@ void CellModel::findCellsToProcess(void) {
     }
     
     if(proc) { 	
-      // find neighbors-with-polymer count
-      u8 np = 0;
-      for(u8 nb=0; nb<NUM_NEIGHBORS; nb++) {
-        if ( cells[cells[i]->neighborIdx[nb]]->state == eStatePoly ) {
-          np++;
-        }
-      }
-			
       // don't need to process if cell is trapped by polymer
-      if (np > 5) {
-        if(cells[i]->state == eStateDrug) {
-          trappedDrugMass += 1.0;
+      if (polyNeighbors<S>(i) == S::size) {
+        if(cells.state[i] == eStateDrug) {
+          w->trapped[thr]++;
         }
         continue;
       }
+      procIdx.push_back(i);
+    }
+  }
+  }
+  }
+  if (layout != eLayoutLinear) {
+    std::sort(procIdx.begin(), procIdx.end());
+  }
+}
+
+// per-slot data of a range of slots
+void CellModel::fillSlots(void* work, const u32 thr, const u32 numThr) {
+  const u32* const procIdx = ((FindCellsWork*)work)->procIdx;
+  u32 p0, p1;
+  ThreadPool::range(numCellsToProcess, thr, numThr, &p0, &p1);
+  for(u32 p=p0; p<p1; p++) {
+    const u32 i = procIdx[p];
+    // the tables go by polymer faces, in either stencil
+    const u8 np = polyNeighbors<Stencil6>(i);
+    cellsToProcess[p] = i;
+    rngIdx[p] = linearIdx(i);
+
+    dissCount[p] = 0;
+    diffMul[p] = diffNMul[np];
+    dissSteps[p] = (u32)((f64)dissNSteps[np] * dissratescale);
+    dissInc[p] = 1.0 / (f64)(dissSteps[p]);
+    dissProb[p] = 0.0;
 			
-      cellsToProcess[numCellsToProcess] = cells[i]->idx;
-      numCellsToProcess++;
-			
-      cells[i]->diffMul = diffNMul[np];
-      cells[i]->dissSteps = (u32)((f64)dissNSteps[np] * dissratescale);
-      cells[i]->dissInc = 1.0 / (f64)(cells[i]->dissSteps);
-			
-      // set dissolution probability depending on cell type
-      if(cells[i]->state == eStateDrug) {
-        cells[i]->dissProb = dissProbDrug;
-      }
-      if(cells[i]->state == eStateEx) {
-        cells[i]->dissProb = dissProbEx;
-      }
-      if(cells[i]->state == eStateVoid) {
-        cells[i]->dissProb = 1.0;
-      }
+    // set dissolution probability depending on cell type
+    if(cells.state[i] == eStateDrug) {
+      dissProb[p] = dissProbDrug;
+    }
+    if(cells.state[i] == eStateEx) {
+      dissProb[p] = dissProbEx;
+    }
+    if(cells.state[i] == eStateVoid) {
+      dissProb[p] = 1.0;
     }
   }
-} 
+}
+
+// count of a cell's neighbors that are polymer
+template<class S> u8 CellModel::polyNeighbors(const u32 idx) {
+  u32 nIdx[S::size];
+  neighbors<S>(idx, nIdx);
+  return __builtin_popcountl(classMask<S>(neighborClasses<S>(nIdx), eClassPoly));
+}
+
+// allocate the per-active-cell data for numCellsToProcess slots
+// (replacing any from an earlier call)
+void CellModel::allocSlots(void) {
+  this->freeSlots();
+  cellsToProcess =  new u32 [numCellsToProcess];
+  rngIdx =          new u32 [numCellsToProcess];
+  dissCount =       new u16 [numCellsToProcess];
+  dissSteps =       new u16 [numCellsToProcess];
+  dissInc =         new f64 [numCellsToProcess];
+  diffMul =         new f64 [numCellsToProcess];
+  dissProb =        new f64 [numCellsToProcess];
+  numMassChunks = (numCellsToProcess + massChunkSize - 1) / massChunkSize;
+  massPartial =     new f64 [numMassChunks];
+  frontier =        new u32 [numCellsToProcess];
+  frontierAdd =     new u32 [numCellsToProcess];
+  inFrontier =      new u8 [numCellsToProcess];
+  if (sleepTol > 0.0) {
+    slotSleepBrick = new u32 [numCellsToProcess];
+    sleepSlots =     new u32 [numCellsToProcess];
+  }
+  if (stepMultiple > 1) {
+    // (vectors have an entry past the last row)
+    const u32 chunks = numCellsToProcess / massChunkSize + 1;
+    rowSlot =        new u32 [numCellsToProcess];
+    cellRow =        new u32 [numCells];
+    rowNbr =         new u32 [(u64)numCellsToProcess * numNeighbors];
+    rowNw =          new u8 [numCellsToProcess];
+    rowDecay =       new u32 [numCellsToProcess];
+    cgX =            new f64 [2 * (numCellsToProcess + 1)];
+    cgR =            new f64 [2 * (numCellsToProcess + 1)];
+    cgR0 =           new f64 [2 * (numCellsToProcess + 1)];
+    cgP =            new f64 [2 * (numCellsToProcess + 1)];
+    cgPHat =         new f64 [2 * (numCellsToProcess + 1)];
+    cgV =            new f64 [2 * (numCellsToProcess + 1)];
+    cgSHat =         new f64 [2 * (numCellsToProcess + 1)];
+    cgT =            new f64 [2 * (numCellsToProcess + 1)];
+    cgPartial =      new f64 [2 * chunks * IMPLICIT_PARTIALS];
+    rowMass =        new f64 [chunks];
+    wetAt =          new u32 [numCellsToProcess];
+    for(u32 i=0; i<numCells; i++) {
+      cellRow[i] = 0;
+    }
+  }
+}
+
+void CellModel::freeSlots(void) {
+  delete[] cellsToProcess;
+  delete[] rngIdx;
+  delete[] dissCount;
+  delete[] dissSteps;
+  delete[] dissInc;
+  delete[] diffMul;
+  delete[] dissProb;
+  delete[] massPartial;
+  delete[] frontier;
+  delete[] frontierAdd;
+  delete[] inFrontier;
+  delete[] slotSleepBrick;
+  delete[] sleepSlots;
+  delete[] rowSlot;
+  delete[] cellRow;
+  delete[] rowNbr;
+  delete[] rowNw;
+  delete[] rowDecay;
+  delete[] cgX;
+  delete[] cgR;
+  delete[] cgR0;
+  delete[] cgP;
+  delete[] cgPHat;
+  delete[] cgV;
+  delete[] cgSHat;
+  delete[] cgT;
+  delete[] cgPartial;
+  delete[] rowMass;
+  delete[] wetAt;
+}
+
+// initial frontier: active cells with a neighbor they can exchange with.
+// (boundary cells only exchange with wet cells, so none start out active.)
+void CellModel::initFrontier(void) {
+  runSetup(&CellModel::frontierFlags, NULL);
+  numFrontier = 0;
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    if (inFrontier[p]) {
+      frontier[numFrontier++] = p;
+    }
+  }
+}
+
+void CellModel::frontierFlags(void* /*work*/, const u32 thr, const u32 numThr) {
+  u32 p0, p1;
+  ThreadPool::range(numCellsToProcess, thr, numThr, &p0, &p1);
+  for(u32 p=p0; p<p1; p++) {
+    const u32 idx = cellsToProcess[p];
+    const u8 state = cells.state[idx];
+    u8 nw = 0;
+    u32 nIdx[MAX_NEIGHBORS];
+    findNeighbors(idx, nIdx);
+    for(u8 i=0; i<numNeighbors; i++) {
+      const u8 nState = cells.state[nIdx[i]];
+      nw += (nState == eStateWet) || ((nState == eStateBound) && (state != eStateBound));
+    }
+    inFrontier[p] = (nw > 0);
+  }
+}
+
+// (work is the buffer)
+void CellModel::clearCells(void* work, const u32 thr, const u32 numThr) {
+  CellBuffer* const buf = (CellBuffer*)work;
+  u32 i0, i1;
+  ThreadPool::range(numCells, thr, numThr, &i0, &i1);
+  for(u32 i=i0; i<i1; i++) {
+    buf->state[i] = eStateDummy;
+    buf->concentration[0][i] = 0.0;
+    buf->concentration[1][i] = 0.0;
+  }
+}
+
+void CellModel::copyCells(void* work, const u32 thr, const u32 numThr) {
+  CellBuffer* const buf = (CellBuffer*)work;
+  u32 i0, i1;
+  ThreadPool::range(numCells, thr, numThr, &i0, &i1);
+  memcpy(buf->state + i0, cells.state + i0, (i1 - i0) * sizeof(u8));
+  memcpy(buf->concentration[0] + i0, cells.concentration[0] + i0, (i1 - i0) * sizeof(conc_t));
+  memcpy(buf->concentration[1] + i0, cells.concentration[1] + i0, (i1 - i0) * sizeof(conc_t));
+}
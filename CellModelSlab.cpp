@@ -0,0 +1,186 @@
+/*
+ *  CellModelSlab.cpp
+ *  celldiff
+ *
+ *  slab decomposition (see Slab.hpp): each process keeps the active cells
+ *  of its planes [slabZ0, slabZ1) and the cells of those planes and one
+ *  plane on either side. the planes on either side (the halo) are only
+ *  read by the update; after each step they are replaced by the cells of
+ *  the neighboring slabs, and cells next to halo cells that just got wet
+ *  join the frontier, as they would next to a wet cell of the slab.
+ *
+ *  linear layout only: a plane is then a contiguous run of cells, and the
+ *  active cells of a slab a contiguous run of slots.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include "CellModel.hpp"
+#include "Slab.hpp"
+
+using namespace std;
+
+// boundaries between slabs, with about the same count of active cells in each
+int CellModel::splitSlabs(const u32 n) {
+  if ((layout != eLayoutLinear) || (n == 0) || (numCellsToProcess == 0)) { return -1; }
+  // active cells per plane
+  vector<u32> count(cubeLength, 0);
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    count[cellsToProcess[p] / cubeLength2]++;
+  }
+  const u32 zMin = cellsToProcess[0] / cubeLength2;
+  const u32 zMax = cellsToProcess[numCellsToProcess - 1] / cubeLength2;
+  if (n > zMax - zMin + 1) { return -1; }
+
+  // each slab starts where the cells before it reach its share,
+  // and holds at least one plane from zMin to zMax
+  slabStart.assign(n + 1, 0);
+  slabStart[n] = cubeLength;
+  u32 z = 0;
+  u64 before = 0;
+  for(u32 s=1; s<n; s++) {
+    const u64 share = (u64)numCellsToProcess * s / n;
+    while ((z < cubeLength) && (before + count[z] <= share)) {
+      before += count[z++];
+    }
+    const u32 lo = max(slabStart[s - 1], zMin) + 1;
+    const u32 hi = zMax + 1 - (n - s);
+    slabStart[s] = min(max(z, lo), hi);
+  }
+  return 0;
+}
+
+// bytes of one plane of cells sent between slabs: states, then concentrations
+u64 CellModel::slabPlaneBytes(void) {
+  return (u64)cubeLength2 * (sizeof(u8) + 2 * sizeof(conc_t));
+}
+
+// keep only this slab's part of the model set up by setup() and splitSlabs()
+void CellModel::setSlab(SlabTransport* transport) {
+  slabs = transport;
+  slabZ0 = slabStart[slabs->slab];
+  slabZ1 = slabStart[slabs->slab + 1];
+  const u32 p0 = lower_bound(cellsToProcess, cellsToProcess + numCellsToProcess, slabZ0 * cubeLength2)
+    - cellsToProcess;
+  const u32 p1 = lower_bound(cellsToProcess, cellsToProcess + numCellsToProcess, slabZ1 * cubeLength2)
+    - cellsToProcess;
+
+  // drug mass of this slab's cells; slab 0 also keeps the mass outside the
+  // active cells (trapped drug), so the slabs add up to the whole model
+  const f64 untracked = drugMass - calcDrugMass(0, numCellsToProcess);
+  drugMass = calcDrugMass(p0, p1) + ((slabs->slab == 0) ? untracked : 0.0);
+
+  // per-slot data of the slab's slots, and its part of the frontier
+  const vector<u32> ctp(cellsToProcess + p0, cellsToProcess + p1);
+  const vector<u32> rng(rngIdx + p0, rngIdx + p1);
+  const vector<u16> count(dissCount + p0, dissCount + p1);
+  const vector<u16> steps(dissSteps + p0, dissSteps + p1);
+  const vector<f64> inc(dissInc + p0, dissInc + p1);
+  const vector<f64> mul(diffMul + p0, diffMul + p1);
+  const vector<f64> prob(dissProb + p0, dissProb + p1);
+  const vector<u8> in(inFrontier + p0, inFrontier + p1);
+  vector<u32> front;
+  for(u32 f=0; f<numFrontier; f++) {
+    if ((frontier[f] >= p0) && (frontier[f] < p1)) {
+      front.push_back(frontier[f] - p0);
+    }
+  }
+  numCellsToProcess = p1 - p0;
+  allocSlots();
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    cellsToProcess[p] = ctp[p];
+    rngIdx[p] = rng[p];
+    dissCount[p] = count[p];
+    dissSteps[p] = steps[p];
+    dissInc[p] = inc[p];
+    diffMul[p] = mul[p];
+    dissProb[p] = prob[p];
+    inFrontier[p] = in[p];
+  }
+  numFrontier = front.size();
+  for(u32 f=0; f<numFrontier; f++) {
+    frontier[f] = front[f];
+  }
+
+  // cell buffers of the slab and its halo, allocated here so each process
+  // first touches its own cells. indices stay those of the whole cube
+  const u32 lo = ((slabZ0 > 0) ? (slabZ0 - 1) : 0) * cubeLength2;
+  const u32 hi = min(slabZ1 + 1, cubeLength) * cubeLength2;
+  CellBuffer* const bufs[2] = { &cells, &cellsUpdate };
+  for(u8 b=0; b<2; b++) {
+    CellBuffer window;
+    window.state = new u8 [hi - lo + STATE_PAD];
+    window.concentration[0] = new conc_t [hi - lo];
+    window.concentration[1] = new conc_t [hi - lo];
+    memcpy(window.state, bufs[b]->state + lo, (hi - lo) * sizeof(u8));
+    memset(window.state + (hi - lo), eStateDummy, STATE_PAD);
+    memcpy(window.concentration[0], bufs[b]->concentration[0] + lo, (hi - lo) * sizeof(conc_t));
+    memcpy(window.concentration[1], bufs[b]->concentration[1] + lo, (hi - lo) * sizeof(conc_t));
+    freeBuffer(bufs[b]);
+    bufs[b]->state = window.state - lo;
+    bufs[b]->concentration[0] = window.concentration[0] - lo;
+    bufs[b]->concentration[1] = window.concentration[1] - lo;
+  }
+  slabLo = lo;
+  slabHi = hi;
+
+  // planes sent down and up, and received from below and above
+  slabBuf = new u8 [4 * slabPlaneBytes()];
+}
+
+// copy plane z of the current buffer out
+void CellModel::packPlane(const u32 z, u8* dst) {
+  const u32 i0 = z * cubeLength2;
+  memcpy(dst, cells.state + i0, cubeLength2 * sizeof(u8));
+  dst += cubeLength2 * sizeof(u8);
+  memcpy(dst, cells.concentration[eStateDrug] + i0, cubeLength2 * sizeof(conc_t));
+  dst += cubeLength2 * sizeof(conc_t);
+  memcpy(dst, cells.concentration[eStateEx] + i0, cubeLength2 * sizeof(conc_t));
+}
+
+// replace halo plane z with a neighbor's plane, adding slots next to cells
+// that just got wet to frontierAdd; returns the new count of additions
+u32 CellModel::unpackPlane(const u32 z, const u8* src, u32 nAdd) {
+  const u32 i0 = z * cubeLength2;
+  u32 nIdx[MAX_NEIGHBORS];
+  for(u32 i=0; i<cubeLength2; i++) {
+    if ((src[i] != eStateWet) || (cells.state[i0 + i] == eStateWet)) { continue; }
+    findNeighbors(i0 + i, nIdx);
+    for(u8 j=0; j<numNeighbors; j++) {
+      const u32 q = findSlot(nIdx[j]);
+      if ((q < numCellsToProcess) && !inFrontier[q]) {
+        inFrontier[q] = 1;
+        frontierAdd[nAdd++] = q;
+      }
+    }
+  }
+  // both buffers: the next commit leaves the halo where it is
+  const u8* const drug = src + cubeLength2 * sizeof(u8);
+  const u8* const ex = drug + cubeLength2 * sizeof(conc_t);
+  CellBuffer* const bufs[2] = { &cells, &cellsUpdate };
+  for(u8 b=0; b<2; b++) {
+    memcpy(bufs[b]->state + i0, src, cubeLength2 * sizeof(u8));
+    memcpy(bufs[b]->concentration[eStateDrug] + i0, drug, cubeLength2 * sizeof(conc_t));
+    memcpy(bufs[b]->concentration[eStateEx] + i0, ex, cubeLength2 * sizeof(conc_t));
+  }
+  return nAdd;
+}
+
+// after a step: trade edge planes with the neighboring slabs
+void CellModel::exchangeHalo(void) {
+  const u64 bytes = slabPlaneBytes();
+  u8* const sendLo = slabBuf;
+  u8* const sendHi = slabBuf + bytes;
+  u8* const below = slabBuf + 2 * bytes;
+  u8* const above = slabBuf + 3 * bytes;
+  const bool hasBelow = (slabs->slab > 0);
+  const bool hasAbove = (slabs->slab + 1 < slabs->numSlabs);
+  if (hasBelow) { packPlane(slabZ0, sendLo); }
+  if (hasAbove) { packPlane(slabZ1 - 1, sendHi); }
+  slabs->exchange(hasBelow ? sendLo : NULL, hasAbove ? sendHi : NULL,
+                  hasBelow ? below : NULL, hasAbove ? above : NULL);
+  u32 nAdd = 0;
+  if (hasBelow) { nAdd = unpackPlane(slabZ0 - 1, below, nAdd); }
+  if (hasAbove) { nAdd = unpackPlane(slabZ1, above, nAdd); }
+  numFrontier = mergeFrontier(numFrontier, nAdd);
+}
@@ -0,0 +1,202 @@
+/*
+ *  CellModelSleep.cpp
+ *  celldiff
+ *
+ *  sleeping bricks: late in a run most wet cells barely change from one
+ *  step to the next. cells are grouped in cubes of SLEEP_BRICK_LENGTH^3
+ *  (by coordinates, so the same in every layout). after a step, a brick
+ *  whose wet and boundary cells all changed by no more than sleepTol, and
+ *  with no brick around it changing by more, leaves the frontier with its
+ *  values held in both buffers. it wakes as soon as a brick around it
+ *  changes by more than sleepTol. dry, dissolving and newly wet cells keep
+ *  their brick (and so the bricks around it) awake.
+ *
+ *  error bound: a region left to diffuse doesn't change faster than it did,
+ *  so each skipped update would have moved its cell by at most sleepTol.
+ *  sleepBound (sleepTol per skipped wet or boundary cell update) bounds the
+ *  drug mass the held cells could have exchanged, and sleepCellBound() the
+ *  drift of any one cell.
+ */
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "CellModel.hpp"
+
+using namespace std;
+
+// brick flags; every brick starts awake
+void CellModel::allocSleep(void) {
+  sleepBricks = (cubeLength + SLEEP_BRICK_LENGTH - 1) >> SLEEP_BRICK_BITS;
+  numSleepBricks = sleepBricks * sleepBricks * sleepBricks;
+  brickAwake = new u8 [numSleepBricks];
+  brickChange = new f64 [numSleepBricks * threads->numThreads];
+  brickNear = new u8 [2 * numSleepBricks];
+  brickSleptAt = new u64 [numSleepBricks];
+  sleepSlotStart = new u32 [numSleepBricks + 1];
+  for(u32 b=0; b<numSleepBricks * threads->numThreads; b++) {
+    brickChange[b] = 0.0;
+  }
+  for(u32 b=0; b<numSleepBricks; b++) {
+    brickAwake[b] = 1;
+    brickSleptAt[b] = 0;
+  }
+}
+
+// brick of each slot and slots of each brick, once the active cells are known.
+// (brickAwake may come from a checkpoint)
+void CellModel::initSleep(void) {
+  if (sleepTol <= 0.0) { return; }
+  u32 x, y, z;
+  for(u32 b=0; b<=numSleepBricks; b++) {
+    sleepSlotStart[b] = 0;
+  }
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    idxToSub(cellsToProcess[p], &x, &y, &z);
+    const u32 b = ((z >> SLEEP_BRICK_BITS) * sleepBricks + (y >> SLEEP_BRICK_BITS)) * sleepBricks
+      + (x >> SLEEP_BRICK_BITS);
+    slotSleepBrick[p] = b;
+    sleepSlotStart[b + 1]++;
+  }
+  for(u32 b=0; b<numSleepBricks; b++) {
+    sleepSlotStart[b + 1] += sleepSlotStart[b];
+  }
+  vector<u32> fill(sleepSlotStart, sleepSlotStart + numSleepBricks);
+  for(u32 p=0; p<numCellsToProcess; p++) {
+    sleepSlots[fill[slotSleepBrick[p]]++] = p;
+  }
+
+  // wet and boundary cells held by sleeping bricks
+  numSleepCells = 0;
+  for(u32 b=0; b<numSleepBricks; b++) {
+    if (brickAwake[b]) { continue; }
+    for(u32 s=sleepSlotStart[b]; s<sleepSlotStart[b + 1]; s++) {
+      const u8 state = cells.state[cellsToProcess[sleepSlots[s]]];
+      numSleepCells += (state == eStateWet) || (state == eStateBound);
+    }
+  }
+}
+
+// entries that stay in the frontier after their update (the others can't change).
+// branch-free: wet and dry cells are interleaved
+void CellModel::measureSleep(const u32 thr, const u32 f0, const u32 f1) {
+  f64* const change = brickChange + (u64)thr * numSleepBricks;
+  for(u32 f=f0; f<f1; f++) {
+    const u32 p = frontier[f];
+    const u32 idx = cellsToProcess[p];
+    const u32 b = slotSleepBrick[p];
+    const u8 state = cellsUpdate.state[idx];
+    const f64 d = max(fabs((f64)cells.concentration[eStateDrug][idx] - cellsUpdate.concentration[eStateDrug][idx]),
+                      fabs((f64)cells.concentration[eStateEx][idx] - cellsUpdate.concentration[eStateEx][idx]));
+    // dry and dissolving cells can change state any step
+    const bool held = (state == eStateWet) || (state == eStateBound);
+    change[b] = max(change[b], held ? d : HUGE_VAL);
+  }
+}
+
+u32 CellModel::updateSleep(const u32 n, u32* pAdd) {
+  // largest change of each brick over all threads
+  for(u32 t=1; t<threads->numThreads; t++) {
+    const f64* const change = brickChange + (u64)t * numSleepBricks;
+    for(u32 b=0; b<numSleepBricks; b++) {
+      brickChange[b] = max(brickChange[b], change[b]);
+    }
+  }
+  // bricks around a changing brick (all 26, and itself) stay or get awake:
+  // the changing bricks, grown by one brick along x, then y, then z
+  u8* near = brickNear;
+  u8* grown = brickNear + numSleepBricks;
+  for(u32 b=0; b<numSleepBricks; b++) {
+    near[b] = (brickChange[b] > sleepTol);
+  }
+  const u32 sb = sleepBricks;
+  u32 stride = 1;
+  for(u8 a=0; a<3; a++) {
+    // b = (hi * sb + c) * stride + lo, c the coordinate along this axis
+    u32 b = 0;
+    for(u32 hi=0; hi<numSleepBricks / (sb * stride); hi++) {
+      for(u32 c=0; c<sb; c++) {
+        for(u32 lo=0; lo<stride; lo++, b++) {
+          grown[b] = near[b] | ((c > 0) ? near[b - stride] : 0)
+            | ((c + 1 < sb) ? near[b + stride] : 0);
+        }
+      }
+    }
+    swap(near, grown);
+    stride *= sb;
+  }
+
+  u32 nAdd = *pAdd;
+  bool slept = false;
+  for(u32 b=0; b<numSleepBricks * threads->numThreads; b++) {
+    brickChange[b] = 0.0;
+  }
+  for(u32 b=0; b<numSleepBricks; b++) {
+    if (brickAwake[b] && !near[b]) {
+      // hold the brick: the update buffer takes this step's values
+      brickAwake[b] = 0;
+      brickSleptAt[b] = iterationNum;
+      slept = true;
+      for(u32 s=sleepSlotStart[b]; s<sleepSlotStart[b + 1]; s++) {
+        const u32 p = sleepSlots[s];
+        const u32 idx = cellsToProcess[p];
+        const u8 state = cells.state[idx];
+        if (inFrontier[p]) {
+          cellsUpdate.state[idx] = state;
+          cellsUpdate.concentration[eStateDrug][idx] = cells.concentration[eStateDrug][idx];
+          cellsUpdate.concentration[eStateEx][idx] = cells.concentration[eStateEx][idx];
+          inFrontier[p] = 0;
+        }
+        numSleepCells += (state == eStateWet) || (state == eStateBound);
+      }
+    } else if (!brickAwake[b] && near[b]) {
+      // wake: its wet and boundary cells rejoin the frontier
+      // (boundary cells without wet neighbors drop out again next step)
+      u32 held = 0;
+      brickAwake[b] = 1;
+      for(u32 s=sleepSlotStart[b]; s<sleepSlotStart[b + 1]; s++) {
+        const u32 p = sleepSlots[s];
+        const u8 state = cells.state[cellsToProcess[p]];
+        if ((state == eStateWet) || (state == eStateBound)) {
+          held++;
+          if (!inFrontier[p]) {
+            inFrontier[p] = 1;
+            frontierAdd[nAdd++] = p;
+          }
+        }
+      }
+      numSleepCells -= held;
+      if (held > 0) {
+        sleepMaxSteps = max(sleepMaxSteps, iterationNum - brickSleptAt[b]);
+      }
+    }
+  }
+  *pAdd = nAdd;
+  if (!slept) { return n; }
+
+  // drop the held cells from the frontier, keeping slot order
+  u32 m = 0;
+  for(u32 f=0; f<n; f++) {
+    if (inFrontier[frontier[f]]) {
+      frontier[m++] = frontier[f];
+    }
+  }
+  return m;
+}
+
+// sleepTol times the longest any brick holding cells has slept,
+// including bricks asleep now
+f64 CellModel::sleepCellBound(void) {
+  u64 steps = sleepMaxSteps;
+  for(u32 b=0; b<numSleepBricks; b++) {
+    if (brickAwake[b]) { continue; }
+    for(u32 s=sleepSlotStart[b]; s<sleepSlotStart[b + 1]; s++) {
+      const u8 state = cells.state[cellsToProcess[sleepSlots[s]]];
+      if ((state == eStateWet) || (state == eStateBound)) {
+        steps = max(steps, iterationNum - brickSleptAt[b]);
+        break;
+      }
+    }
+  }
+  return sleepTol * (f64)steps;
+}
@@ -0,0 +1,61 @@
+/*
+ *  Checkpoint.cpp
+ *  celldiff
+ *
+ *  checkpoint files (see Checkpoint.hpp for the layout)
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Checkpoint.hpp"
+#include "CellModel.hpp"
+
+u64 checkpoint_size(CellModel* model) {
+  return CHECKPOINT_ALIGN + model->checkpointSize();
+}
+
+void checkpoint_pack(u8* dst, const CheckpointRun* run, CellModel* model) {
+  CheckpointHeader hdr;
+  memset(&hdr, 0, sizeof(CheckpointHeader));
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, 8);
+  hdr.version = CHECKPOINT_VERSION;
+  hdr.headerSize = sizeof(CheckpointHeader);
+  hdr.modelOffset = CHECKPOINT_ALIGN;
+  hdr.modelSize = model->checkpointSize();
+  hdr.size = hdr.modelOffset + hdr.modelSize;
+  hdr.run = *run;
+
+  memset(dst, 0, CHECKPOINT_ALIGN);
+  memcpy(dst, &hdr, sizeof(CheckpointHeader));
+  model->checkpointPack(dst + hdr.modelOffset);
+}
+
+int checkpoint_read(const char* path, u8** pData) {
+  CheckpointHeader hdr;
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) { return -1; }
+  if ((fread(&hdr, sizeof(CheckpointHeader), 1, f) != 1)
+      || (memcmp(hdr.magic, CHECKPOINT_MAGIC, 8) != 0)
+      || (hdr.version != CHECKPOINT_VERSION)
+      || (hdr.headerSize != sizeof(CheckpointHeader))
+      || (hdr.modelOffset + hdr.modelSize != hdr.size)) {
+    fclose(f);
+    return -1;
+  }
+  u8* data = (u8*)malloc(hdr.size);
+  if (data == NULL) {
+    fclose(f);
+    return -1;
+  }
+  rewind(f);
+  const bool ok = (fread(data, 1, hdr.size, f) == hdr.size);
+  fclose(f);
+  if (!ok) {
+    free(data);
+    return -1;
+  }
+  *pData = data;
+  return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ *  Checkpoint.hpp
+ *  celldiff
+ *
+ *  checkpoint files for stopping and resuming a run.
+ *
+ *  format (native byte order): a page-sized header holding the run state
+ *  of the program (parameters, loop counters, output positions), followed
+ *  by the model's own checkpoint (see CellModelCheckpoint.cpp) at
+ *  modelOffset. a resumed run continues with bit-identical results.
+ */
+
+#ifndef _CELLDIFF_CHECKPOINT_H_
+#define _CELLDIFF_CHECKPOINT_H_
+
+#include <stdint.h>
+#include "types.h"
+
+class CellModel;
+
+#define CHECKPOINT_MAGIC "CELLCKPT"
+#define CHECKPOINT_VERSION 5
+// size of the header, and offset of the model data
+#define CHECKPOINT_ALIGN 4096
+// longest output path stored in a checkpoint
+#define CHECKPOINT_PATH_MAX 1024
+
+// what the program needs to pick up where it stopped
+struct CheckpointRun {
+  // parameters
+  f64       diameter;
+  f64       cellSize;
+  f64       height;
+  f64       pDrug;
+  f64       pPoly;
+  f64       drugDiff;
+  f64       exDiff;
+  f64       dissProbDrug;
+  f64       dissProbEx;
+  f64       polyShellBalance;
+  f64       boundDiff;
+  f64       dissScale;
+  f64       maxTime;
+  f64       sleepTol;
+  uint32_t  seed;
+  uint32_t  polyShellWidth;
+  uint32_t  compress;
+  uint32_t  statePeriod;
+  uint32_t  textState;
+  uint32_t  layout;
+  uint32_t  stencil;
+  uint32_t  stepMultiple;
+  // main loop state
+  uint64_t  step;
+  uint64_t  frameStep;
+  uint64_t  stateStep;
+  uint64_t  noChangeCount;
+  f64       released[2];
+  // bytes of output written so far
+  uint64_t  releasedBytes;
+  uint64_t  stateBytes;
+  char      releasedPath[CHECKPOINT_PATH_MAX];
+  char      statePath[CHECKPOINT_PATH_MAX];
+};
+
+struct CheckpointHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  headerSize;
+  // total size of the file
+  uint64_t  size;
+  uint64_t  modelOffset;
+  uint64_t  modelSize;
+  CheckpointRun run;
+};
+
+// bytes of a checkpoint of this model
+u64 checkpoint_size(CellModel* model);
+// copy a checkpoint into memory (checkpoint_size() bytes at dst)
+void checkpoint_pack(u8* dst, const CheckpointRun* run, CellModel* model);
+// read and check a checkpoint file; on success *pData holds the whole file
+// (starting with its CheckpointHeader) and should be freed with free().
+// returns 0 on success
+int checkpoint_read(const char* path, u8** pData);
+
+#endif // header guard
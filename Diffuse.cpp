@@ -0,0 +1,520 @@
+/*
+ *  Diffuse.cpp
+ *  celldiff
+ *
+ *  diffusion kernels for batches of wet cells: scalar, AVX2 and AVX-512,
+ *  chosen at runtime. all paths use the same fused update and the same
+ *  neighbor summation order, so they produce bit-identical results.
+ *  the f32 build computes in f32 lanes: 8 cells per AVX2 vector, against
+ *  4 in doubles.
+ */
+
+#include <cstdio>
+#include <immintrin.h>
+#include "CellModel.hpp"
+
+//------ kernel selection
+void CellModel::selectDiffuseKernel(const u8 level) {
+  __builtin_cpu_init();
+  const bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  // (the f32 AVX-512 kernel does its arithmetic with AVX2)
+  const bool hasAvx512 = __builtin_cpu_supports("avx512f") && hasAvx2;
+
+  simdLevel = (eSimdLevel)level;
+  if (simdLevel == eSimdAuto) {
+    simdLevel = hasAvx512 ? eSimdAvx512 : (hasAvx2 ? eSimdAvx2 : eSimdScalar);
+  }
+  // fall back if the requested level isn't supported
+  if ((simdLevel == eSimdAvx512) && !hasAvx512) { simdLevel = eSimdAvx2; }
+  if ((simdLevel == eSimdAvx2) && !hasAvx2) { simdLevel = eSimdScalar; }
+
+  if (stencil == eStencil26) {
+    selectKernels<Stencil26>();
+  } else {
+    selectKernels<Stencil6>();
+  }
+}
+
+template<class S> void CellModel::selectKernels(void) {
+  switch(simdLevel) {
+    case eSimdAvx512:
+      diffuseWet = &CellModel::diffuseWetAvx512<S>;
+      break;
+    case eSimdAvx2:
+      diffuseWet = &CellModel::diffuseWetAvx2<S>;
+      break;
+    default:
+      diffuseWet = &CellModel::diffuseWetScalar<S>;
+      break;
+  }
+  updateCells = &CellModel::updateCellsStencil<S>;
+}
+
+//------ scalar
+template<class S> f64 CellModel::diffuseWetScalar(const u32* pList, const u32 n) {
+  f64 dMass = 0.0;
+  for(u32 k=0; k<n; k++) {
+    f64 d = 0.0;
+    diffuse<S>(pList[k], &d);
+    dMass += d;
+  }
+  return dMass;
+}
+
+// the vector paths load and store u32 cell indices as 64-bit lanes
+static_assert(sizeof(u32) == 8, "SIMD kernels need 8-byte u32 cell indices");
+
+//------ neighbor steps per lane, as CellModel::neighbor()
+__attribute__((target("avx2,fma")))
+static inline __m256i neighborAvx2(const CellModel* m, const __m256i vIdx, const u8 i) {
+  const u8 a = i >> 1;
+  switch(m->layout) {
+    case eLayoutBrick: {
+      const int shift = a * BRICK_BITS;
+      const __m256i v = _mm256_and_si256(_mm256_srli_epi64(vIdx, shift), _mm256_set1_epi64x(BRICK_LENGTH - 1));
+      const long long edge = (long long)(BRICK_LENGTH - 1) << shift;
+      const long long step = (i & 1) ? (edge - (long long)m->brickStep[a]) : ((long long)m->brickStep[a] - edge);
+      const __m256i onEdge = _mm256_cmpeq_epi64(v, _mm256_set1_epi64x((i & 1) ? 0 : (BRICK_LENGTH - 1)));
+      const __m256i inner = _mm256_set1_epi64x((i & 1) ? -(1LL << shift) : (1LL << shift));
+      return _mm256_add_epi64(vIdx, _mm256_blendv_epi8(inner, _mm256_set1_epi64x(step), onEdge));
+    }
+    case eLayoutSparse: {
+      // edge lanes look up the next stored brick
+      const int shift = a * BRICK_BITS;
+      const __m256i v = _mm256_and_si256(_mm256_srli_epi64(vIdx, shift), _mm256_set1_epi64x(BRICK_LENGTH - 1));
+      const __m256i onEdge = _mm256_cmpeq_epi64(v, _mm256_set1_epi64x((i & 1) ? 0 : (BRICK_LENGTH - 1)));
+      const __m256i step = _mm256_add_epi64(vIdx, _mm256_set1_epi64x((i & 1) ? -(1LL << shift) : (1LL << shift)));
+      const __m256i brick = _mm256_srli_epi64(vIdx, 3 * BRICK_BITS);
+      const __m256i row = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(brick, 2), _mm256_slli_epi64(brick, 1)), _mm256_set1_epi64x(i));
+      const __m256i next = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), (const long long*)m->slotNeighbor, row, onEdge, 8);
+      const __m256i inner = _mm256_xor_si256(_mm256_and_si256(vIdx, _mm256_set1_epi64x(BRICK_CELLS - 1)),
+                                             _mm256_set1_epi64x((long long)(BRICK_LENGTH - 1) << shift));
+      return _mm256_blendv_epi8(step, _mm256_add_epi64(_mm256_slli_epi64(next, 3 * BRICK_BITS), inner), onEdge);
+    }
+    case eLayoutMorton: {
+      const __m256i vm = _mm256_set1_epi64x((long long)m->mortonMask[a]);
+      const __m256i vOne = _mm256_set1_epi64x(1);
+      const __m256i v = (i & 1)
+        ? _mm256_sub_epi64(_mm256_and_si256(vIdx, vm), vOne)
+        : _mm256_add_epi64(_mm256_or_si256(vIdx, _mm256_xor_si256(vm, _mm256_set1_epi64x(-1))), vOne);
+      return _mm256_or_si256(_mm256_and_si256(v, vm), _mm256_andnot_si256(vm, vIdx));
+    }
+    default:
+      return _mm256_add_epi64(vIdx, _mm256_set1_epi64x((long long)m->nbrOffset[i]));
+  }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i neighborAvx512(const CellModel* m, const __m512i vIdx, const u8 i) {
+  const u8 a = i >> 1;
+  switch(m->layout) {
+    case eLayoutBrick: {
+      const int shift = a * BRICK_BITS;
+      const __m512i v = _mm512_and_si512(_mm512_srli_epi64(vIdx, shift), _mm512_set1_epi64(BRICK_LENGTH - 1));
+      const long long edge = (long long)(BRICK_LENGTH - 1) << shift;
+      const long long step = (i & 1) ? (edge - (long long)m->brickStep[a]) : ((long long)m->brickStep[a] - edge);
+      const __mmask8 onEdge = _mm512_cmpeq_epi64_mask(v, _mm512_set1_epi64((i & 1) ? 0 : (BRICK_LENGTH - 1)));
+      const __m512i inner = _mm512_set1_epi64((i & 1) ? -(1LL << shift) : (1LL << shift));
+      return _mm512_add_epi64(vIdx, _mm512_mask_mov_epi64(inner, onEdge, _mm512_set1_epi64(step)));
+    }
+    case eLayoutSparse: {
+      // edge lanes look up the next stored brick
+      const int shift = a * BRICK_BITS;
+      const __m512i v = _mm512_and_si512(_mm512_srli_epi64(vIdx, shift), _mm512_set1_epi64(BRICK_LENGTH - 1));
+      const __mmask8 onEdge = _mm512_cmpeq_epi64_mask(v, _mm512_set1_epi64((i & 1) ? 0 : (BRICK_LENGTH - 1)));
+      const __m512i step = _mm512_add_epi64(vIdx, _mm512_set1_epi64((i & 1) ? -(1LL << shift) : (1LL << shift)));
+      if (onEdge == 0) { return step; }
+      const __m512i brick = _mm512_srli_epi64(vIdx, 3 * BRICK_BITS);
+      const __m512i row = _mm512_add_epi64(_mm512_add_epi64(_mm512_slli_epi64(brick, 2), _mm512_slli_epi64(brick, 1)), _mm512_set1_epi64(i));
+      const __m512i next = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), onEdge, row, m->slotNeighbor, 8);
+      const __m512i inner = _mm512_xor_si512(_mm512_and_si512(vIdx, _mm512_set1_epi64(BRICK_CELLS - 1)),
+                                             _mm512_set1_epi64((long long)(BRICK_LENGTH - 1) << shift));
+      return _mm512_mask_mov_epi64(step, onEdge, _mm512_add_epi64(_mm512_slli_epi64(next, 3 * BRICK_BITS), inner));
+    }
+    case eLayoutMorton: {
+      const __m512i vm = _mm512_set1_epi64((long long)m->mortonMask[a]);
+      const __m512i vOne = _mm512_set1_epi64(1);
+      const __m512i v = (i & 1)
+        ? _mm512_sub_epi64(_mm512_and_si512(vIdx, vm), vOne)
+        : _mm512_add_epi64(_mm512_or_si512(vIdx, _mm512_xor_si512(vm, _mm512_set1_epi64(-1))), vOne);
+      return _mm512_or_si512(_mm512_and_si512(v, vm), _mm512_andnot_si512(vm, vIdx));
+    }
+    default:
+      return _mm512_add_epi64(vIdx, _mm512_set1_epi64((long long)m->nbrOffset[i]));
+  }
+}
+
+//------ all neighbors per lane, in stencil order, as CellModel::neighbors()
+template<class S> static inline void neighborsAvx2(const CellModel* m, const __m256i vIdx, __m256i* vn);
+template<class S> static inline void neighborsAvx512(const CellModel* m, const __m512i vIdx, __m512i* vn);
+
+template<> __attribute__((target("avx2,fma")))
+inline void neighborsAvx2<Stencil6>(const CellModel* m, const __m256i vIdx, __m256i* vn) {
+  for(u8 i=0; i<NUM_FACES; i++) {
+    vn[i] = neighborAvx2(m, vIdx, i);
+  }
+}
+
+template<> __attribute__((target("avx2,fma")))
+inline void neighborsAvx2<Stencil26>(const CellModel* m, const __m256i vIdx, __m256i* vn) {
+  if (m->layout == eLayoutLinear) {
+    for(u8 i=0; i<Stencil26::size; i++) {
+      vn[i] = _mm256_add_epi64(vIdx, _mm256_set1_epi64x((long long)m->diagOffset[i]));
+    }
+    return;
+  }
+  u8 i = 0;
+  for(u8 z=0; z<3; z++) {
+    const __m256i cz = (z == 1) ? vIdx : neighborAvx2(m, vIdx, (z == 0) ? 5 : 4);
+    for(u8 y=0; y<3; y++) {
+      const __m256i cy = (y == 1) ? cz : neighborAvx2(m, cz, (y == 0) ? 3 : 2);
+      vn[i++] = neighborAvx2(m, cy, 1);
+      if ((z != 1) || (y != 1)) { vn[i++] = cy; }
+      vn[i++] = neighborAvx2(m, cy, 0);
+    }
+  }
+}
+
+template<> __attribute__((target("avx512f")))
+inline void neighborsAvx512<Stencil6>(const CellModel* m, const __m512i vIdx, __m512i* vn) {
+  for(u8 i=0; i<NUM_FACES; i++) {
+    vn[i] = neighborAvx512(m, vIdx, i);
+  }
+}
+
+template<> __attribute__((target("avx512f")))
+inline void neighborsAvx512<Stencil26>(const CellModel* m, const __m512i vIdx, __m512i* vn) {
+  if (m->layout == eLayoutLinear) {
+    for(u8 i=0; i<Stencil26::size; i++) {
+      vn[i] = _mm512_add_epi64(vIdx, _mm512_set1_epi64((long long)m->diagOffset[i]));
+    }
+    return;
+  }
+  u8 i = 0;
+  for(u8 z=0; z<3; z++) {
+    const __m512i cz = (z == 1) ? vIdx : neighborAvx512(m, vIdx, (z == 0) ? 5 : 4);
+    for(u8 y=0; y<3; y++) {
+      const __m512i cy = (y == 1) ? cz : neighborAvx512(m, cz, (y == 0) ? 3 : 2);
+      vn[i++] = neighborAvx512(m, cy, 1);
+      if ((z != 1) || (y != 1)) { vn[i++] = cy; }
+      vn[i++] = neighborAvx512(m, cy, 0);
+    }
+  }
+}
+
+#if !CELLDIFF_F32
+//------ f64 lanes: one cell index per lane
+__attribute__((target("avx2,fma")))
+static inline __m256d gatherConcAvx2(const conc_t* c, const __m256i vIdx, const __m256d m) {
+  return _mm256_mask_i64gather_pd(_mm256_setzero_pd(), c, vIdx, m, 8);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d gatherConcAvx512(const conc_t* c, const __m512i vIdx, const __mmask8 m) {
+  return _mm512_mask_i64gather_pd(_mm512_setzero_pd(), m, vIdx, c, 8);
+}
+
+// store; returns the stored values
+__attribute__((target("avx512f")))
+static inline __m512d scatterConcAvx512(conc_t* c, const __m512i vIdx, const __m512d v) {
+  _mm512_i64scatter_pd(c, vIdx, v, 8);
+  return v;
+}
+
+//------ AVX2: 4 cells per vector
+template<class S> __attribute__((target("avx2,fma")))
+f64 CellModel::diffuseWetAvx2(const u32* pList, const u32 n) {
+  const long long* const st = (const long long*)cells.state;
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  conc_t* const uDrug = cellsUpdate.concentration[eStateDrug];
+  conc_t* const uEx = cellsUpdate.concentration[eStateEx];
+  const long long* const active = (const long long*)cellsToProcess;
+
+  const __m256d vdDrug = _mm256_set1_pd(dDrug);
+  const __m256d vdEx = _mm256_set1_pd(dEx);
+  const __m256d vDecay = _mm256_set1_pd(boundDiff);
+  const __m256d vSat = _mm256_set1_pd(0.000000000001);
+  const __m256d vOne = _mm256_set1_pd(1.0);
+  const __m256d vZero = _mm256_setzero_pd();
+  const __m256i vByte = _mm256_set1_epi64x(0xff);
+  const __m256i vWet = _mm256_set1_epi64x(eStateWet);
+  const __m256i vBound = _mm256_set1_epi64x(eStateBound);
+
+  f64 outDrug[4], outEx[4], oldDrug[4];
+  u32 idx[4];
+  __m256i vn[S::size];
+  f64 dMass = 0.0;
+  u32 k = 0;
+  for(; k + 4 <= n; k += 4) {
+    const __m256i vp = _mm256_loadu_si256((const __m256i*)(pList + k));
+    const __m256i vIdx = _mm256_i64gather_epi64(active, vp, 8);
+    __m256d sumDrug = vZero;
+    __m256d sumEx = vZero;
+    __m256d nw = vZero;
+    neighborsAvx2<S>(this, vIdx, vn);
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const __m256i vs = _mm256_and_si256(_mm256_i64gather_epi64(st, vn[i], 1), vByte);
+      const __m256d isWet = _mm256_castsi256_pd(_mm256_cmpeq_epi64(vs, vWet));
+      const __m256d isBound = _mm256_castsi256_pd(_mm256_cmpeq_epi64(vs, vBound));
+      const __m256d m = _mm256_or_pd(isWet, isBound);
+      __m256d d = gatherConcAvx2(cDrug, vn[i], m);
+      __m256d e = gatherConcAvx2(cEx, vn[i], m);
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated (see diffuse())
+        __m256d dd = _mm256_mul_pd(d, vDecay);
+        __m256d de = _mm256_mul_pd(e, vDecay);
+        dd = _mm256_and_pd(dd, _mm256_cmp_pd(dd, vSat, _CMP_GE_OQ));
+        de = _mm256_and_pd(de, _mm256_cmp_pd(de, vSat, _CMP_GE_OQ));
+        d = _mm256_blendv_pd(d, dd, isBound);
+        e = _mm256_blendv_pd(e, de, isBound);
+      }
+      sumDrug = _mm256_add_pd(sumDrug, d);
+      sumEx = _mm256_add_pd(sumEx, e);
+      nw = _mm256_add_pd(nw, _mm256_and_pd(m, vOne));
+    }
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    const __m256d cD = gatherConcAvx2(cDrug, vIdx, all);
+    const __m256d cE = gatherConcAvx2(cEx, vIdx, all);
+    _mm256_storeu_pd(outDrug, _mm256_fmadd_pd(_mm256_fnmadd_pd(nw, cD, sumDrug), vdDrug, cD));
+    _mm256_storeu_pd(outEx, _mm256_fmadd_pd(_mm256_fnmadd_pd(nw, cE, sumEx), vdEx, cE));
+    _mm256_storeu_pd(oldDrug, cD);
+    _mm256_storeu_si256((__m256i*)idx, vIdx);
+    for(u8 j=0; j<4; j++) {
+      cellsUpdate.state[idx[j]] = eStateWet;
+      uDrug[idx[j]] = outDrug[j];
+      uEx[idx[j]] = outEx[j];
+      // the mass change, as in diffuse()
+      dMass += uDrug[idx[j]] - oldDrug[j];
+    }
+  }
+  return dMass + diffuseWetScalar<S>(pList + k, n - k);
+}
+
+//------ AVX-512: 8 cells per vector
+template<class S> __attribute__((target("avx512f")))
+f64 CellModel::diffuseWetAvx512(const u32* pList, const u32 n) {
+  const long long* const st = (const long long*)cells.state;
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  conc_t* const uDrug = cellsUpdate.concentration[eStateDrug];
+  conc_t* const uEx = cellsUpdate.concentration[eStateEx];
+  const long long* const active = (const long long*)cellsToProcess;
+
+  const __m512d vdDrug = _mm512_set1_pd(dDrug);
+  const __m512d vdEx = _mm512_set1_pd(dEx);
+  const __m512d vDecay = _mm512_set1_pd(boundDiff);
+  const __m512d vSat = _mm512_set1_pd(0.000000000001);
+  const __m512d vOne = _mm512_set1_pd(1.0);
+  const __m512d vZero = _mm512_setzero_pd();
+  const __m512i vByte = _mm512_set1_epi64(0xff);
+  const __m512i vWet = _mm512_set1_epi64(eStateWet);
+  const __m512i vBound = _mm512_set1_epi64(eStateBound);
+
+  f64 outDrug[8], oldDrug[8];
+  u32 idx[8];
+  __m512i vn[S::size];
+  f64 dMass = 0.0;
+  u32 k = 0;
+  for(; k + 8 <= n; k += 8) {
+    const __m512i vp = _mm512_loadu_si512((const void*)(pList + k));
+    const __m512i vIdx = _mm512_i64gather_epi64(vp, active, 8);
+    __m512d sumDrug = vZero;
+    __m512d sumEx = vZero;
+    __m512d nw = vZero;
+    neighborsAvx512<S>(this, vIdx, vn);
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const __m512i vs = _mm512_and_si512(_mm512_i64gather_epi64(vn[i], st, 1), vByte);
+      const __mmask8 isWet = _mm512_cmpeq_epi64_mask(vs, vWet);
+      const __mmask8 isBound = _mm512_cmpeq_epi64_mask(vs, vBound);
+      const __mmask8 m = isWet | isBound;
+      __m512d d = gatherConcAvx512(cDrug, vn[i], m);
+      __m512d e = gatherConcAvx512(cEx, vn[i], m);
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated (see diffuse())
+        const __m512d dd = _mm512_mul_pd(d, vDecay);
+        const __m512d de = _mm512_mul_pd(e, vDecay);
+        const __mmask8 okD = _mm512_cmp_pd_mask(dd, vSat, _CMP_GE_OQ);
+        const __mmask8 okE = _mm512_cmp_pd_mask(de, vSat, _CMP_GE_OQ);
+        d = _mm512_mask_mov_pd(d, isBound, _mm512_maskz_mov_pd(okD, dd));
+        e = _mm512_mask_mov_pd(e, isBound, _mm512_maskz_mov_pd(okE, de));
+      }
+      sumDrug = _mm512_add_pd(sumDrug, d);
+      sumEx = _mm512_add_pd(sumEx, e);
+      nw = _mm512_mask_add_pd(nw, m, nw, vOne);
+    }
+    const __m512d cD = gatherConcAvx512(cDrug, vIdx, 0xff);
+    const __m512d cE = gatherConcAvx512(cEx, vIdx, 0xff);
+    const __m512d nD = scatterConcAvx512(uDrug, vIdx, _mm512_fmadd_pd(_mm512_fnmadd_pd(nw, cD, sumDrug), vdDrug, cD));
+    scatterConcAvx512(uEx, vIdx, _mm512_fmadd_pd(_mm512_fnmadd_pd(nw, cE, sumEx), vdEx, cE));
+    _mm512_storeu_pd(outDrug, nD);
+    _mm512_storeu_pd(oldDrug, cD);
+    _mm512_storeu_si512((void*)idx, vIdx);
+    for(u8 j=0; j<8; j++) {
+      cellsUpdate.state[idx[j]] = eStateWet;
+      dMass += outDrug[j] - oldDrug[j];
+    }
+  }
+  return dMass + diffuseWetScalar<S>(pList + k, n - k);
+}
+
+#else
+//------ f32 lanes: twice the cells per vector, so each vector of
+// concentrations takes two vectors of 64-bit cell indices (AVX2)
+__attribute__((target("avx2,fma")))
+static inline __m256 gatherConcAvx2(const conc_t* c, const __m256i lo, const __m256i hi, const __m256 m) {
+  const __m128 a = _mm256_mask_i64gather_ps(_mm_setzero_ps(), c, lo, _mm256_castps256_ps128(m), 4);
+  const __m128 b = _mm256_mask_i64gather_ps(_mm_setzero_ps(), c, hi, _mm256_extractf128_ps(m, 1), 4);
+  return _mm256_setr_m128(a, b);
+}
+
+//------ AVX2: 8 cells per vector
+template<class S> __attribute__((target("avx2,fma")))
+f64 CellModel::diffuseWetAvx2(const u32* pList, const u32 n) {
+  const int* const st = (const int*)cells.state;
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  conc_t* const uDrug = cellsUpdate.concentration[eStateDrug];
+  conc_t* const uEx = cellsUpdate.concentration[eStateEx];
+  const long long* const active = (const long long*)cellsToProcess;
+
+  const __m256 vdDrug = _mm256_set1_ps((calc_t)dDrug);
+  const __m256 vdEx = _mm256_set1_ps((calc_t)dEx);
+  const __m256 vDecay = _mm256_set1_ps((calc_t)boundDiff);
+  const __m256 vSat = _mm256_set1_ps((calc_t)0.000000000001);
+  const __m256 vOne = _mm256_set1_ps(1.0f);
+  const __m256 vZero = _mm256_setzero_ps();
+  const __m256i vByte = _mm256_set1_epi32(0xff);
+  const __m256i vWet = _mm256_set1_epi32(eStateWet);
+  const __m256i vBound = _mm256_set1_epi32(eStateBound);
+
+  conc_t outDrug[8], outEx[8], oldDrug[8];
+  u32 idx[8];
+  __m256i vIdx[2];
+  __m256i vn[2][S::size];
+  f64 dMass = 0.0;
+  u32 k = 0;
+  for(; k + 8 <= n; k += 8) {
+    for(u8 h=0; h<2; h++) {
+      const __m256i vp = _mm256_loadu_si256((const __m256i*)(pList + k + 4 * h));
+      vIdx[h] = _mm256_i64gather_epi64(active, vp, 8);
+      neighborsAvx2<S>(this, vIdx[h], vn[h]);
+    }
+    __m256 sumDrug = vZero;
+    __m256 sumEx = vZero;
+    __m256 nw = vZero;
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const __m256i vs = _mm256_and_si256(_mm256_setr_m128i(_mm256_i64gather_epi32(st, vn[0][i], 1),
+                                                            _mm256_i64gather_epi32(st, vn[1][i], 1)), vByte);
+      const __m256 isWet = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vWet));
+      const __m256 isBound = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vBound));
+      const __m256 m = _mm256_or_ps(isWet, isBound);
+      __m256 d = gatherConcAvx2(cDrug, vn[0][i], vn[1][i], m);
+      __m256 e = gatherConcAvx2(cEx, vn[0][i], vn[1][i], m);
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated (see diffuse())
+        __m256 dd = _mm256_mul_ps(d, vDecay);
+        __m256 de = _mm256_mul_ps(e, vDecay);
+        dd = _mm256_and_ps(dd, _mm256_cmp_ps(dd, vSat, _CMP_GE_OQ));
+        de = _mm256_and_ps(de, _mm256_cmp_ps(de, vSat, _CMP_GE_OQ));
+        d = _mm256_blendv_ps(d, dd, isBound);
+        e = _mm256_blendv_ps(e, de, isBound);
+      }
+      sumDrug = _mm256_add_ps(sumDrug, d);
+      sumEx = _mm256_add_ps(sumEx, e);
+      nw = _mm256_add_ps(nw, _mm256_and_ps(m, vOne));
+    }
+    const __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    const __m256 cD = gatherConcAvx2(cDrug, vIdx[0], vIdx[1], all);
+    const __m256 cE = gatherConcAvx2(cEx, vIdx[0], vIdx[1], all);
+    _mm256_storeu_ps(outDrug, _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cD, sumDrug), vdDrug, cD));
+    _mm256_storeu_ps(outEx, _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cE, sumEx), vdEx, cE));
+    _mm256_storeu_ps(oldDrug, cD);
+    _mm256_storeu_si256((__m256i*)idx, vIdx[0]);
+    _mm256_storeu_si256((__m256i*)(idx + 4), vIdx[1]);
+    for(u8 j=0; j<8; j++) {
+      cellsUpdate.state[idx[j]] = eStateWet;
+      uDrug[idx[j]] = outDrug[j];
+      uEx[idx[j]] = outEx[j];
+      // the mass change, as in diffuse()
+      dMass += (f64)outDrug[j] - oldDrug[j];
+    }
+  }
+  return dMass + diffuseWetScalar<S>(pList + k, n - k);
+}
+
+//------ AVX-512: 8 cells per vector, the arithmetic in 8 f32 lanes. the
+// kernel is bound by the gathers, which fetch one element each: 16 lanes
+// (two index vectors per vector of concentrations) measured slower
+template<class S> __attribute__((target("avx512f,avx2,fma")))
+f64 CellModel::diffuseWetAvx512(const u32* pList, const u32 n) {
+  const int* const st = (const int*)cells.state;
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  conc_t* const uDrug = cellsUpdate.concentration[eStateDrug];
+  conc_t* const uEx = cellsUpdate.concentration[eStateEx];
+  const long long* const active = (const long long*)cellsToProcess;
+
+  const __m256 vdDrug = _mm256_set1_ps((calc_t)dDrug);
+  const __m256 vdEx = _mm256_set1_ps((calc_t)dEx);
+  const __m256 vDecay = _mm256_set1_ps((calc_t)boundDiff);
+  const __m256 vSat = _mm256_set1_ps((calc_t)0.000000000001);
+  const __m256 vOne = _mm256_set1_ps(1.0f);
+  const __m256 vZero = _mm256_setzero_ps();
+  const __m256i vByte = _mm256_set1_epi32(0xff);
+  const __m256i vWet = _mm256_set1_epi32(eStateWet);
+  const __m256i vBound = _mm256_set1_epi32(eStateBound);
+
+  conc_t outDrug[8], oldDrug[8];
+  u32 idx[8];
+  __m512i vn[S::size];
+  f64 dMass = 0.0;
+  u32 k = 0;
+  for(; k + 8 <= n; k += 8) {
+    const __m512i vp = _mm512_loadu_si512((const void*)(pList + k));
+    const __m512i vIdx = _mm512_i64gather_epi64(vp, active, 8);
+    __m256 sumDrug = vZero;
+    __m256 sumEx = vZero;
+    __m256 nw = vZero;
+    neighborsAvx512<S>(this, vIdx, vn);
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const __m256i vs = _mm256_and_si256(_mm512_i64gather_epi32(vn[i], st, 1), vByte);
+      const __m256 isWet = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vWet));
+      const __m256 isBound = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vBound));
+      const __m256 m = _mm256_or_ps(isWet, isBound);
+      const __mmask8 km = (__mmask8)_mm256_movemask_ps(m);
+      __m256 d = _mm512_mask_i64gather_ps(vZero, km, vn[i], cDrug, 4);
+      __m256 e = _mm512_mask_i64gather_ps(vZero, km, vn[i], cEx, 4);
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated (see diffuse())
+        __m256 dd = _mm256_mul_ps(d, vDecay);
+        __m256 de = _mm256_mul_ps(e, vDecay);
+        dd = _mm256_and_ps(dd, _mm256_cmp_ps(dd, vSat, _CMP_GE_OQ));
+        de = _mm256_and_ps(de, _mm256_cmp_ps(de, vSat, _CMP_GE_OQ));
+        d = _mm256_blendv_ps(d, dd, isBound);
+        e = _mm256_blendv_ps(e, de, isBound);
+      }
+      sumDrug = _mm256_add_ps(sumDrug, d);
+      sumEx = _mm256_add_ps(sumEx, e);
+      nw = _mm256_add_ps(nw, _mm256_and_ps(m, vOne));
+    }
+    const __m256 cD = _mm512_i64gather_ps(vIdx, cDrug, 4);
+    const __m256 cE = _mm512_i64gather_ps(vIdx, cEx, 4);
+    const __m256 nD = _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cD, sumDrug), vdDrug, cD);
+    _mm512_i64scatter_ps(uDrug, vIdx, nD, 4);
+    _mm512_i64scatter_ps(uEx, vIdx, _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cE, sumEx), vdEx, cE), 4);
+    _mm256_storeu_ps(outDrug, nD);
+    _mm256_storeu_ps(oldDrug, cD);
+    _mm512_storeu_si512((void*)idx, vIdx);
+    for(u8 j=0; j<8; j++) {
+      cellsUpdate.state[idx[j]] = eStateWet;
+      dMass += (f64)outDrug[j] - oldDrug[j];
+    }
+  }
+  return dMass + diffuseWetScalar<S>(pList + k, n - k);
+}
+#endif
@@ -0,0 +1,674 @@
+/*
+ *  Ensemble.cpp
+ *  celldiff
+ *
+ *  lockstep ensemble of replicas (see Ensemble.hpp)
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+#include "Ensemble.hpp"
+
+using namespace std;
+
+// neighbor sums of one cell for one block of lanes
+struct LaneSums {
+  // sums over wet neighbors (what dissolution compares against)
+  calc_t sumWet[2][ENSEMBLE_LANES];
+  // diffused concentrations
+  calc_t update[2][ENSEMBLE_LANES];
+  // count of wet or boundary neighbors, and of wet neighbors
+  calc_t nAll[ENSEMBLE_LANES];
+  calc_t nWet[ENSEMBLE_LANES];
+};
+
+// the same sums as CellModel::dissolve() and CellModel::diffuse(), one
+// replica per lane. neighbors that don't count add zero, which leaves
+// the sums unchanged, so every lane matches the single model exactly.
+template<class S>
+static void sum_lanes_scalar(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                             const f64 dDrug, const f64 dEx, const f64 boundDiff) {
+  calc_t sumAll[2][ENSEMBLE_LANES];
+  for(u32 l=0; l<ENSEMBLE_LANES; l++) {
+    sumAll[0][l] = 0;
+    sumAll[1][l] = 0;
+    s->sumWet[0][l] = 0;
+    s->sumWet[1][l] = 0;
+    s->nAll[l] = 0;
+    s->nWet[l] = 0;
+  }
+  UNROLL_NEIGHBORS
+  for(u8 i=0; i<S::size; i++) {
+    const u8* const st = cells->state + nBase[i];
+    const conc_t* const cD = cells->concentration[eStateDrug] + nBase[i];
+    const conc_t* const cE = cells->concentration[eStateEx] + nBase[i];
+    for(u32 l=0; l<ENSEMBLE_LANES; l++) {
+      const bool wet = (st[l] == eStateWet);
+      const bool bound = (st[l] == eStateBound);
+      calc_t d = cD[l];
+      calc_t e = cE[l];
+      s->sumWet[0][l] += wet ? d : 0;
+      s->sumWet[1][l] += wet ? e : 0;
+      if (S::behind(i) && bound) {
+        // boundary cells behind are seen decayed (see CellModel::diffuse())
+        d *= (calc_t)boundDiff;
+        e *= (calc_t)boundDiff;
+        d = (d < (calc_t)0.000000000001) ? 0 : d;
+        e = (e < (calc_t)0.000000000001) ? 0 : e;
+      }
+      sumAll[0][l] += (wet || bound) ? d : 0;
+      sumAll[1][l] += (wet || bound) ? e : 0;
+      s->nAll[l] += (wet || bound) ? 1 : 0;
+      s->nWet[l] += wet ? 1 : 0;
+    }
+  }
+  const u8* const st = cells->state + c;
+  const conc_t* const cD = cells->concentration[eStateDrug] + c;
+  const conc_t* const cE = cells->concentration[eStateEx] + c;
+  for(u32 l=0; l<ENSEMBLE_LANES; l++) {
+    // boundary cells only exchange with wet cells
+    const bool bound = (st[l] == eStateBound);
+    const calc_t nw = bound ? s->nWet[l] : s->nAll[l];
+    const calc_t sD = bound ? s->sumWet[0][l] : sumAll[0][l];
+    const calc_t sE = bound ? s->sumWet[1][l] : sumAll[1][l];
+    s->update[0][l] = fma(fma(-nw, (calc_t)cD[l], sD), (calc_t)dDrug, (calc_t)cD[l]);
+    s->update[1][l] = fma(fma(-nw, (calc_t)cE[l], sE), (calc_t)dEx, (calc_t)cE[l]);
+  }
+}
+
+#if !CELLDIFF_F32
+//------ stored concentrations of consecutive lanes
+__attribute__((target("avx2,fma")))
+static inline __m256d load_conc_avx2(const conc_t* c) {
+  return _mm256_loadu_pd(c);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d load_conc_avx512(const conc_t* c) {
+  return _mm512_loadu_pd(c);
+}
+
+//------ AVX2: two vectors of 4 lanes
+template<class S> __attribute__((target("avx2,fma")))
+static void sum_lanes_avx2(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                           const f64 dDrug, const f64 dEx, const f64 boundDiff) {
+  const __m256d vDecay = _mm256_set1_pd(boundDiff);
+  const __m256d vSat = _mm256_set1_pd(0.000000000001);
+  const __m256d vOne = _mm256_set1_pd(1.0);
+  const __m256d vZero = _mm256_setzero_pd();
+  const __m256i vWet = _mm256_set1_epi64x(eStateWet);
+  const __m256i vBound = _mm256_set1_epi64x(eStateBound);
+  for(u32 h=0; h<ENSEMBLE_LANES; h+=4) {
+    __m256d sumD = vZero, sumE = vZero, wetD = vZero, wetE = vZero, nAll = vZero, nWet = vZero;
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const u64 n = nBase[i] + h;
+      int st4;
+      memcpy(&st4, cells->state + n, 4);
+      const __m256i vs = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(st4));
+      const __m256d isWet = _mm256_castsi256_pd(_mm256_cmpeq_epi64(vs, vWet));
+      const __m256d isBound = _mm256_castsi256_pd(_mm256_cmpeq_epi64(vs, vBound));
+      const __m256d m = _mm256_or_pd(isWet, isBound);
+      __m256d d = load_conc_avx2(cells->concentration[eStateDrug] + n);
+      __m256d e = load_conc_avx2(cells->concentration[eStateEx] + n);
+      wetD = _mm256_add_pd(wetD, _mm256_and_pd(d, isWet));
+      wetE = _mm256_add_pd(wetE, _mm256_and_pd(e, isWet));
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated
+        __m256d dd = _mm256_mul_pd(d, vDecay);
+        __m256d de = _mm256_mul_pd(e, vDecay);
+        dd = _mm256_and_pd(dd, _mm256_cmp_pd(dd, vSat, _CMP_GE_OQ));
+        de = _mm256_and_pd(de, _mm256_cmp_pd(de, vSat, _CMP_GE_OQ));
+        d = _mm256_blendv_pd(d, dd, isBound);
+        e = _mm256_blendv_pd(e, de, isBound);
+      }
+      sumD = _mm256_add_pd(sumD, _mm256_and_pd(d, m));
+      sumE = _mm256_add_pd(sumE, _mm256_and_pd(e, m));
+      nAll = _mm256_add_pd(nAll, _mm256_and_pd(vOne, m));
+      nWet = _mm256_add_pd(nWet, _mm256_and_pd(vOne, isWet));
+    }
+    int st4;
+    memcpy(&st4, cells->state + c + h, 4);
+    const __m256d isBound = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(st4)), vBound));
+    const __m256d nw = _mm256_blendv_pd(nAll, nWet, isBound);
+    const __m256d cD = load_conc_avx2(cells->concentration[eStateDrug] + c + h);
+    const __m256d cE = load_conc_avx2(cells->concentration[eStateEx] + c + h);
+    const __m256d sD = _mm256_blendv_pd(sumD, wetD, isBound);
+    const __m256d sE = _mm256_blendv_pd(sumE, wetE, isBound);
+    _mm256_storeu_pd(s->update[0] + h, _mm256_fmadd_pd(_mm256_fnmadd_pd(nw, cD, sD), _mm256_set1_pd(dDrug), cD));
+    _mm256_storeu_pd(s->update[1] + h, _mm256_fmadd_pd(_mm256_fnmadd_pd(nw, cE, sE), _mm256_set1_pd(dEx), cE));
+    _mm256_storeu_pd(s->sumWet[0] + h, wetD);
+    _mm256_storeu_pd(s->sumWet[1] + h, wetE);
+    _mm256_storeu_pd(s->nAll + h, nAll);
+    _mm256_storeu_pd(s->nWet + h, nWet);
+  }
+}
+
+//------ AVX-512: one vector of 8 lanes
+template<class S> __attribute__((target("avx512f")))
+static void sum_lanes_avx512(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                             const f64 dDrug, const f64 dEx, const f64 boundDiff) {
+  const __m512d vDecay = _mm512_set1_pd(boundDiff);
+  const __m512d vSat = _mm512_set1_pd(0.000000000001);
+  const __m512d vOne = _mm512_set1_pd(1.0);
+  const __m512d vZero = _mm512_setzero_pd();
+  const __m512i vWet = _mm512_set1_epi64(eStateWet);
+  const __m512i vBound = _mm512_set1_epi64(eStateBound);
+  __m512d sumD = vZero, sumE = vZero, wetD = vZero, wetE = vZero, nAll = vZero, nWet = vZero;
+  UNROLL_NEIGHBORS
+  for(u8 i=0; i<S::size; i++) {
+    const u64 n = nBase[i];
+    const __m512i vs = _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i*)(cells->state + n)));
+    const __mmask8 isWet = _mm512_cmpeq_epi64_mask(vs, vWet);
+    const __mmask8 isBound = _mm512_cmpeq_epi64_mask(vs, vBound);
+    const __mmask8 m = isWet | isBound;
+    __m512d d = load_conc_avx512(cells->concentration[eStateDrug] + n);
+    __m512d e = load_conc_avx512(cells->concentration[eStateEx] + n);
+    wetD = _mm512_add_pd(wetD, _mm512_maskz_mov_pd(isWet, d));
+    wetE = _mm512_add_pd(wetE, _mm512_maskz_mov_pd(isWet, e));
+    if (S::behind(i)) {
+      // boundary cells behind: decayed and saturated
+      const __m512d dd = _mm512_mul_pd(d, vDecay);
+      const __m512d de = _mm512_mul_pd(e, vDecay);
+      d = _mm512_mask_mov_pd(d, isBound, _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(dd, vSat, _CMP_GE_OQ), dd));
+      e = _mm512_mask_mov_pd(e, isBound, _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(de, vSat, _CMP_GE_OQ), de));
+    }
+    sumD = _mm512_add_pd(sumD, _mm512_maskz_mov_pd(m, d));
+    sumE = _mm512_add_pd(sumE, _mm512_maskz_mov_pd(m, e));
+    nAll = _mm512_mask_add_pd(nAll, m, nAll, vOne);
+    nWet = _mm512_mask_add_pd(nWet, isWet, nWet, vOne);
+  }
+  const __m512i vs = _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i*)(cells->state + c)));
+  const __mmask8 isBound = _mm512_cmpeq_epi64_mask(vs, vBound);
+  const __m512d nw = _mm512_mask_blend_pd(isBound, nAll, nWet);
+  const __m512d cD = load_conc_avx512(cells->concentration[eStateDrug] + c);
+  const __m512d cE = load_conc_avx512(cells->concentration[eStateEx] + c);
+  const __m512d sD = _mm512_mask_blend_pd(isBound, sumD, wetD);
+  const __m512d sE = _mm512_mask_blend_pd(isBound, sumE, wetE);
+  _mm512_storeu_pd(s->update[0], _mm512_fmadd_pd(_mm512_fnmadd_pd(nw, cD, sD), _mm512_set1_pd(dDrug), cD));
+  _mm512_storeu_pd(s->update[1], _mm512_fmadd_pd(_mm512_fnmadd_pd(nw, cE, sE), _mm512_set1_pd(dEx), cE));
+  _mm512_storeu_pd(s->sumWet[0], wetD);
+  _mm512_storeu_pd(s->sumWet[1], wetE);
+  _mm512_storeu_pd(s->nAll, nAll);
+  _mm512_storeu_pd(s->nWet, nWet);
+}
+
+#else
+//------ AVX2: two vectors of 8 f32 lanes
+template<class S> __attribute__((target("avx2,fma")))
+static void sum_lanes_avx2(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                           const f64 dDrug, const f64 dEx, const f64 boundDiff) {
+  const __m256 vDecay = _mm256_set1_ps((calc_t)boundDiff);
+  const __m256 vSat = _mm256_set1_ps((calc_t)0.000000000001);
+  const __m256 vOne = _mm256_set1_ps(1.0f);
+  const __m256 vZero = _mm256_setzero_ps();
+  const __m256i vWet = _mm256_set1_epi32(eStateWet);
+  const __m256i vBound = _mm256_set1_epi32(eStateBound);
+  for(u32 h=0; h<ENSEMBLE_LANES; h+=8) {
+    __m256 sumD = vZero, sumE = vZero, wetD = vZero, wetE = vZero, nAll = vZero, nWet = vZero;
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const u64 n = nBase[i] + h;
+      const __m256i vs = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(cells->state + n)));
+      const __m256 isWet = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vWet));
+      const __m256 isBound = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vBound));
+      const __m256 m = _mm256_or_ps(isWet, isBound);
+      __m256 d = _mm256_loadu_ps(cells->concentration[eStateDrug] + n);
+      __m256 e = _mm256_loadu_ps(cells->concentration[eStateEx] + n);
+      wetD = _mm256_add_ps(wetD, _mm256_and_ps(d, isWet));
+      wetE = _mm256_add_ps(wetE, _mm256_and_ps(e, isWet));
+      if (S::behind(i)) {
+        // boundary cells behind: decayed and saturated
+        __m256 dd = _mm256_mul_ps(d, vDecay);
+        __m256 de = _mm256_mul_ps(e, vDecay);
+        dd = _mm256_and_ps(dd, _mm256_cmp_ps(dd, vSat, _CMP_GE_OQ));
+        de = _mm256_and_ps(de, _mm256_cmp_ps(de, vSat, _CMP_GE_OQ));
+        d = _mm256_blendv_ps(d, dd, isBound);
+        e = _mm256_blendv_ps(e, de, isBound);
+      }
+      sumD = _mm256_add_ps(sumD, _mm256_and_ps(d, m));
+      sumE = _mm256_add_ps(sumE, _mm256_and_ps(e, m));
+      nAll = _mm256_add_ps(nAll, _mm256_and_ps(vOne, m));
+      nWet = _mm256_add_ps(nWet, _mm256_and_ps(vOne, isWet));
+    }
+    const __m256i vs = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(cells->state + c + h)));
+    const __m256 isBound = _mm256_castsi256_ps(_mm256_cmpeq_epi32(vs, vBound));
+    const __m256 nw = _mm256_blendv_ps(nAll, nWet, isBound);
+    const __m256 cD = _mm256_loadu_ps(cells->concentration[eStateDrug] + c + h);
+    const __m256 cE = _mm256_loadu_ps(cells->concentration[eStateEx] + c + h);
+    const __m256 sD = _mm256_blendv_ps(sumD, wetD, isBound);
+    const __m256 sE = _mm256_blendv_ps(sumE, wetE, isBound);
+    _mm256_storeu_ps(s->update[0] + h, _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cD, sD), _mm256_set1_ps((calc_t)dDrug), cD));
+    _mm256_storeu_ps(s->update[1] + h, _mm256_fmadd_ps(_mm256_fnmadd_ps(nw, cE, sE), _mm256_set1_ps((calc_t)dEx), cE));
+    _mm256_storeu_ps(s->sumWet[0] + h, wetD);
+    _mm256_storeu_ps(s->sumWet[1] + h, wetE);
+    _mm256_storeu_ps(s->nAll + h, nAll);
+    _mm256_storeu_ps(s->nWet + h, nWet);
+  }
+}
+
+//------ AVX-512: one vector of 16 f32 lanes
+template<class S> __attribute__((target("avx512f")))
+static void sum_lanes_avx512(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                             const f64 dDrug, const f64 dEx, const f64 boundDiff) {
+  const __m512 vDecay = _mm512_set1_ps((calc_t)boundDiff);
+  const __m512 vSat = _mm512_set1_ps((calc_t)0.000000000001);
+  const __m512 vOne = _mm512_set1_ps(1.0f);
+  const __m512 vZero = _mm512_setzero_ps();
+  const __m512i vWet = _mm512_set1_epi32(eStateWet);
+  const __m512i vBound = _mm512_set1_epi32(eStateBound);
+  __m512 sumD = vZero, sumE = vZero, wetD = vZero, wetE = vZero, nAll = vZero, nWet = vZero;
+  UNROLL_NEIGHBORS
+  for(u8 i=0; i<S::size; i++) {
+    const u64 n = nBase[i];
+    const __m512i vs = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(cells->state + n)));
+    const __mmask16 isWet = _mm512_cmpeq_epi32_mask(vs, vWet);
+    const __mmask16 isBound = _mm512_cmpeq_epi32_mask(vs, vBound);
+    const __mmask16 m = isWet | isBound;
+    __m512 d = _mm512_loadu_ps(cells->concentration[eStateDrug] + n);
+    __m512 e = _mm512_loadu_ps(cells->concentration[eStateEx] + n);
+    wetD = _mm512_add_ps(wetD, _mm512_maskz_mov_ps(isWet, d));
+    wetE = _mm512_add_ps(wetE, _mm512_maskz_mov_ps(isWet, e));
+    if (S::behind(i)) {
+      // boundary cells behind: decayed and saturated
+      const __m512 dd = _mm512_mul_ps(d, vDecay);
+      const __m512 de = _mm512_mul_ps(e, vDecay);
+      d = _mm512_mask_mov_ps(d, isBound, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(dd, vSat, _CMP_GE_OQ), dd));
+      e = _mm512_mask_mov_ps(e, isBound, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(de, vSat, _CMP_GE_OQ), de));
+    }
+    sumD = _mm512_add_ps(sumD, _mm512_maskz_mov_ps(m, d));
+    sumE = _mm512_add_ps(sumE, _mm512_maskz_mov_ps(m, e));
+    nAll = _mm512_mask_add_ps(nAll, m, nAll, vOne);
+    nWet = _mm512_mask_add_ps(nWet, isWet, nWet, vOne);
+  }
+  const __m512i vs = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(cells->state + c)));
+  const __mmask16 isBound = _mm512_cmpeq_epi32_mask(vs, vBound);
+  const __m512 nw = _mm512_mask_blend_ps(isBound, nAll, nWet);
+  const __m512 cD = _mm512_loadu_ps(cells->concentration[eStateDrug] + c);
+  const __m512 cE = _mm512_loadu_ps(cells->concentration[eStateEx] + c);
+  const __m512 sD = _mm512_mask_blend_ps(isBound, sumD, wetD);
+  const __m512 sE = _mm512_mask_blend_ps(isBound, sumE, wetE);
+  _mm512_storeu_ps(s->update[0], _mm512_fmadd_ps(_mm512_fnmadd_ps(nw, cD, sD), _mm512_set1_ps((calc_t)dDrug), cD));
+  _mm512_storeu_ps(s->update[1], _mm512_fmadd_ps(_mm512_fnmadd_ps(nw, cE, sE), _mm512_set1_ps((calc_t)dEx), cE));
+  _mm512_storeu_ps(s->sumWet[0], wetD);
+  _mm512_storeu_ps(s->sumWet[1], wetE);
+  _mm512_storeu_ps(s->nAll, nAll);
+  _mm512_storeu_ps(s->nWet, nWet);
+}
+#endif
+
+//------ c-tor
+CellEnsemble::CellEnsemble(CellModel* const* replicas, const u32 numreplicas, const u32 numthreads, u8 simd) :
+numReplicas(numreplicas)
+{
+  const CellModel* const m0 = replicas[0];
+  for(u32 r=1; r<numReplicas; r++) {
+    if ((replicas[r]->numCells != m0->numCells) || (replicas[r]->layout != m0->layout) || (replicas[r]->dt != m0->dt)
+        || (replicas[r]->stencil != m0->stencil) || (replicas[r]->iterationNum != m0->iterationNum)) {
+      printf("ensemble replicas must share their parameters, exiting!\n");
+      exit(1);
+    }
+  }
+  numLanes = ((numReplicas + ENSEMBLE_LANES - 1) / ENSEMBLE_LANES) * ENSEMBLE_LANES;
+  numBlocks = numLanes / ENSEMBLE_LANES;
+  numCells = m0->numCells;
+  dt = m0->dt;
+  dDrug = m0->dDrug;
+  dEx = m0->dEx;
+  boundDiff = m0->boundDiff;
+  iterationNum = m0->iterationNum;
+
+  // the cells active in any replica
+  vector<u32> all;
+  for(u32 r=0; r<numReplicas; r++) {
+    all.insert(all.end(), replicas[r]->cellsToProcess, replicas[r]->cellsToProcess + replicas[r]->numCellsToProcess);
+  }
+  sort(all.begin(), all.end());
+  all.erase(unique(all.begin(), all.end()), all.end());
+  numSlots = all.size();
+
+  const u64 cellLanes = (u64)numCells * numLanes;
+  const u64 slotLanes = (u64)numSlots * numLanes;
+  cells.state = new u8 [cellLanes];
+  cells.concentration[0] = new conc_t [cellLanes];
+  cells.concentration[1] = new conc_t [cellLanes];
+  cellsUpdate.state = new u8 [cellLanes];
+  cellsUpdate.concentration[0] = new conc_t [cellLanes];
+  cellsUpdate.concentration[1] = new conc_t [cellLanes];
+  slotIdx = new u32 [numSlots];
+  rngIdx = new u32 [numSlots];
+  numNeighbors = m0->numNeighbors;
+  faceBits = (m0->stencil == eStencil26) ? Stencil26::faceLowBits() : Stencil6::faceLowBits();
+  neighborIdx = new u32 [numSlots * numNeighbors];
+  active = new u8 [slotLanes];
+  inFrontier = new u8 [slotLanes];
+  nextFrontier = new u8 [slotLanes];
+  dissCount = new u16 [slotLanes];
+  dissSteps = new u16 [slotLanes];
+  dissInc = new f64 [slotLanes];
+  dissProb = new f64 [slotLanes];
+  seed = new u32 [numLanes];
+  drugMassTotal = new f64 [numLanes];
+  drugMass = new f64 [numLanes];
+  released = new f64 [numLanes];
+  framePos = new u32 [numLanes];
+  chunkMass = new f64 [numLanes];
+  batchMass = new f64 [numLanes];
+  batchCount = new u32 [numLanes];
+
+  copy(all.begin(), all.end(), slotIdx);
+  for(u32 u=0; u<numSlots; u++) {
+    rngIdx[u] = replicas[0]->linearIdx(slotIdx[u]);
+  }
+  memset(active, 0, slotLanes);
+  memset(inFrontier, 0, slotLanes);
+  memset(nextFrontier, 0, slotLanes);
+  for(u64 k=0; k<slotLanes; k++) {
+    dissCount[k] = 0;
+    dissSteps[k] = 1;
+    dissInc[k] = 0.0;
+    dissProb[k] = 0.0;
+  }
+
+  // interleave the replicas; padding lanes are inert polymer
+  for(u32 r=0; r<numLanes; r++) {
+    const CellModel* const m = (r < numReplicas) ? replicas[r] : NULL;
+    for(u32 idx=0; idx<numCells; idx++) {
+      const u64 k = (u64)idx * numLanes + r;
+      cells.state[k] = m ? m->cells.state[idx] : (u8)eStatePoly;
+      cells.concentration[0][k] = m ? m->cells.concentration[0][idx] : 0.0;
+      cells.concentration[1][k] = m ? m->cells.concentration[1][idx] : 0.0;
+    }
+    seed[r] = m ? m->rngSeed : 0;
+    drugMassTotal[r] = m ? m->drugMassTotal : 0.0;
+    drugMass[r] = m ? m->drugMass : 0.0;
+    released[r] = 0.0;
+    if (m == NULL) { continue; }
+    for(u32 p=0; p<m->numCellsToProcess; p++) {
+      const u32 u = findSlot(m->cellsToProcess[p]);
+      const u64 k = (u64)u * numLanes + r;
+      // all replicas share the geometry, so any of them gives the neighbors
+      m->findNeighbors(m->cellsToProcess[p], neighborIdx + (u * numNeighbors));
+      active[k] = 1;
+      inFrontier[k] = m->inFrontier[p];
+      dissCount[k] = m->dissCount[p];
+      dissSteps[k] = m->dissSteps[p];
+      dissInc[k] = m->dissInc[p];
+      dissProb[k] = m->dissProb[p];
+    }
+  }
+  memcpy(cellsUpdate.state, cells.state, cellLanes * sizeof(u8));
+  memcpy(cellsUpdate.concentration[0], cells.concentration[0], cellLanes * sizeof(conc_t));
+  memcpy(cellsUpdate.concentration[1], cells.concentration[1], cellLanes * sizeof(conc_t));
+
+  // neighbor-sum kernel, with the same fallbacks as CellModel::selectDiffuseKernel()
+  __builtin_cpu_init();
+  const bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  const bool hasAvx512 = __builtin_cpu_supports("avx512f");
+  simdLevel = (eSimdLevel)simd;
+  if (simdLevel == eSimdAuto) {
+    simdLevel = hasAvx512 ? eSimdAvx512 : (hasAvx2 ? eSimdAvx2 : eSimdScalar);
+  }
+  if ((simdLevel == eSimdAvx512) && !hasAvx512) { simdLevel = eSimdAvx2; }
+  if ((simdLevel == eSimdAvx2) && !hasAvx2) { simdLevel = eSimdScalar; }
+  const bool s26 = (m0->stencil == eStencil26);
+  switch(simdLevel) {
+    case eSimdAvx512:
+      sumLanes = s26 ? &sum_lanes_avx512<Stencil26> : &sum_lanes_avx512<Stencil6>;
+      break;
+    case eSimdAvx2:
+      sumLanes = s26 ? &sum_lanes_avx2<Stencil26> : &sum_lanes_avx2<Stencil6>;
+      break;
+    default:
+      sumLanes = s26 ? &sum_lanes_scalar<Stencil26> : &sum_lanes_scalar<Stencil6>;
+      break;
+  }
+
+  threads = new ThreadPool(numthreads);
+}
+
+//------ d-tor
+CellEnsemble::~CellEnsemble(void) {
+  delete[] cells.state;
+  delete[] cells.concentration[0];
+  delete[] cells.concentration[1];
+  delete[] cellsUpdate.state;
+  delete[] cellsUpdate.concentration[0];
+  delete[] cellsUpdate.concentration[1];
+  delete[] slotIdx;
+  delete[] rngIdx;
+  delete[] neighborIdx;
+  delete[] active;
+  delete[] inFrontier;
+  delete[] nextFrontier;
+  delete[] dissCount;
+  delete[] dissSteps;
+  delete[] dissInc;
+  delete[] dissProb;
+  delete[] seed;
+  delete[] drugMassTotal;
+  delete[] drugMass;
+  delete[] released;
+  delete[] framePos;
+  delete[] chunkMass;
+  delete[] batchMass;
+  delete[] batchCount;
+  delete threads;
+}
+
+// bytes of cell data: both buffers plus per-slot data
+u64 CellEnsemble::cellMemory(void) {
+  const u64 perCell = sizeof(u8) + 2 * sizeof(conc_t);
+  const u64 perSlot = 3 * sizeof(u8) + 2 * sizeof(u16) + 2 * sizeof(f64);
+  return (2 * perCell * (u64)numCells * numLanes) + (perSlot * (u64)numSlots * numLanes)
+    + ((u64)numSlots * (numNeighbors + 2) * sizeof(u32));
+}
+
+//---------- iterate
+const f64* CellEnsemble::iterate(void) {
+  threads->run(&CellEnsemble::iterate_thr, this);
+  iterationNum++;
+
+  // commit: swap the buffers and move on to the next frontier
+  CellBuffer tmp = cells;
+  cells = cellsUpdate;
+  cellsUpdate = tmp;
+  u8* const f = inFrontier;
+  inFrontier = nextFrontier;
+  nextFrontier = f;
+  memset(nextFrontier, 0, (u64)numSlots * numLanes);
+
+  for(u32 r=0; r<numReplicas; r++) {
+    released[r] = drugMassTotal[r] - drugMass[r];
+  }
+  return released;
+}
+
+void CellEnsemble::iterate_thr(void* ctx, const u32 thr, const u32 numThr) {
+  ((CellEnsemble*)ctx)->iterateThread(thr, numThr);
+}
+
+// each thread owns whole lane blocks; lanes never interact
+void CellEnsemble::iterateThread(const u32 thr, const u32 numThr) {
+  u32 b0, b1;
+  ThreadPool::range(numBlocks, thr, numThr, &b0, &b1);
+  if (b0 < b1) {
+    updateLanes(b0 * ENSEMBLE_LANES, b1 * ENSEMBLE_LANES);
+  }
+}
+
+// close one lane's chunk of the single model's frontier
+inline void CellEnsemble::closeChunk(const u32 r) {
+  if (batchCount[r] > 0) { chunkMass[r] += batchMass[r]; }
+  drugMass[r] += chunkMass[r];
+  chunkMass[r] = 0.0;
+  batchMass[r] = 0.0;
+  batchCount[r] = 0;
+}
+
+// one step of lanes [r0, r1). per lane, this visits the replica's
+// frontier in the same order as CellModel::updateCells(), and sums the
+// change in drug mass the same way: wet cells in batches of WET_BATCH,
+// batches and chunks closed where the single model closes them.
+void CellEnsemble::updateLanes(const u32 r0, const u32 r1) {
+  const u32 chunk = CellModel::massChunkSize;
+  const u32 L = numLanes;
+  LaneSums s;
+  u64 nBase[MAX_NEIGHBORS];
+  // local copies: byte stores below would otherwise force reloading members
+  const u8* const inFr = inFrontier;
+  u8* const nextFr = nextFrontier;
+  const u8* const state = cells.state;
+  const conc_t* const cDrug = cells.concentration[eStateDrug];
+  const conc_t* const cEx = cells.concentration[eStateEx];
+  u8* const uState = cellsUpdate.state;
+  conc_t* const uDrug = cellsUpdate.concentration[eStateDrug];
+  conc_t* const uEx = cellsUpdate.concentration[eStateEx];
+  u32* const fPos = framePos;
+  f64* const bMass = batchMass;
+  u32* const bCount = batchCount;
+  for(u32 r=r0; r<r1; r++) {
+    fPos[r] = 0;
+    chunkMass[r] = 0.0;
+    bMass[r] = 0.0;
+    bCount[r] = 0;
+  }
+
+  for(u32 u=0; u<numSlots; u++) {
+    const u8* const inF = inFr + ((u64)u * L);
+    u8 any = 0;
+    for(u32 r=r0; r<r1; r++) { any |= inF[r]; }
+    if (!any) { continue; }
+
+    const u32 idx = slotIdx[u];
+    const u32* const nIdx = neighborIdx + (u * numNeighbors);
+    for(u32 l0=r0; l0<r1; l0+=ENSEMBLE_LANES) {
+      u8 anyBlock = 0;
+      for(u32 l=0; l<ENSEMBLE_LANES; l++) { anyBlock |= inF[l0 + l]; }
+      if (!anyBlock) { continue; }
+      for(u8 i=0; i<numNeighbors; i++) {
+        nBase[i] = (u64)nIdx[i] * L + l0;
+      }
+      const u64 c = (u64)idx * L + l0;
+      (*sumLanes)(&s, &cells, c, nBase, dDrug, dEx, boundDiff);
+
+      // wet and boundary lanes take the diffused values, everything else
+      // carries over (lanes outside the frontier are equal in both buffers);
+      // dissolution below overwrites what it changes
+      const u8* const st = state + c;
+      const conc_t* const cD = cDrug + c;
+      const conc_t* const cE = cEx + c;
+      conc_t* const uD = uDrug + c;
+      conc_t* const uE = uEx + c;
+      memcpy(uState + c, st, ENSEMBLE_LANES);
+      for(u32 l=0; l<ENSEMBLE_LANES; l++) {
+        const bool diffusing = inF[l0 + l] && ((st[l] == eStateWet) || (st[l] == eStateBound));
+        uD[l] = diffusing ? s.update[0][l] : cD[l];
+        uE[l] = diffusing ? s.update[1][l] : cE[l];
+      }
+
+      u8* const next = nextFr + ((u64)u * L) + l0;
+      for(u32 l=0; l<ENSEMBLE_LANES; l++) {
+        const u32 r = l0 + l;
+        if (!inF[r]) { continue; }
+        if (((fPos[r] % chunk) == 0) && (fPos[r] > 0)) {
+          closeChunk(r);
+        }
+        fPos[r]++;
+        const u8 sl = st[l];
+        // wet cells are always kept; boundary cells while they have a wet neighbor
+        const bool wet = (sl == eStateWet);
+        bMass[r] += wet ? ((f64)uD[l] - cD[l]) : 0.0;
+        bCount[r] += wet;
+        next[l] |= wet || ((sl == eStateBound) && (s.nWet[l] > 0.0));
+        if (bCount[r] == WET_BATCH) {
+          chunkMass[r] += bMass[r];
+          bMass[r] = 0.0;
+          bCount[r] = 0;
+        }
+        if ((sl <= eStateDissEx) || (sl == eStateVoid)) {
+          dissolveLane(u, r, c + l, sl, &s, l);
+        }
+      }
+    }
+  }
+
+  // close the last chunk
+  for(u32 r=r0; r<r1; r++) {
+    if (fPos[r] > 0) { closeChunk(r); }
+  }
+}
+
+// dissolution of one dry or dissolving cell in one lane, as in
+// CellModel::dissolve() and CellModel::continueDissolve()
+void CellEnsemble::dissolveLane(const u32 u, const u32 r, const u64 k, const u8 state, const LaneSums* s, const u32 l) {
+  const u64 q = (u64)u * numLanes + r;
+  bool wake = false;
+  if ((state == eStateDissDrug) || (state == eStateDissEx)) {
+    const u8 species = state - 2;
+    dissCount[q]++;
+    cellsUpdate.concentration[species][k] = cells.concentration[species][k] + dissInc[q];
+    nextFrontier[q] = 1;
+    if (dissCount[q] >= dissSteps[q]) {
+      cellsUpdate.state[k] = eStateWet;
+      chunkMass[r] += cellsUpdate.concentration[eStateDrug][k] - ((state == eStateDissDrug) ? 1.0 : 0.0);
+      wake = true;
+    }
+  } else {
+    // drug, excipient or void: only face neighbors count. with 6 neighbors
+    // those are the lane sums; else sum them here, in neighbor order
+    u8 nw = 0;
+    calc_t sumC = 0;
+    if (numNeighbors == Stencil6::size) {
+      nw = (u8)s->nAll[l];
+      sumC = (state <= eStateEx) ? s->sumWet[state][l] : 0;
+    } else {
+      const u32* const nIdx = neighborIdx + (u * numNeighbors);
+      for(u8 i=0; i<numNeighbors; i++) {
+        if (!((faceBits >> (CLASS_BITS * i)) & 1)) { continue; }
+        const u64 n = (u64)nIdx[i] * numLanes + r;
+        const u8 sn = cells.state[n];
+        nw += (sn == eStateWet) || (sn == eStateBound);
+        if ((sn == eStateWet) && (state <= eStateEx)) {
+          sumC += cells.concentration[state][n];
+        }
+      }
+    }
+    if (nw == 0) { return; }
+    nextFrontier[q] = 1;
+    if (Random::uniform(seed[r], eRandDissolve, iterationNum, rngIdx[u]) < ((1 - (sumC / (f64)nw)) * dissProb[q])) {
+      if (state == eStateVoid) {
+        cellsUpdate.state[k] = eStateWet;
+        chunkMass[r] += cells.concentration[eStateDrug][k];
+        wake = true;
+      } else {
+        cellsUpdate.state[k] = (state == eStateDrug) ? eStateDissDrug : eStateDissEx;
+        dissCount[q] = 0;
+      }
+    }
+  }
+  if (wake) {
+    // wake this replica's candidate neighbors
+    const u32* const nIdx = neighborIdx + (u * numNeighbors);
+    for(u8 i=0; i<numNeighbors; i++) {
+      const u32 n = findSlot(nIdx[i]);
+      if ((n < numSlots) && active[(u64)n * numLanes + r]) {
+        nextFrontier[(u64)n * numLanes + r] = 1;
+      }
+    }
+  }
+}
+
+// slot of a cell in the union active list, or numSlots if it has none
+u32 CellEnsemble::findSlot(const u32 idx) {
+  const u32* const it = lower_bound(slotIdx, slotIdx + numSlots, idx);
+  if ((it == slotIdx + numSlots) || (*it != idx)) {
+    return numSlots;
+  }
+  return it - slotIdx;
+}
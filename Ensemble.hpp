@@ -0,0 +1,108 @@
+/*
+ *  Ensemble.hpp
+ *  celldiff
+ *
+ *  lockstep ensemble: replicas of one model (same parameters, different
+ *  seeds) advanced together. every per-cell value is stored with the
+ *  replicas innermost, cell-major: value(idx, r) = plane[idx * numLanes + r],
+ *  so the neighbor sums of diffusion run as vectors across replicas.
+ *  replicas are processed in blocks of ENSEMBLE_LANES; each lane follows
+ *  exactly the same rules, random draws and summation order as a single
+ *  CellModel, so a replica's release curve is the same as its own run.
+ */
+
+#ifndef _CELLDIFF_ENSEMBLE_H_
+#define _CELLDIFF_ENSEMBLE_H_
+
+#include "types.h"
+#include "CellModel.hpp"
+
+// replicas per vector block (the lane count is padded to a multiple):
+// one 512-bit vector of f64, or of f32 in the f32 build
+#if CELLDIFF_F32
+#define ENSEMBLE_LANES 16
+#else
+#define ENSEMBLE_LANES 8
+#endif
+
+// neighbor sums of one cell for one block of lanes (Ensemble.cpp)
+struct LaneSums;
+
+class CellEnsemble {
+public:
+  // gather replicas that have been set up; they can be deleted afterwards
+  CellEnsemble(CellModel* const* replicas, const u32 numreplicas, const u32 numthreads=1, u8 simd=eSimdAuto);
+  ~CellEnsemble(void);
+  // advance all replicas by one step; returns the released drug mass of each
+  const f64* iterate(void);
+  // bytes of cell data allocated
+  u64 cellMemory(void);
+private:
+  // update one thread's lane blocks for one step
+  void iterateThread(const u32 thr, const u32 numThr);
+  static void iterate_thr(void* ctx, const u32 thr, const u32 numThr);
+  // update all active cells of lanes [r0, r1)
+  void updateLanes(const u32 r0, const u32 r1);
+  // dissolution of a dry or dissolving cell in one lane
+  void dissolveLane(const u32 u, const u32 r, const u64 k, const u8 state, const LaneSums* s, const u32 l);
+  // add a lane's finished chunk to its drug mass
+  void closeChunk(const u32 r);
+  // slot of a cell in the union active list, numSlots if none
+  u32 findSlot(const u32 idx);
+public:
+  u32 numReplicas;
+  // replicas rounded up to whole blocks
+  u32 numLanes;
+  u32 numBlocks;
+  u32 numCells;
+  // time step (shared)
+  f64 dt;
+  // initial drug mass of each replica
+  f64* drugMassTotal;
+  // kernel for the per-lane neighbor sums, chosen like CellModel's
+  eSimdLevel simdLevel;
+private:
+  // lane-interleaved cell buffers
+  CellBuffer cells;
+  CellBuffer cellsUpdate;
+  // cells active in any replica, in index order ("slots"), and their neighbors
+  // (numNeighbors each)
+  u32* slotIdx;
+  u32* neighborIdx;
+  u8 numNeighbors;
+  // the face neighbors among them, as the stencil's low class bits
+  u32 faceBits;
+  // linear index of each slot's cell, for the random streams
+  u32* rngIdx;
+  u32 numSlots;
+  //------ per slot and lane: [slot * numLanes + lane]
+  // cell is active in this replica
+  u8* active;
+  // cell is in this replica's frontier: this step, next step
+  u8* inFrontier;
+  u8* nextFrontier;
+  u16* dissCount;
+  u16* dissSteps;
+  f64* dissInc;
+  f64* dissProb;
+  //------ per lane
+  u32* seed;
+  f64* drugMass;
+  f64* released;
+  // per lane, during a step: frontier position, chunk sum, wet batch sum and count
+  u32* framePos;
+  f64* chunkMass;
+  f64* batchMass;
+  u32* batchCount;
+  // model constants (shared)
+  f64 dDrug;
+  f64 dEx;
+  f64 boundDiff;
+  // neighbor-sum kernel
+  void (*sumLanes)(LaneSums* s, const CellBuffer* cells, const u64 c, const u64* nBase,
+                   const f64 dDrug, const f64 dEx, const f64 boundDiff);
+  ThreadPool* threads;
+  u64 iterationNum;
+};
+
+#endif // header guard
@@ -0,0 +1,427 @@
+/*
+ *  Implicit.cpp
+ *  celldiff
+ *
+ *  implicit diffusion (--implicit K): the time step is K explicit steps
+ *  long, and the wet and boundary cells take one backward Euler step
+ *  together. for a wet cell,
+ *
+ *    (1 + k nw) c' - k sum(c' of wet neighbors) - k sum(d c' of boundary neighbors) = c
+ *
+ *  with k the per-step weight (K times the explicit one), nw the count of
+ *  wet and boundary neighbors, and d the decay of boundary cells behind it
+ *  (boundDiff, or 1), as in diffuse(). a boundary cell exchanges with its
+ *  wet neighbors only. each exchange then moves the same mass both ways as
+ *  in the explicit update, and any K is stable.
+ *
+ *  the decay makes the system unsymmetric, so it is solved by BiCGSTAB
+ *  with a Jacobi preconditioner, both species in lockstep. rows follow the
+ *  frontier, and dot products are summed per fixed chunk of rows in chunk
+ *  order, so the result doesn't depend on the thread count.
+ *
+ *  the front moves within the step as it would over the explicit steps:
+ *  a dry cell gets the chances of the explicit steps left after its first
+ *  neighbor got wet, and a cell that gets wet at explicit step t of the
+ *  step gives its own newly woken neighbors the steps after t. dissolving
+ *  cells go on for the rest of the step. cells wet during the step, and
+ *  the boundary cells they reach, join the solve of that step, from the
+ *  values they got wet with.
+ */
+
+#include <cmath>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "CellModel.hpp"
+
+using namespace std;
+
+// sum the partial dot products of all chunks, in chunk order
+static void sum_partials(const f64* partial, const u32 numChunks, f64* sum) {
+  for(u8 j=0; j<IMPLICIT_PARTIALS; j++) {
+    sum[j] = 0.0;
+  }
+  for(u32 c=0; c<numChunks; c++) {
+    for(u8 j=0; j<IMPLICIT_PARTIALS; j++) {
+      sum[j] += partial[c * IMPLICIT_PARTIALS + j];
+    }
+  }
+}
+
+// state of cell n once the front has moved through the step: the update
+// buffer holds the cells wet during the step, and current states elsewhere
+// (or stale ones, where the cell was wet already)
+static inline u8 step_state(const CellBuffer& cur, const CellBuffer& upd, const u32 n) {
+  return (upd.state[n] == eStateWet) ? (u8)eStateWet : cur.state[n];
+}
+
+// weighted sum of a row's neighbors in v, both species
+template<class S> static inline void sum_neighbors(const u32* nbr, const u32 decay, const f64 d,
+                                                   const f64* v, f64* nsum) {
+  nsum[0] = 0.0;
+  nsum[1] = 0.0;
+  UNROLL_NEIGHBORS
+  for(u8 i=0; i<S::size; i++) {
+    const f64 w = ((decay >> i) & 1) ? d : 1.0;
+    nsum[0] += w * v[2 * nbr[i]];
+    nsum[1] += w * v[2 * nbr[i] + 1];
+  }
+}
+
+template<class S> void CellModel::solveImplicit(const u32 thr, const u32 numThr) {
+  // rows: the wet and boundary cells, in frontier order
+  if (thr == 0) {
+    numRows = 0;
+    for(u32 t=0; t<numThr; t++) {
+      for(u32 w=0; w<implicitRows[t].size(); w++) {
+        const u32 p = implicitRows[t][w];
+        rowSlot[numRows] = p;
+        cellRow[cellsToProcess[p]] = numRows;
+        numRows++;
+      }
+      implicitRows[t].clear();
+    }
+    for(u32 w=0; w<spreadRows.size(); w++) {
+      const u32 p = spreadRows[w];
+      rowSlot[numRows] = p;
+      cellRow[cellsToProcess[p]] = numRows;
+      numRows++;
+    }
+    spreadRows.clear();
+    numRowChunks = (numRows + massChunkSize - 1) / massChunkSize;
+    // the entry past the last row stands for "no neighbor"
+    cgX[2 * numRows] = cgX[2 * numRows + 1] = 0.0;
+    cgPHat[2 * numRows] = cgPHat[2 * numRows + 1] = 0.0;
+    cgSHat[2 * numRows] = cgSHat[2 * numRows + 1] = 0.0;
+  }
+  threads->sync();
+
+  // each thread owns whole chunks of rows
+  u32 c0, c1;
+  ThreadPool::range(numRowChunks, thr, numThr, &c0, &c1);
+  const u32 r0 = min(c0 * massChunkSize, numRows);
+  const u32 r1 = min(c1 * massChunkSize, numRows);
+  const f64 k[2] = { dDrug, dEx };
+  const conc_t* const cOld[2] = { cells.concentration[eStateDrug], cells.concentration[eStateEx] };
+  // two sets of partials: a phase never fills the set the phase before it
+  // summed, since a thread may still be reading it
+  f64* const partial[2] = { cgPartial, cgPartial + numRowChunks * IMPLICIT_PARTIALS };
+  f64 sum[IMPLICIT_PARTIALS];
+  f64 nsum[2];
+  // the preconditioner, 1 / diagonal, by neighbor count
+  f64 invDiag[2][S::size + 1];
+  for(u8 nw=0; nw<=S::size; nw++) {
+    invDiag[0][nw] = 1.0 / (1.0 + k[0] * nw);
+    invDiag[1][nw] = 1.0 / (1.0 + k[1] * nw);
+  }
+
+  // neighbor rows and right-hand side (in cgR). the first guess carries on a
+  // wet cell's change over the step before (still in the update buffer);
+  // cells wet during the step start from the value they got wet with
+  for(u32 r=r0; r<r1; r++) {
+    const u32 idx = cellsToProcess[rowSlot[r]];
+    const bool isWet = (step_state(cells, cellsUpdate, idx) == eStateWet);
+    const bool wasWet = (cells.state[idx] == eStateWet);
+    u32 nIdx[S::size];
+    neighbors<S>(idx, nIdx);
+    u8 nw = 0;
+    u32 decay = 0;
+    f64 held[2] = { 0.0, 0.0 };
+    UNROLL_NEIGHBORS
+    for(u8 i=0; i<S::size; i++) {
+      const u32 n = nIdx[i];
+      const u8 state = step_state(cells, cellsUpdate, n);
+      u32 row = numRows;
+      // boundary cells only exchange with wet ones
+      if ((state == eStateWet) || (isWet && (state == eStateBound))) {
+        nw++;
+        const bool decayed = isWet && (state == eStateBound) && S::behind(i);
+        const u32 q = cellRow[n];
+        if ((q < numRows) && (cellsToProcess[rowSlot[q]] == n)) {
+          row = q;
+          decay |= (u32)decayed << i;
+        } else {
+          // not in the system: holds its value
+          const f64 d = decayed ? boundDiff : 1.0;
+          held[0] += d * cOld[0][n];
+          held[1] += d * cOld[1][n];
+        }
+      }
+      rowNbr[r * S::size + i] = row;
+    }
+    rowNw[r] = nw;
+    rowDecay[r] = decay;
+    for(u8 s=0; s<2; s++) {
+      const f64 c = (isWet && !wasWet) ? cellsUpdate.concentration[s][idx] : cOld[s][idx];
+      cgR[2 * r + s] = c + k[s] * held[s];
+      cgX[2 * r + s] = wasWet ? max(2.0 * c - cellsUpdate.concentration[s][idx], 0.0) : c;
+    }
+  }
+  threads->sync();
+
+  // r = r0 = p = b - A x, phat = p / diagonal
+  for(u32 c=c0; c<c1; c++) {
+    f64* const part = partial[1] + c * IMPLICIT_PARTIALS;
+    for(u8 j=0; j<IMPLICIT_PARTIALS; j++) { part[j] = 0.0; }
+    const u32 e = min((c + 1) * massChunkSize, numRows);
+    for(u32 r=c*massChunkSize; r<e; r++) {
+      sum_neighbors<S>(rowNbr + r * S::size, rowDecay[r], boundDiff, cgX, nsum);
+      for(u8 s=0; s<2; s++) {
+        const f64 diag = 1.0 + k[s] * rowNw[r];
+        const f64 b = cgR[2 * r + s];
+        const f64 res = b - (diag * cgX[2 * r + s] - k[s] * nsum[s]);
+        cgR[2 * r + s] = res;
+        cgR0[2 * r + s] = res;
+        cgP[2 * r + s] = res;
+        cgPHat[2 * r + s] = res * invDiag[s][rowNw[r]];
+        part[s] += res * res;
+        part[2 + s] += b * b;
+      }
+    }
+  }
+  threads->sync();
+  sum_partials(partial[1], numRowChunks, sum);
+  f64 rho[2] = { sum[0], sum[1] };
+  const f64 tol2[2] = { IMPLICIT_TOL * IMPLICIT_TOL * sum[2], IMPLICIT_TOL * IMPLICIT_TOL * sum[3] };
+  bool done[2] = { sum[0] <= tol2[0], sum[1] <= tol2[1] };
+
+  u32 it = 0;
+  while (!(done[0] && done[1]) && (it < IMPLICIT_MAX_ITER)) {
+    it++;
+    // v = A phat
+    for(u32 c=c0; c<c1; c++) {
+      f64* const part = partial[0] + c * IMPLICIT_PARTIALS;
+      for(u8 j=0; j<IMPLICIT_PARTIALS; j++) { part[j] = 0.0; }
+      const u32 e = min((c + 1) * massChunkSize, numRows);
+      for(u32 r=c*massChunkSize; r<e; r++) {
+        sum_neighbors<S>(rowNbr + r * S::size, rowDecay[r], boundDiff, cgPHat, nsum);
+        for(u8 s=0; s<2; s++) {
+          const f64 v = (1.0 + k[s] * rowNw[r]) * cgPHat[2 * r + s] - k[s] * nsum[s];
+          cgV[2 * r + s] = v;
+          part[s] += cgR0[2 * r + s] * v;
+        }
+      }
+    }
+    threads->sync();
+    sum_partials(partial[0], numRowChunks, sum);
+    f64 alpha[2];
+    for(u8 s=0; s<2; s++) {
+      // (a zero product is a breakdown: stop where it is)
+      done[s] = done[s] || (sum[s] == 0.0);
+      alpha[s] = done[s] ? 0.0 : rho[s] / sum[s];
+    }
+
+    // s = r - alpha v (in cgR), shat = s / diagonal
+    for(u32 r=r0; r<r1; r++) {
+      for(u8 s=0; s<2; s++) {
+        const f64 res = cgR[2 * r + s] - alpha[s] * cgV[2 * r + s];
+        cgR[2 * r + s] = res;
+        cgSHat[2 * r + s] = res * invDiag[s][rowNw[r]];
+      }
+    }
+    threads->sync();
+
+    // t = A shat
+    for(u32 c=c0; c<c1; c++) {
+      f64* const part = partial[0] + c * IMPLICIT_PARTIALS;
+      for(u8 j=0; j<IMPLICIT_PARTIALS; j++) { part[j] = 0.0; }
+      const u32 e = min((c + 1) * massChunkSize, numRows);
+      for(u32 r=c*massChunkSize; r<e; r++) {
+        sum_neighbors<S>(rowNbr + r * S::size, rowDecay[r], boundDiff, cgSHat, nsum);
+        for(u8 s=0; s<2; s++) {
+          const f64 t = (1.0 + k[s] * rowNw[r]) * cgSHat[2 * r + s] - k[s] * nsum[s];
+          cgT[2 * r + s] = t;
+          part[s] += t * cgR[2 * r + s];
+          part[2 + s] += t * t;
+        }
+      }
+    }
+    threads->sync();
+    sum_partials(partial[0], numRowChunks, sum);
+    f64 omega[2];
+    for(u8 s=0; s<2; s++) {
+      omega[s] = (done[s] || (sum[2 + s] == 0.0)) ? 0.0 : sum[s] / sum[2 + s];
+    }
+
+    // x += alpha phat + omega shat, r = s - omega t
+    for(u32 c=c0; c<c1; c++) {
+      f64* const part = partial[1] + c * IMPLICIT_PARTIALS;
+      for(u8 j=0; j<IMPLICIT_PARTIALS; j++) { part[j] = 0.0; }
+      const u32 e = min((c + 1) * massChunkSize, numRows);
+      for(u32 r=c*massChunkSize; r<e; r++) {
+        for(u8 s=0; s<2; s++) {
+          cgX[2 * r + s] += alpha[s] * cgPHat[2 * r + s] + omega[s] * cgSHat[2 * r + s];
+          const f64 res = cgR[2 * r + s] - omega[s] * cgT[2 * r + s];
+          cgR[2 * r + s] = res;
+          part[s] += cgR0[2 * r + s] * res;
+          part[2 + s] += res * res;
+        }
+      }
+    }
+    threads->sync();
+    sum_partials(partial[1], numRowChunks, sum);
+    f64 beta[2];
+    for(u8 s=0; s<2; s++) {
+      beta[s] = (done[s] || (omega[s] == 0.0)) ? 0.0 : (sum[s] / rho[s]) * (alpha[s] / omega[s]);
+      rho[s] = sum[s];
+      done[s] = done[s] || (omega[s] == 0.0) || (sum[2 + s] <= tol2[s]);
+    }
+
+    // p = r + beta (p - omega v), phat = p / diagonal
+    for(u32 r=r0; r<r1; r++) {
+      for(u8 s=0; s<2; s++) {
+        const f64 p = cgR[2 * r + s] + beta[s] * (cgP[2 * r + s] - omega[s] * cgV[2 * r + s]);
+        cgP[2 * r + s] = p;
+        cgPHat[2 * r + s] = p * invDiag[s][rowNw[r]];
+      }
+    }
+    threads->sync();
+  }
+  if (thr == 0) {
+    implicitSolves++;
+    implicitIters += it;
+  }
+
+  // cells take the solution; change in drug mass of the wet ones per chunk, as stored
+  for(u32 c=c0; c<c1; c++) {
+    f64 dMass = 0.0;
+    const u32 e = min((c + 1) * massChunkSize, numRows);
+    for(u32 r=c*massChunkSize; r<e; r++) {
+      const u32 idx = cellsToProcess[rowSlot[r]];
+      const u8 state = step_state(cells, cellsUpdate, idx);
+      // (cells wet during the step counted their mass as they got wet)
+      const f64 before = (cells.state[idx] == eStateWet) ? (f64)cOld[0][idx]
+        : (f64)cellsUpdate.concentration[eStateDrug][idx];
+      cellsUpdate.state[idx] = state;
+      cellsUpdate.concentration[eStateDrug][idx] = cgX[2 * r];
+      cellsUpdate.concentration[eStateEx][idx] = cgX[2 * r + 1];
+      if (state == eStateWet) {
+        dMass += (f64)cellsUpdate.concentration[eStateDrug][idx] - before;
+      }
+    }
+    rowMass[c] = dMass;
+  }
+}
+
+void CellModel::dissolveFrom(const u32 p, const f64 prob, const u32 t0, f64* pMass) {
+  const u32 idx = cellsToProcess[p];
+  const u8 state = cells.state[idx];
+  const f64 q = min(max(prob, 0.0), 1.0);
+  if ((t0 >= stepMultiple) || (q <= 0.0)) { return; }
+  // chances failed before the first success: with n chances left this
+  // decides as u < 1 - (1 - q)^n would
+  const f64 u = getRand(eRandDissolve, iterationNum, rngIdx[p]);
+  const f64 failed = (q < 1.0) ? floor(log1p(-u) / log1p(-q)) : 0.0;
+  if (failed >= (f64)(stepMultiple - t0)) { return; }
+  const u32 t = t0 + (u32)failed + 1;
+
+  if (state == eStateVoid) {
+    cellsUpdate.state[idx] = eStateWet;
+    wetAt[p] = t;
+    // wet cells count their drug concentration
+    *pMass += cells.concentration[eStateDrug][idx];
+    return;
+  }
+  // drug or excipient: dissolve through the steps left, as continueDissolve()
+  const u8 species = state;
+  const u32 n = min((u32)dissSteps[p], stepMultiple - t);
+  dissCount[p] = n;
+  if (n > 0) {
+    cellsUpdate.concentration[species][idx] = cells.concentration[species][idx] + n * dissInc[p];
+  }
+  cellsUpdate.state[idx] = (state == eStateDrug) ? eStateDissDrug : eStateDissEx;
+  if (dissCount[p] >= dissSteps[p]) {
+    cellsUpdate.state[idx] = eStateWet;
+    wetAt[p] = t + n;
+    // dissolving drug counts as a whole cell
+    *pMass += cellsUpdate.concentration[eStateDrug][idx] - ((state == eStateDrug) ? 1.0 : 0.0);
+  }
+}
+
+template<class S> f64 CellModel::spreadProb(const u32 p, const u32 t0) {
+  const u32 idx = cellsToProcess[p];
+  const u8 state = cells.state[idx];
+  u32 nIdx[S::size];
+  neighbors<S>(idx, nIdx);
+  u8 nw = 0;
+  calc_t sumC = 0.0;
+  for(u8 i=0; i<S::size; i++) {
+    // face neighbors only, as in dissolve()
+    if (!((S::faceLowBits() >> (CLASS_BITS * i)) & 1)) { continue; }
+    const u32 n = nIdx[i];
+    // wet at the start of the step, or by step t0 of it
+    bool wet = (cells.state[n] == eStateWet);
+    const CellBuffer* buf = &cells;
+    if (!wet && (cellsUpdate.state[n] == eStateWet)) {
+      const u32 q = findSlot(n);
+      wet = (q < numCellsToProcess) && (wetAt[q] <= t0);
+      buf = &cellsUpdate;
+    }
+    if (wet) {
+      nw++;
+      if (state <= eStateEx) {
+        sumC += buf->concentration[state][n];
+      }
+    } else if (cells.state[n] == eStateBound) {
+      nw++;
+    }
+  }
+  return (nw > 0) ? (1 - (sumC / (f64)nw)) * dissProb[p] : 0.0;
+}
+
+template<class S> void CellModel::spreadFront(void) {
+  // newly wet cells, earliest first (then by slot)
+  typedef std::pair<u32, u32> wet_t;
+  priority_queue<wet_t, vector<wet_t>, greater<wet_t> > wet;
+  for(u32 t=0; t<threads->numThreads; t++) {
+    for(u32 w=0; w<wakeList[t].size(); w++) {
+      wet.push(wet_t(wetAt[wakeList[t][w]], wakeList[t][w]));
+    }
+    wakeList[t].clear();
+  }
+
+  u32 nAdd = 0;
+  f64 dMass = 0.0;
+  u32 nIdx[S::size];
+  while (!wet.empty()) {
+    const u32 t0 = wet.top().first;
+    const u32 p = wet.top().second;
+    wet.pop();
+    spreadRows.push_back(p);
+    // wake its neighbors; the dry ones the update didn't reach get the
+    // chances of the steps left
+    neighbors<S>(cellsToProcess[p], nIdx);
+    for(u8 i=0; i<S::size; i++) {
+      const u32 q = findSlot(nIdx[i]);
+      if ((q >= numCellsToProcess) || inFrontier[q]) { continue; }
+      inFrontier[q] = 1;
+      frontierAdd[nAdd++] = q;
+      const u32 idx = nIdx[i];
+      const u8 state = cells.state[idx];
+      if (state == eStateBound) {
+        spreadRows.push_back(q);
+        continue;
+      }
+      if ((t0 >= stepMultiple) || ((state > eStateEx) && (state != eStateVoid))) { continue; }
+      cellsUpdate.state[idx] = state;
+      cellsUpdate.concentration[0][idx] = cells.concentration[0][idx];
+      cellsUpdate.concentration[1][idx] = cells.concentration[1][idx];
+      dissolveFrom(q, spreadProb<S>(q, t0), t0, &dMass);
+      if (cellsUpdate.state[idx] == eStateWet) {
+        wet.push(wet_t(wetAt[q], q));
+      }
+    }
+  }
+  numSpreadAdd = nAdd;
+  spreadMass = dMass;
+}
+
+f64 CellModel::implicitIterations(void) {
+  return implicitSolves ? ((f64)implicitIters / (f64)implicitSolves) : 0.0;
+}
+
+template void CellModel::solveImplicit<Stencil6>(const u32 thr, const u32 numThr);
+template void CellModel::solveImplicit<Stencil26>(const u32 thr, const u32 numThr);
+template void CellModel::spreadFront<Stencil6>(void);
+template void CellModel::spreadFront<Stencil26>(void);
@@ -0,0 +1,101 @@
+/*
+ *  Profile.cpp
+ *  celldiff
+ *
+ *  per-phase timing report
+ */
+
+#include <ctime>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include "Profile.hpp"
+
+using namespace std;
+
+static const char* phaseNames[eNumProfilePhases] = {
+  "distribute", "compress", "findCellsToProcess",
+  "update", "solve", "commit", "mass", "halo", "output", "draw"
+};
+
+Profile::Profile(void) {
+  for(u32 p=0; p<eNumProfilePhases; p++) {
+    current[p] = 0.0;
+  }
+  start = now();
+  iterationStart = -1.0;
+}
+
+f64 Profile::now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+void Profile::endIteration(void) {
+  const f64 t = now();
+  // the first iteration closes the setup phases
+  if (iterationStart < 0.0) {
+    for(u32 p=0; p<PROFILE_SETUP_PHASES; p++) {
+      setup[p] = current[p];
+      current[p] = 0.0;
+    }
+    for(u32 p=PROFILE_SETUP_PHASES; p<eNumProfilePhases; p++) {
+      samples[p].reserve(1 << 16);
+    }
+    iterations.reserve(1 << 16);
+  } else {
+    iterations.push_back(t - iterationStart);
+    for(u32 p=PROFILE_SETUP_PHASES; p<eNumProfilePhases; p++) {
+      samples[p].push_back(current[p]);
+    }
+  }
+  for(u32 p=PROFILE_SETUP_PHASES; p<eNumProfilePhases; p++) {
+    current[p] = 0.0;
+  }
+  iterationStart = t;
+}
+
+// nearest-rank percentile of sorted samples
+static f64 percentile(const vector<f64>& v, const f64 q) {
+  if (v.empty()) { return 0.0; }
+  const u32 i = (u32)(q * (f64)(v.size() - 1) + 0.5);
+  return v[i];
+}
+
+static void report_line(FILE* f, const char* name, vector<f64>& v, const f64 wall) {
+  f64 total = 0.0;
+  for(u32 i=0; i<v.size(); i++) {
+    total += v[i];
+  }
+  sort(v.begin(), v.end());
+  fprintf(f, "  %-20s %10.3f %6.1f%% %10.2f %10.2f %10.2f %10.2f\n", name, total,
+          (wall > 0.0) ? 100.0 * total / wall : 0.0,
+          percentile(v, 0.5) * 1e6, percentile(v, 0.9) * 1e6, percentile(v, 0.99) * 1e6,
+          v.empty() ? 0.0 : v.back() * 1e6);
+}
+
+void Profile::report(FILE* f) {
+  const f64 wall = now() - start;
+  if (iterationStart < 0.0) {
+    // no iterations ran: everything so far was setup
+    for(u32 p=0; p<PROFILE_SETUP_PHASES; p++) {
+      setup[p] = current[p];
+    }
+  }
+  fprintf(f, "\nprofile: %.3f s wall, %d iterations\n", wall, (int)iterations.size());
+  fprintf(f, "  %-20s %10s %7s\n", "setup", "s", "wall");
+  for(u32 p=0; p<PROFILE_SETUP_PHASES; p++) {
+    fprintf(f, "  %-20s %10.3f %6.1f%%\n", phaseNames[p], setup[p], (wall > 0.0) ? 100.0 * setup[p] / wall : 0.0);
+  }
+  fprintf(f, "  %-20s %10s %7s %10s %10s %10s %10s\n", "per iteration", "s", "wall", "p50 us", "p90 us", "p99 us", "max us");
+  for(u32 p=PROFILE_SETUP_PHASES; p<eNumProfilePhases; p++) {
+    report_line(f, phaseNames[p], samples[p], wall);
+  }
+  report_line(f, "iteration", iterations, wall);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  // ru_maxrss is in kilobytes on linux
+  fprintf(f, "  peak RSS %.1f MB\n", (f64)ru.ru_maxrss / 1024.0);
+}
@@ -0,0 +1,57 @@
+/*
+ *  Profile.hpp
+ *  celldiff
+ *
+ *  optional per-phase timing (--profile). code that is timed holds a
+ *  Profile pointer that is NULL when profiling is off, so the only cost
+ *  then is a test of that pointer around each phase.
+ */
+
+#ifndef _CELLDIFF_PROFILE_H_
+#define _CELLDIFF_PROFILE_H_
+
+#include <cstdio>
+#include <vector>
+#include "types.h"
+
+enum eProfilePhase {
+  // setup
+  eProfDistribute,
+  eProfCompress,
+  eProfFindCells,
+  // model iteration
+  eProfUpdate,
+  eProfSolve,
+  eProfCommit,
+  eProfMass,
+  eProfHalo,
+  // main loop
+  eProfOutput,
+  eProfDraw,
+  eNumProfilePhases
+};
+// phases before the first iteration
+#define PROFILE_SETUP_PHASES 3
+
+class Profile {
+public:
+  Profile(void);
+  // monotonic time in seconds
+  static f64 now(void);
+  // add time spent in a phase (to the current iteration, for iteration phases)
+  void add(const eProfilePhase phase, const f64 seconds) { current[phase] += seconds; }
+  // an iteration is over: keep its phase times as one sample each
+  void endIteration(void);
+  // totals, per-iteration percentiles and peak memory
+  void report(FILE* f);
+private:
+  f64 start;
+  f64 setup[PROFILE_SETUP_PHASES];
+  f64 current[eNumProfilePhases];
+  f64 iterationStart;
+  // per iteration: time in each phase, and wall time of the whole iteration
+  std::vector<f64> samples[eNumProfilePhases];
+  std::vector<f64> iterations;
+};
+
+#endif // header guard
@@ -0,0 +1,76 @@
+/*
+ *  Random.hpp
+ *  celldiff
+ *
+ *  counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+ *  each value is a pure function of (seed, stream, counter, index),
+ *  so draws don't depend on thread count or on the order cells are visited.
+ */
+
+#ifndef _CELLDIFF_RANDOM_H_
+#define _CELLDIFF_RANDOM_H_
+
+#include <stdint.h>
+#include "types.h"
+
+// independent streams for each consumer of random numbers
+enum eRandStream {
+  eRandDistribute = 0,
+  eRandCompress   = 1,
+  eRandDissolve   = 2
+};
+
+namespace Random {
+
+  static const uint32_t kMul0 = 0xD2511F53;
+  static const uint32_t kMul1 = 0xCD9E8D57;
+  static const uint32_t kWeyl0 = 0x9E3779B9;
+  static const uint32_t kWeyl1 = 0xBB67AE85;
+
+  inline void philoxRound(uint32_t* ctr, const uint32_t* key) {
+    const uint64_t p0 = (uint64_t)kMul0 * ctr[0];
+    const uint64_t p1 = (uint64_t)kMul1 * ctr[2];
+    const uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0];
+    const uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1];
+    ctr[0] = c0;
+    ctr[1] = (uint32_t)p1;
+    ctr[2] = c2;
+    ctr[3] = (uint32_t)p0;
+  }
+
+  // 10-round philox: 128-bit counter, 64-bit key
+  inline void philox(uint32_t* ctr, uint32_t k0, uint32_t k1) {
+    uint32_t key[2] = { k0, k1 };
+    for(u8 r=0; r<10; r++) {
+      philoxRound(ctr, key);
+      key[0] += kWeyl0;
+      key[1] += kWeyl1;
+    }
+  }
+
+  // 64 random bits
+  inline uint64_t bits(const uint32_t seed, const uint32_t stream,
+                       const uint64_t counter, const uint64_t index) {
+    uint32_t ctr[4] = {
+      (uint32_t)index, (uint32_t)(index >> 32),
+      (uint32_t)counter, (uint32_t)(counter >> 32)
+    };
+    philox(ctr, seed, stream);
+    return ((uint64_t)ctr[0] << 32) | ctr[1];
+  }
+
+  // uniform in [0, 1) with 53 bits of precision
+  inline f64 uniform(const uint32_t seed, const uint32_t stream,
+                     const uint64_t counter, const uint64_t index) {
+    return (f64)(bits(seed, stream, counter, index) >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // uniform integer in [0, n)
+  inline uint64_t below(const uint64_t n, const uint32_t seed, const uint32_t stream,
+                        const uint64_t counter, const uint64_t index) {
+    return (uint64_t)(uniform(seed, stream, counter, index) * (f64)n);
+  }
+
+} // namespace Random
+
+#endif // header guard
@@ -0,0 +1,162 @@
+/*
+ *  Slab.cpp
+ *  celldiff
+ *
+ *  shared memory transport for slab processes
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "Slab.hpp"
+
+// offsets in the shared object are kept to whole cache lines
+static u64 align64(const u64 n) {
+  return (n + 63) & ~((u64)63);
+}
+
+ShmTransport::ShmTransport(const u32 n, const u64 planebytes) :
+planeBytes(planebytes),
+size(0),
+base(NULL),
+barrier(NULL),
+sums(NULL),
+planes(NULL),
+numExchanges(0),
+numSums(0)
+{
+  numSlabs = (n > 0) ? n : 1;
+  slab = 0;
+}
+
+ShmTransport::~ShmTransport(void) {
+  if (base == NULL) { return; }
+  if ((slab == 0) && children.empty()) {
+    pthread_barrier_destroy(barrier);
+  }
+  munmap(base, size);
+}
+
+int ShmTransport::open(void) {
+  const u64 sumsOffset = align64(sizeof(pthread_barrier_t));
+  const u64 planesOffset = sumsOffset + align64(2 * numSlabs * sizeof(f64));
+  size = planesOffset + 2 * 2 * numSlabs * align64(planeBytes);
+
+  // the object only needs a name until it is mapped: forked processes
+  // inherit the mapping. (unrelated processes would shm_open the name instead)
+  char name[64];
+  snprintf(name, sizeof(name), "/celldiff-%d", (int)getpid());
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) { return -1; }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  shm_unlink(name);
+  if (p == MAP_FAILED) { return -1; }
+  base = (u8*)p;
+  barrier = (pthread_barrier_t*)base;
+  sums = (f64*)(base + sumsOffset);
+  planes = base + planesOffset;
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  const int err = pthread_barrier_init(barrier, &attr, numSlabs);
+  pthread_barrierattr_destroy(&attr);
+  return err ? -1 : 0;
+}
+
+int ShmTransport::spawn(void) {
+  // nothing buffered may be written twice
+  fflush(stdout);
+  fflush(stderr);
+  for(u32 s=1; s<numSlabs; s++) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      // the ones started would wait for the rest forever
+      for(u32 c=0; c<children.size(); c++) {
+        kill(children[c], SIGKILL);
+        waitpid(children[c], NULL, 0);
+      }
+      children.clear();
+      return -1;
+    }
+    if (pid == 0) {
+      slab = s;
+      children.clear();
+      pin();
+      return 0;
+    }
+    children.push_back(pid);
+  }
+  pin();
+  return 0;
+}
+
+// keep this process on its share of the CPUs it may run on: slab s gets the
+// s-th of numSlabs runs of consecutive CPUs, which on most machines lie on one
+// NUMA node. (nothing to do with fewer CPUs than slabs)
+void ShmTransport::pin(void) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { return; }
+  std::vector<int> cpus;
+  for(int c=0; c<CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed)) { cpus.push_back(c); }
+  }
+  if (cpus.size() < numSlabs) { return; }
+  cpu_set_t mine;
+  CPU_ZERO(&mine);
+  const u32 c0 = (u32)((u64)cpus.size() * slab / numSlabs);
+  const u32 c1 = (u32)((u64)cpus.size() * (slab + 1) / numSlabs);
+  for(u32 c=c0; c<c1; c++) {
+    CPU_SET(cpus[c], &mine);
+  }
+  sched_setaffinity(0, sizeof(mine), &mine);
+}
+
+int ShmTransport::join(void) {
+  int err = 0;
+  for(u32 c=0; c<children.size(); c++) {
+    int status = 0;
+    if ((waitpid(children[c], &status, 0) != children[c]) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      err = -1;
+    }
+  }
+  children.clear();
+  return err;
+}
+
+u8* ShmTransport::plane(const u32 set, const u32 s, const u32 side) {
+  return planes + (((u64)set * numSlabs + s) * 2 + side) * align64(planeBytes);
+}
+
+void ShmTransport::exchange(const u8* lo, const u8* hi, u8* below, u8* above) {
+  const u32 set = numExchanges & 1;
+  numExchanges++;
+  if (lo != NULL) { memcpy(plane(set, slab, 0), lo, planeBytes); }
+  if (hi != NULL) { memcpy(plane(set, slab, 1), hi, planeBytes); }
+  pthread_barrier_wait(barrier);
+  if (below != NULL) { memcpy(below, plane(set, slab - 1, 1), planeBytes); }
+  if (above != NULL) { memcpy(above, plane(set, slab + 1, 0), planeBytes); }
+}
+
+f64 ShmTransport::sum(const f64 v) {
+  f64* const s = sums + (numSums & 1) * numSlabs;
+  numSums++;
+  s[slab] = v;
+  pthread_barrier_wait(barrier);
+  f64 total = 0.0;
+  for(u32 i=0; i<numSlabs; i++) {
+    total += s[i];
+  }
+  return total;
+}
@@ -0,0 +1,70 @@
+/*
+ *  Slab.hpp
+ *  celldiff
+ *
+ *  slab decomposition: the cube is split along z into slabs, each owned by
+ *  one process. after every step a slab sends its first and last planes of
+ *  cells to the slabs below and above it, and the slabs add up their drug
+ *  mass. SlabTransport is what moves them; ShmTransport does it through a
+ *  POSIX shared memory object between processes forked from one parent,
+ *  and other backends (MPI) can sit next to it.
+ */
+
+#ifndef _CELLDIFF_SLAB_H_
+#define _CELLDIFF_SLAB_H_
+
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+#include "types.h"
+
+class SlabTransport {
+public:
+  SlabTransport(void) : slab(0), numSlabs(1) {}
+  virtual ~SlabTransport(void) {}
+  // send this slab's first plane down and its last plane up, and receive
+  // the planes next to it from the slabs below and above.
+  // (NULL where there is no slab; planes are of the size the transport was made for)
+  virtual void exchange(const u8* lo, const u8* hi, u8* below, u8* above) = 0;
+  // sum of one value per slab, added in slab order, so every slab gets the same sum
+  virtual f64 sum(const f64 v) = 0;
+public:
+  // this process's slab, and the count of slabs
+  u32 slab;
+  u32 numSlabs;
+};
+
+class ShmTransport : public SlabTransport {
+public:
+  ShmTransport(const u32 n, const u64 planebytes);
+  ~ShmTransport(void);
+  // create and map the shared memory object; -1 on failure
+  int open(void);
+  // fork a process for each other slab; every process returns with its
+  // slab set (the caller keeps slab 0) and pinned to its share of the CPUs.
+  // -1 on failure
+  int spawn(void);
+  // slab 0: wait for the other processes; -1 if any of them failed
+  int join(void);
+  void exchange(const u8* lo, const u8* hi, u8* below, u8* above);
+  f64 sum(const f64 v);
+private:
+  // restrict this process to its slab's share of the allowed CPUs
+  void pin(void);
+  // plane sent by a slab (side 0 down, 1 up), in one of two sets
+  u8* plane(const u32 set, const u32 s, const u32 side);
+  u64 planeBytes;
+  u64 size;
+  u8* base;
+  // in the shared object: barrier, two sets of per-slab sums, two sets of planes
+  pthread_barrier_t* barrier;
+  f64* sums;
+  u8* planes;
+  // calls so far; each call uses the other set than the one before, so a
+  // slab never overwrites what a slow neighbor is still reading
+  u64 numExchanges;
+  u64 numSums;
+  std::vector<pid_t> children;
+};
+
+#endif // header guard
@@ -0,0 +1,135 @@
+/*
+ *  Snapshot.cpp
+ *  celldiff
+ *
+ *  writing and mapping full-state snapshots (see Snapshot.hpp for the layout)
+ */
+
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Snapshot.hpp"
+#include "CellModel.hpp"
+
+static u64 align_up(const u64 n) {
+  return (n + SNAPSHOT_ALIGN - 1) & ~((u64)SNAPSHOT_ALIGN - 1);
+}
+
+void snapshot_header(SnapshotHeader* hdr, const CellModel* model, const f64 time, const f64 released) {
+  memset(hdr, 0, sizeof(SnapshotHeader));
+  memcpy(hdr->magic, SNAPSHOT_MAGIC, 8);
+  hdr->version = SNAPSHOT_VERSION;
+  hdr->headerSize = sizeof(SnapshotHeader);
+  hdr->cubeLength = model->cubeLength;
+  // planes are always written in linear order, without layout padding
+  hdr->numCells = (u64)model->cubeLength * model->cubeLength * model->cubeLength;
+  hdr->iteration = model->iterationNum;
+  hdr->time = time;
+  hdr->cellLength = model->cellLength;
+  hdr->pDrug = model->pDrug;
+  hdr->pPoly = model->pPoly;
+  hdr->dDrugStep = model->dDrug;
+  hdr->dExStep = model->dEx;
+  hdr->boundDiff = model->boundDiff;
+  hdr->dissProbDrug = model->dissProbDrug;
+  hdr->dissProbEx = model->dissProbEx;
+  hdr->seed = model->rngSeed;
+  hdr->compress = model->compressFlag;
+  hdr->released = released;
+  hdr->drugMassTotal = model->drugMassTotal;
+
+  const u64 stateBytes = align_up(hdr->numCells * sizeof(u8));
+  const u64 concBytes = align_up(hdr->numCells * sizeof(f64));
+  hdr->stateOffset = SNAPSHOT_ALIGN;
+  hdr->concentrationOffset[0] = hdr->stateOffset + stateBytes;
+  hdr->concentrationOffset[1] = hdr->concentrationOffset[0] + concBytes;
+  hdr->frameSize = hdr->concentrationOffset[1] + concBytes;
+}
+
+void snapshot_pack(u8* dst, const SnapshotHeader* hdr, CellModel* model) {
+  const u64 n = hdr->numCells;
+  memset(dst, 0, hdr->stateOffset);
+  memcpy(dst, hdr, sizeof(SnapshotHeader));
+  model->copyLinear(dst + hdr->stateOffset, (f64*)(dst + hdr->concentrationOffset[0]),
+                    (f64*)(dst + hdr->concentrationOffset[1]));
+  memset(dst + hdr->stateOffset + n, 0, hdr->concentrationOffset[0] - hdr->stateOffset - n);
+  for(u8 s=0; s<2; s++) {
+    const u64 end = (s == 0) ? hdr->concentrationOffset[1] : hdr->frameSize;
+    memset(dst + hdr->concentrationOffset[s] + (n * sizeof(f64)), 0,
+           end - hdr->concentrationOffset[s] - (n * sizeof(f64)));
+  }
+}
+
+int snapshot_write_text(FILE* f, const u64 numCells, const u8* state, const f64* const* concentration) {
+  for(u64 cell = 0; cell<numCells; cell++) {
+    fprintf(f, "\n%i", state[cell]);
+    fprintf(f, "\t%f", concentration[0][cell]);
+    fprintf(f, "\t%f", concentration[1][cell]);
+  }
+  return ferror(f) ? -1 : 0;
+}
+
+int snapshot_map(const char* path, SnapshotFile* file) {
+  struct stat st;
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) { return -1; }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  file->size = st.st_size;
+  void* p = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) { return -1; }
+  file->data = (const u8*)p;
+  return 0;
+}
+
+void snapshot_unmap(SnapshotFile* file) {
+  munmap((void*)file->data, file->size);
+  file->data = NULL;
+  file->size = 0;
+}
+
+int snapshot_frame(const SnapshotFile* file, const u64 k, SnapshotFrame* frame) {
+  u64 offset = 0;
+  for(u64 i=0; ; i++) {
+    if (offset + sizeof(SnapshotHeader) > file->size) { return -1; }
+    const SnapshotHeader* hdr = (const SnapshotHeader*)(file->data + offset);
+    if ((memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) != 0) || (hdr->version != SNAPSHOT_VERSION)) { return -1; }
+    if (offset + hdr->frameSize > file->size) { return -1; }
+    if (i == k) {
+      frame->header = hdr;
+      frame->state = file->data + offset + hdr->stateOffset;
+      frame->concentration[0] = (const f64*)(file->data + offset + hdr->concentrationOffset[0]);
+      frame->concentration[1] = (const f64*)(file->data + offset + hdr->concentrationOffset[1]);
+      return 0;
+    }
+    offset += hdr->frameSize;
+  }
+}
+
+s64 snapshot_check(const SnapshotFile* file, const u64 k, const SnapshotHeader* hdr, CellModel* model) {
+  SnapshotFrame frame;
+  if (snapshot_frame(file, k, &frame)) { return -1; }
+  if ((frame.header->numCells != hdr->numCells) || (frame.header->iteration != hdr->iteration) ||
+      (frame.header->frameSize != hdr->frameSize)) { return -1; }
+  // the frame is in linear order, whatever the model's layout
+  const u64 n = hdr->numCells;
+  std::vector<u8> state(n);
+  std::vector<f64> drug(n), ex(n);
+  model->copyLinear(&state[0], &drug[0], &ex[0]);
+  s64 bad = 0;
+  for(u64 cell=0; cell<n; cell++) {
+    if ((frame.state[cell] != state[cell]) ||
+        (frame.concentration[0][cell] != drug[cell]) ||
+        (frame.concentration[1][cell] != ex[cell])) {
+      bad++;
+    }
+  }
+  return bad;
+}
@@ -0,0 +1,98 @@
+/*
+ *  Snapshot.hpp
+ *  celldiff
+ *
+ *  full-state snapshots of the model.
+ *
+ *  binary format (native byte order): a file is a sequence of frames.
+ *  each frame is a page-sized header followed by raw planes, each plane
+ *  starting on a page boundary so a mapped file can be read in place:
+ *    state           : numCells x u8 (eCellState)
+ *    drug conc.      : numCells x f64
+ *    excipient conc. : numCells x f64
+ *  planes hold the cubeLength^3 cells in linear order (x fastest, then y,
+ *  then z) whatever the model's grid layout.
+ *  offsets in the header are relative to the start of the frame, and
+ *  frameSize gives the offset of the next frame.
+ *
+ *  the old tab-separated text format is still available.
+ */
+
+#ifndef _CELLDIFF_SNAPSHOT_H_
+#define _CELLDIFF_SNAPSHOT_H_
+
+#include <cstdio>
+#include <stdint.h>
+#include "types.h"
+
+class CellModel;
+
+#define SNAPSHOT_MAGIC "CELLSNAP"
+#define SNAPSHOT_VERSION 1
+// alignment of the header and of every plane
+#define SNAPSHOT_ALIGN 4096
+
+struct SnapshotHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  headerSize;
+  uint64_t  frameSize;
+  // dimensions
+  uint64_t  cubeLength;
+  uint64_t  numCells;
+  // time
+  uint64_t  iteration;
+  f64       time;
+  // parameters
+  f64       cellLength;
+  f64       pDrug;
+  f64       pPoly;
+  // per-step diffusion coefficients as the model applies them
+  // (rate * dt / cellLength^2), not the physical rates
+  f64       dDrugStep;
+  f64       dExStep;
+  f64       boundDiff;
+  f64       dissProbDrug;
+  f64       dissProbEx;
+  uint32_t  seed;
+  uint32_t  compress;
+  // released drug mass and its reference total
+  f64       released;
+  f64       drugMassTotal;
+  // plane offsets from the start of the frame
+  uint64_t  stateOffset;
+  uint64_t  concentrationOffset[2];
+};
+
+// a frame of a mapped snapshot file
+struct SnapshotFrame {
+  const SnapshotHeader* header;
+  const u8* state;
+  const f64* concentration[2];
+};
+
+// a mapped snapshot file
+struct SnapshotFile {
+  const u8* data;
+  u64 size;
+};
+
+// fill a frame header for the model's current state
+void snapshot_header(SnapshotHeader* hdr, const CellModel* model, const f64 time, const f64 released);
+// copy one binary frame of the model's current state into memory
+// (hdr->frameSize bytes at dst), in linear order whatever its layout
+void snapshot_pack(u8* dst, const SnapshotHeader* hdr, CellModel* model);
+// write one frame in the text format
+int snapshot_write_text(FILE* f, const u64 numCells, const u8* state, const f64* const* concentration);
+
+// map a binary snapshot file read-only; returns 0 on success
+int snapshot_map(const char* path, SnapshotFile* file);
+void snapshot_unmap(SnapshotFile* file);
+// find the k-th frame of a mapped file; returns 0 on success
+int snapshot_frame(const SnapshotFile* file, const u64 k, SnapshotFrame* frame);
+// compare the k-th frame of a mapped file with a header and the model's current
+// state; returns the number of differing cells, or -1 if the frame is missing
+// or its header differs
+s64 snapshot_check(const SnapshotFile* file, const u64 k, const SnapshotHeader* hdr, CellModel* model);
+
+#endif // header guard
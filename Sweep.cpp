@@ -0,0 +1,381 @@
+/*
+ *  Sweep.cpp
+ *  celldiff
+ *
+ *  celldiff-sweep: run a grid of celldiff parameter sets in one process.
+ *
+ *  the spec file lists one parameter per line, followed by its values:
+ *
+ *    # polymer sweep, three seeds each
+ *    polymerratio  0.1:0.9:0.1
+ *    seed          47 48 49
+ *    diameter      0.016
+ *
+ *  parameters are named like celldiff's long options (or their letters),
+ *  values are numbers or inclusive ranges start:stop:step. every
+ *  combination is a job; the first parameter varies slowest. jobs run on a
+ *  work-stealing queue, largest grids first, one model per thread. each
+ *  job's release curve is the same as celldiff's for those parameters.
+ *
+ *  all curves go to one file: a commented job table, then one data block
+ *  per job in job order, separated by two blank lines (gnuplot's "index").
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "CellModel.hpp"
+#include "Threads.hpp"
+
+using namespace std;
+
+//======= defines
+// the halting rule of celldiff
+#define NO_CHANGE_MASS_THRESH 0.00001
+#define NO_CHANGE_COUNT_THRESH 10
+
+//======= parameters
+enum eSweepParam {
+  eParamDiameter,
+  eParamMaxTime,
+  eParamPolymer,
+  eParamDrug,
+  eParamHeight,
+  eParamCompress,
+  eParamSeed,
+  eParamDissProbDrug,
+  eParamDissProbEx,
+  eParamShellWidth,
+  eParamShellBalance,
+  eParamBoundDiff,
+  eParamDrugDiff,
+  eParamExDiff,
+  eParamCellSize,
+  eParamStencil,
+  eParamSleep,
+  eParamImplicit,
+  eNumParams
+};
+
+// names and option letters as in celldiff, and its defaults
+static const char* paramNames[eNumParams] = {
+  "diameter", "maxtime", "polymerratio", "drugratio", "tabletheight", "compress", "seed",
+  "dissprobdrug", "dissprobex", "polyshellwidth", "polyshellbalance", "boundarydiffusion",
+  "drugdiffusionrate", "exdiffusionrate", "cellsize", "stencil", "sleep", "implicit"
+};
+static const char paramLetters[eNumParams + 1] = "ncpghdeolwbfukyNSI";
+static const f64 paramDefaults[eNumParams] = {
+  0.016, 100.0, 0.4, 0.1, 0.23, 1, 47,
+  1.0, 1.0, 1, 1.0, 0.9,
+  0.000001, 0.000001, 0.001, 6, 0.0, 1
+};
+
+// one swept parameter and its values
+struct SweepAxis {
+  u32 param;
+  vector<f64> values;
+};
+
+// everything the job threads share
+struct Sweep {
+  vector<SweepAxis> axes;
+  u32 numJobs;
+  u8 simd;
+  // finished curves, waiting to be written in job order
+  vector<string> curves;
+  vector<u8> done;
+  u32 numWritten;
+  u32 numDone;
+  FILE* out;
+  pthread_mutex_t lock;
+};
+
+//======= functions
+static int parse_spec(const char* path, vector<SweepAxis>& axes);
+static int parse_values(char* tok, vector<f64>& values);
+static void job_params(const Sweep* sweep, const u32 job, f64* p);
+static u32 job_cells(const f64* p);
+static f64 job_cost(const f64* p);
+static void run_job(void* ctx, const u32 job, const u32 thr);
+static void print_params(FILE* f, const f64* p);
+
+//------ spec parsing
+int parse_spec(const char* path, vector<SweepAxis>& axes) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    printf("error opening sweep spec %s\n", path);
+    return -1;
+  }
+  char line[4096];
+  u32 lineNum = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineNum++;
+    char* hash = strchr(line, '#');
+    if (hash != NULL) { *hash = '\0'; }
+    char* tok = strtok(line, " \t\r\n");
+    if (tok == NULL) { continue; }
+
+    SweepAxis axis;
+    axis.param = eNumParams;
+    for(u32 i=0; i<eNumParams; i++) {
+      if ((strcmp(tok, paramNames[i]) == 0)
+          || ((strlen(tok) == 1) && (tok[0] == paramLetters[i]))) {
+        axis.param = i;
+      }
+    }
+    if (axis.param == eNumParams) {
+      printf("%s:%d: unknown parameter %s\n", path, (int)lineNum, tok);
+      fclose(f);
+      return -1;
+    }
+    while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+      if (parse_values(tok, axis.values)) {
+        printf("%s:%d: bad value %s\n", path, (int)lineNum, tok);
+        fclose(f);
+        return -1;
+      }
+    }
+    if (axis.values.empty()) {
+      printf("%s:%d: no values for %s\n", path, (int)lineNum, paramNames[axis.param]);
+      fclose(f);
+      return -1;
+    }
+    // a parameter given twice: the later line wins
+    for(u32 a=0; a<axes.size(); a++) {
+      if (axes[a].param == axis.param) {
+        axes.erase(axes.begin() + a);
+        break;
+      }
+    }
+    axes.push_back(axis);
+  }
+  fclose(f);
+  return 0;
+}
+
+// a number, or an inclusive range start:stop:step
+int parse_values(char* tok, vector<f64>& values) {
+  char* end;
+  const f64 start = strtod(tok, &end);
+  if (end == tok) { return -1; }
+  if (*end == '\0') {
+    values.push_back(start);
+    return 0;
+  }
+  if (*end != ':') { return -1; }
+  char* s = end + 1;
+  const f64 stop = strtod(s, &end);
+  if ((end == s) || (*end != ':')) { return -1; }
+  s = end + 1;
+  const f64 step = strtod(s, &end);
+  if ((end == s) || (*end != '\0') || !(step > 0.0) || (stop < start)) { return -1; }
+  // count the steps up front so the values don't pick up summation error
+  const u32 count = (u32)((stop - start) / step + 1e-9) + 1;
+  for(u32 i=0; i<count; i++) {
+    values.push_back(start + step * (f64)i);
+  }
+  return 0;
+}
+
+//------ jobs
+// parameters of a job: the first axis varies slowest
+void job_params(const Sweep* sweep, const u32 job, f64* p) {
+  for(u32 i=0; i<eNumParams; i++) {
+    p[i] = paramDefaults[i];
+  }
+  u32 rest = job;
+  for(u32 a=(u32)sweep->axes.size(); a>0; a--) {
+    const SweepAxis& axis = sweep->axes[a - 1];
+    p[axis.param] = axis.values[rest % axis.values.size()];
+    rest /= axis.values.size();
+  }
+}
+
+// cube width, worked out from the diameter exactly as celldiff does
+u32 job_cells(const f64* p) {
+  const f32 diameter = (f32)p[eParamDiameter];
+  return (u32)((diameter / p[eParamCellSize]) + 0.5);
+}
+
+// rough work of a job: cells times iterations times neighbors
+f64 job_cost(const f64* p) {
+  const f64 n = (f64)job_cells(p);
+  const f64 maxDiff = max(p[eParamDrugDiff], p[eParamExDiff]);
+  const f64 dt = p[eParamCellSize] * p[eParamCellSize] / maxDiff * TIME_STEP_SCALE;
+  const f64 neighbors = ((u32)p[eParamStencil] == eStencil26) ? 26.0 : 6.0;
+  // an implicit step of K steps takes roughly sqrt(K) solver sweeps
+  const f64 k = max(p[eParamImplicit], 1.0);
+  return n * n * n * (p[eParamMaxTime] / (dt * k)) * neighbors * sqrt(k);
+}
+
+void print_params(FILE* f, const f64* p) {
+  for(u32 i=0; i<eNumParams; i++) {
+    fprintf(f, "\t%g", p[i]);
+  }
+}
+
+// run one job to its halt and queue its release curve for the output
+void run_job(void* ctx, const u32 job, const u32 thr) {
+  Sweep* sweep = (Sweep*)ctx;
+  f64 p[eNumParams];
+  job_params(sweep, job, p);
+
+  CellModel model(job_cells(p), p[eParamHeight], p[eParamDrug], p[eParamPolymer], p[eParamCellSize],
+                  p[eParamDrugDiff], p[eParamExDiff], (u32)p[eParamSeed],
+                  p[eParamDissProbDrug], p[eParamDissProbEx],
+                  (u32)p[eParamShellWidth], p[eParamShellBalance], p[eParamBoundDiff],
+                  1.0, (u8)p[eParamCompress], 1, sweep->simd, eLayoutLinear, (u8)p[eParamStencil],
+                  p[eParamSleep], (u32)p[eParamImplicit]);
+  model.setup();
+
+  // same loop and halting rule as celldiff
+  const u32 iterationCount = (u32)(p[eParamMaxTime] / model.dt);
+  string curve = "0.0\t0.0";
+  char line[64];
+  f64 released[2] = {-1000.f, 0.f};
+  u64 noChangeCount = 0;
+  u8 halt = 0;
+  u32 step = 0;
+  while (halt == 0) {
+    step++;
+    if (step == iterationCount) { halt = 1; }
+    released[1] = model.iterate();
+    const f64 dr = released[1] - released[0];
+    released[0] = released[1];
+    if (dr < NO_CHANGE_MASS_THRESH) {
+      if (released[1] > 0.01) {
+        noChangeCount++;
+      }
+    } else {
+      noChangeCount = 0;
+    }
+    if (noChangeCount == NO_CHANGE_COUNT_THRESH) { halt = 1; }
+    snprintf(line, sizeof(line), "\n%f\t%f", model.dt * (float)step, released[1] / model.drugMassTotal);
+    curve += line;
+  }
+
+  // write every curve that is now next in job order
+  pthread_mutex_lock(&(sweep->lock));
+  sweep->curves[job].swap(curve);
+  sweep->done[job] = 1;
+  sweep->numDone++;
+  printf("job %d done (%d of %d), %d iterations, thread %d\n",
+         (int)job, (int)sweep->numDone, (int)sweep->numJobs, (int)step, (int)thr);
+  fflush(stdout);
+  while ((sweep->numWritten < sweep->numJobs) && sweep->done[sweep->numWritten]) {
+    const u32 j = sweep->numWritten;
+    fprintf(sweep->out, "%s# job %d\n%s\n", (j > 0) ? "\n\n" : "", (int)j, sweep->curves[j].c_str());
+    string().swap(sweep->curves[j]);
+    sweep->numWritten++;
+  }
+  pthread_mutex_unlock(&(sweep->lock));
+}
+
+//------ main
+int main(const int argc, char* const* argv) {
+  static struct option long_options[] = {
+    {"releasedfile", required_argument, 0, 'r'},
+    {"threads",      required_argument, 0, 'j'},
+    {"simd",         required_argument, 0, 'm'},
+    {0, 0, 0, 0}
+  };
+
+  // time stuff
+  time_t rawtime;
+  struct tm * ptm;
+  ostringstream timetag;
+  time ( &rawtime );
+  ptm = gmtime ( &rawtime );
+  timetag << ptm->tm_year+1900 << "_" << ptm->tm_mon+1 << "_" << ptm->tm_mday << "_" << ptm->tm_hour << "_" << ptm->tm_min;
+
+  string releasedPath = "sweep_release_" + timetag.str() + ".txt";
+  long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  u8 simd = eSimdAuto;
+  int opt_idx = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:j:m:", long_options, &opt_idx)) != -1) {
+    switch(opt) {
+      case 'r':
+        releasedPath = optarg;
+        break;
+      case 'j':
+        numThreads = atoi(optarg);
+        break;
+      case 'm':
+        simd = atoi(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+  if (optind != argc - 1) {
+    printf("usage: celldiff-sweep [-r releasedfile] [-j threads] [-m simd] specfile\n");
+    return 1;
+  }
+
+  Sweep sweep;
+  if (parse_spec(argv[optind], sweep.axes)) { return 1; }
+  sweep.numJobs = 1;
+  for(u32 a=0; a<sweep.axes.size(); a++) {
+    sweep.numJobs *= sweep.axes[a].values.size();
+  }
+  sweep.simd = simd;
+  sweep.curves.resize(sweep.numJobs);
+  sweep.done.assign(sweep.numJobs, 0);
+  sweep.numWritten = 0;
+  sweep.numDone = 0;
+  pthread_mutex_init(&(sweep.lock), NULL);
+  if (numThreads < 1) { numThreads = 1; }
+  if ((u32)numThreads > sweep.numJobs) { numThreads = sweep.numJobs; }
+
+  sweep.out = fopen(releasedPath.c_str(), "w");
+  if (sweep.out == NULL) {
+    printf("error opening release curve output file, exiting!\n");
+    return 1;
+  }
+
+  // job table, and the order to run in: most work first
+  vector<pair<f64, u32> > costs(sweep.numJobs);
+  f64 p[eNumParams];
+  fprintf(sweep.out, "# celldiff sweep of %s: %d jobs\n# job", argv[optind], (int)sweep.numJobs);
+  for(u32 i=0; i<eNumParams; i++) {
+    fprintf(sweep.out, "\t%s", paramNames[i]);
+  }
+  fprintf(sweep.out, "\n");
+  for(u32 j=0; j<sweep.numJobs; j++) {
+    job_params(&sweep, j, p);
+    fprintf(sweep.out, "# %d", (int)j);
+    print_params(sweep.out, p);
+    fprintf(sweep.out, "\n");
+    costs[j] = make_pair(-job_cost(p), j);
+  }
+  sort(costs.begin(), costs.end());
+  vector<u32> order(sweep.numJobs);
+  for(u32 j=0; j<sweep.numJobs; j++) {
+    order[j] = costs[j].second;
+  }
+
+  printf("running %d jobs on %d threads\n", (int)sweep.numJobs, (int)numThreads);
+  JobQueue queue((u32)numThreads);
+  queue.run(&(order[0]), sweep.numJobs, &run_job, &sweep);
+
+  pthread_mutex_destroy(&(sweep.lock));
+  if (fclose(sweep.out) != 0) {
+    printf("error writing output file!\n");
+    return 1;
+  }
+  printf("release curves written to %s\n", releasedPath.c_str());
+  return 0;
+}
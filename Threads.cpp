@@ -1,22 +1,190 @@
-// create N number of threads
-void init_threads() {
-  // calculation counter lock
-  // calculation-finished condition
-  // copy-finished condition
+/*
+ *  Threads.cpp
+ *  celldiff
+ *
+ *  persistent worker threads for the iteration engine
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include "Threads.hpp"
+
+// create N-1 worker threads (the caller is thread 0)
+ThreadPool::ThreadPool(u32 n) :
+numThreads(n > 0 ? n : 1),
+threads(NULL),
+args(NULL),
+work(NULL),
+ctx(NULL),
+quit(0)
+{
+  if (numThreads == 1) { return; }
+  pthread_barrier_init(&startBarrier, NULL, numThreads);
+  pthread_barrier_init(&phaseBarrier, NULL, numThreads);
+  pthread_barrier_init(&doneBarrier, NULL, numThreads);
+  threads = new pthread_t [numThreads];
+  args = new ThreadArg [numThreads];
+  for(u32 t=1; t<numThreads; t++) {
+    args[t].pool = this;
+    args[t].thr = t;
+    if (pthread_create(&(threads[t]), NULL, &ThreadPool::calculate_thr, &(args[t])) != 0) {
+      printf("error creating worker thread, exiting!\n");
+      exit(1);
+    }
+  }
 }
 
-// copy thread:
-void * copy_thr() {
-  // wait until calculations are complete (counter is at max)
-  // copy data
-  // wake up calculation threads
+ThreadPool::~ThreadPool() {
+  if (numThreads == 1) { return; }
+  // wake the workers with nothing to do but exit
+  quit = 1;
+  pthread_barrier_wait(&startBarrier);
+  for(u32 t=1; t<numThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_barrier_destroy(&startBarrier);
+  pthread_barrier_destroy(&phaseBarrier);
+  pthread_barrier_destroy(&doneBarrier);
+  delete[] threads;
+  delete[] args;
 }
 
+void ThreadPool::run(thread_work_t w, void* c) {
+  if (numThreads == 1) {
+    w(c, 0, 1);
+    return;
+  }
+  work = w;
+  ctx = c;
+  pthread_barrier_wait(&startBarrier);
+  work(ctx, 0, numThreads);
+  pthread_barrier_wait(&doneBarrier);
+}
+
+void ThreadPool::sync(void) {
+  if (numThreads == 1) { return; }
+  pthread_barrier_wait(&phaseBarrier);
+}
+
+void ThreadPool::range(const u32 n, const u32 thr, const u32 numThr, u32* pBegin, u32* pEnd) {
+  *pBegin = (u32)(((u64)n * thr) / numThr);
+  *pEnd = (u32)(((u64)n * (thr + 1)) / numThr);
+}
 
 // calculate thread:
-void * calculate_thr() {
+void* ThreadPool::calculate_thr(void* arg) {
+  ThreadArg* a = (ThreadArg*)arg;
+  ThreadPool* pool = a->pool;
   for (;;) {
     // wait on ready-to-compute condition
-    // acquire, increment computation counter
+    pthread_barrier_wait(&(pool->startBarrier));
+    if (pool->quit) { break; }
+    pool->work(pool->ctx, a->thr, pool->numThreads);
+    // report finished
+    pthread_barrier_wait(&(pool->doneBarrier));
+  }
+  return NULL;
+}
+
+//------ job queue
+
+JobQueue::JobQueue(u32 n) :
+numThreads(n > 0 ? n : 1),
+work(NULL),
+ctx(NULL)
+{
+  deques = new Deque [numThreads];
+  args = new ThreadArg [numThreads];
+  for(u32 t=0; t<numThreads; t++) {
+    deques[t].jobs = NULL;
+    deques[t].head = deques[t].tail = 0;
+    pthread_mutex_init(&(deques[t].lock), NULL);
+    args[t].queue = this;
+    args[t].thr = t;
+  }
+}
+
+JobQueue::~JobQueue() {
+  for(u32 t=0; t<numThreads; t++) {
+    pthread_mutex_destroy(&(deques[t].lock));
+  }
+  delete[] deques;
+  delete[] args;
+}
+
+void JobQueue::run(const u32* order, const u32 numJobs, job_work_t w, void* c) {
+  work = w;
+  ctx = c;
+  // deal the jobs out
+  for(u32 t=0; t<numThreads; t++) {
+    deques[t].jobs = new u32 [numJobs / numThreads + 1];
+    deques[t].head = deques[t].tail = 0;
+  }
+  for(u32 j=0; j<numJobs; j++) {
+    Deque* d = &(deques[j % numThreads]);
+    d->jobs[d->tail++] = order[j];
+  }
+
+  // job threads are only alive for one run; jobs are long
+  pthread_t* threads = new pthread_t [numThreads];
+  for(u32 t=1; t<numThreads; t++) {
+    if (pthread_create(&(threads[t]), NULL, &JobQueue::job_thr, &(args[t])) != 0) {
+      printf("error creating job thread, exiting!\n");
+      exit(1);
+    }
+  }
+  job_thr(&(args[0]));
+  for(u32 t=1; t<numThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  delete[] threads;
+  for(u32 t=0; t<numThreads; t++) {
+    delete[] deques[t].jobs;
+    deques[t].jobs = NULL;
+  }
+}
+
+bool JobQueue::next(const u32 thr, u32* pJob) {
+  Deque* d = &(deques[thr]);
+  pthread_mutex_lock(&(d->lock));
+  if (d->head < d->tail) {
+    *pJob = d->jobs[d->head++];
+    pthread_mutex_unlock(&(d->lock));
+    return true;
+  }
+  pthread_mutex_unlock(&(d->lock));
+
+  // steal: deques only shrink, so a thief that finds them all empty is done
+  for (;;) {
+    u32 victim = numThreads;
+    u32 most = 0;
+    for(u32 t=0; t<numThreads; t++) {
+      pthread_mutex_lock(&(deques[t].lock));
+      const u32 left = deques[t].tail - deques[t].head;
+      pthread_mutex_unlock(&(deques[t].lock));
+      if (left > most) {
+        most = left;
+        victim = t;
+      }
+    }
+    if (victim == numThreads) { return false; }
+    Deque* v = &(deques[victim]);
+    pthread_mutex_lock(&(v->lock));
+    if (v->head < v->tail) {
+      *pJob = v->jobs[--(v->tail)];
+      pthread_mutex_unlock(&(v->lock));
+      return true;
+    }
+    pthread_mutex_unlock(&(v->lock));
+  }
+}
+
+void* JobQueue::job_thr(void* arg) {
+  ThreadArg* a = (ThreadArg*)arg;
+  JobQueue* queue = a->queue;
+  u32 job;
+  while (queue->next(a->thr, &job)) {
+    queue->work(queue->ctx, job, a->thr);
   }
+  return NULL;
 }
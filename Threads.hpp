@@ -0,0 +1,88 @@
+/*
+ *  Threads.hpp
+ *  celldiff
+ *
+ *  persistent worker threads for the iteration engine, and a
+ *  work-stealing queue for independent jobs.
+ *  the calling thread always participates as thread 0.
+ */
+
+#ifndef _CELLDIFF_THREADS_H_
+#define _CELLDIFF_THREADS_H_
+
+#include <pthread.h>
+#include "types.h"
+
+// work function run by every thread: (context, thread index, thread count)
+typedef void (*thread_work_t)(void* ctx, const u32 thr, const u32 numThr);
+
+class ThreadPool {
+public:
+  ThreadPool(u32 n);
+  ~ThreadPool();
+  // run work on all threads and return when every thread has finished
+  void run(thread_work_t work, void* ctx);
+  // barrier between phases; only call from inside running work
+  void sync(void);
+  // split [0, n) evenly; get the range owned by a thread
+  static void range(const u32 n, const u32 thr, const u32 numThr, u32* pBegin, u32* pEnd);
+public:
+  u32 numThreads;
+private:
+  // calculate thread: wait for work, run it, report done
+  static void* calculate_thr(void* arg);
+  struct ThreadArg {
+    ThreadPool* pool;
+    u32 thr;
+  };
+  pthread_t* threads;
+  ThreadArg* args;
+  // start-of-work, between-phases and end-of-work barriers
+  pthread_barrier_t startBarrier;
+  pthread_barrier_t phaseBarrier;
+  pthread_barrier_t doneBarrier;
+  // current work
+  thread_work_t work;
+  void* ctx;
+  // set when the pool is shutting down
+  u8 quit;
+};
+
+// job run by a JobQueue: (context, job index, thread index)
+typedef void (*job_work_t)(void* ctx, const u32 job, const u32 thr);
+
+// independent jobs of uneven size. jobs are dealt round-robin in the given
+// order, so with the largest first every thread starts on its share of the
+// big ones; a thread works from the front of its own deque and, once that
+// is empty, steals from the back of the fullest other deque.
+class JobQueue {
+public:
+  JobQueue(u32 n);
+  ~JobQueue();
+  // run jobs order[0, numJobs) and return when all have finished
+  void run(const u32* order, const u32 numJobs, job_work_t work, void* ctx);
+public:
+  u32 numThreads;
+private:
+  // job thread: take jobs until none are left
+  static void* job_thr(void* arg);
+  // next job for a thread: own front, else steal; false when none are left
+  bool next(const u32 thr, u32* pJob);
+  struct Deque {
+    u32* jobs;
+    u32 head;
+    u32 tail;
+    pthread_mutex_t lock;
+  };
+  struct ThreadArg {
+    JobQueue* queue;
+    u32 thr;
+  };
+  Deque* deques;
+  ThreadArg* args;
+  // current work
+  job_work_t work;
+  void* ctx;
+};
+
+#endif // header guard
@@ -0,0 +1,161 @@
+/*
+ *  Writer.cpp
+ *  celldiff
+ *
+ *  background output writer
+ */
+
+#include <cstdlib>
+#include <unistd.h>
+#include "Writer.hpp"
+#include "Snapshot.hpp"
+
+AsyncWriter::AsyncWriter(const u32 depth) :
+busy(0),
+numErrors(0),
+quit(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&queued, NULL);
+  pthread_cond_init(&freed, NULL);
+  for(u32 i=0; i<(depth > 0 ? depth : 1); i++) {
+    WriterBuffer* buf = new WriterBuffer;
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+    buf->file = NULL;
+    buf->format = eWriteRaw;
+    pool.push_back(buf);
+  }
+  if (pthread_create(&thread, NULL, &AsyncWriter::writer_thr, this) != 0) {
+    printf("error creating writer thread, exiting!\n");
+    exit(1);
+  }
+}
+
+AsyncWriter::~AsyncWriter() {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  while(!pool.empty()) {
+    free(pool.front()->data);
+    delete pool.front();
+    pool.pop_front();
+  }
+  pthread_cond_destroy(&queued);
+  pthread_cond_destroy(&freed);
+  pthread_mutex_destroy(&lock);
+}
+
+WriterBuffer* AsyncWriter::acquire(const u64 n) {
+  pthread_mutex_lock(&lock);
+  // backpressure: wait for the writer to return a buffer
+  while(pool.empty()) {
+    pthread_cond_wait(&freed, &lock);
+  }
+  WriterBuffer* buf = pool.front();
+  pool.pop_front();
+  busy++;
+  pthread_mutex_unlock(&lock);
+
+  if (buf->capacity < n) {
+    free(buf->data);
+    buf->data = (u8*)malloc(n);
+    if (buf->data == NULL) {
+      printf("error allocating output buffer, exiting!\n");
+      exit(1);
+    }
+    buf->capacity = n;
+  }
+  buf->size = 0;
+  return buf;
+}
+
+void AsyncWriter::submit(WriterBuffer* buf, FILE* f, const eWriteFormat format) {
+  buf->file = f;
+  buf->format = format;
+  pthread_mutex_lock(&lock);
+  queue.push_back(buf);
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+}
+
+void AsyncWriter::submitReplace(WriterBuffer* buf, const std::string& path) {
+  buf->path = path;
+  submit(buf, NULL, eWriteReplace);
+}
+
+void AsyncWriter::flush(void) {
+  pthread_mutex_lock(&lock);
+  while(busy > 0) {
+    pthread_cond_wait(&freed, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+u32 AsyncWriter::errors(void) {
+  pthread_mutex_lock(&lock);
+  const u32 n = numErrors;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+void AsyncWriter::write(WriterBuffer* buf) {
+  int err = 0;
+  if (buf->format == eWriteStateText) {
+    const SnapshotHeader* hdr = (const SnapshotHeader*)buf->data;
+    const f64* conc[2] = {
+      (const f64*)(buf->data + hdr->concentrationOffset[0]),
+      (const f64*)(buf->data + hdr->concentrationOffset[1])
+    };
+    err = snapshot_write_text(buf->file, hdr->numCells, buf->data + hdr->stateOffset, conc);
+  } else if (buf->format == eWriteReplace) {
+    err = replace(buf);
+  } else {
+    err = (fwrite(buf->data, 1, buf->size, buf->file) == buf->size) ? 0 : -1;
+  }
+  pthread_mutex_lock(&lock);
+  if (err) { numErrors++; }
+  pool.push_back(buf);
+  busy--;
+  pthread_cond_broadcast(&freed);
+  pthread_mutex_unlock(&lock);
+}
+
+// write to a temporary file beside the destination and rename it into place
+int AsyncWriter::replace(WriterBuffer* buf) {
+  const std::string tmp = buf->path + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (f == NULL) { return -1; }
+  int err = (fwrite(buf->data, 1, buf->size, f) == buf->size) ? 0 : -1;
+  if (fflush(f) != 0) { err = -1; }
+  if (fsync(fileno(f)) != 0) { err = -1; }
+  if (fclose(f) != 0) { err = -1; }
+  if (err == 0) {
+    err = rename(tmp.c_str(), buf->path.c_str());
+  }
+  return err;
+}
+
+// writer thread: write queued buffers in order until told to quit
+void* AsyncWriter::writer_thr(void* arg) {
+  AsyncWriter* w = (AsyncWriter*)arg;
+  for (;;) {
+    pthread_mutex_lock(&(w->lock));
+    while(w->queue.empty() && !w->quit) {
+      pthread_cond_wait(&(w->queued), &(w->lock));
+    }
+    if (w->queue.empty()) {
+      // quitting, and nothing left to write
+      pthread_mutex_unlock(&(w->lock));
+      break;
+    }
+    WriterBuffer* buf = w->queue.front();
+    w->queue.pop_front();
+    pthread_mutex_unlock(&(w->lock));
+    w->write(buf);
+  }
+  return NULL;
+}
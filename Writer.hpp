@@ -0,0 +1,70 @@
+/*
+ *  Writer.hpp
+ *  celldiff
+ *
+ *  background output writer. the simulation fills a buffer, hands it
+ *  off and keeps iterating; a single writer thread does the file I/O.
+ *  there is a fixed pool of buffers, so the simulation only waits when
+ *  all of them are queued or being written.
+ */
+
+#ifndef _CELLDIFF_WRITER_H_
+#define _CELLDIFF_WRITER_H_
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <pthread.h>
+#include "types.h"
+
+// what the writer does with a buffer
+enum eWriteFormat {
+  eWriteRaw       = 0,  // write the bytes as they are
+  eWriteStateText = 1,  // buffer is a binary snapshot frame; write it as text
+  eWriteReplace   = 2   // write the bytes to a new file, then rename it over path
+};
+
+struct WriterBuffer {
+  u8* data;
+  u64 size;
+  u64 capacity;
+  FILE* file;
+  eWriteFormat format;
+  // destination of eWriteReplace
+  std::string path;
+};
+
+class AsyncWriter {
+public:
+  AsyncWriter(const u32 depth);
+  // writes everything still queued, then stops the thread
+  ~AsyncWriter();
+  // get a free buffer with room for n bytes; blocks while none is free
+  WriterBuffer* acquire(const u64 n);
+  // queue a filled buffer for writing
+  void submit(WriterBuffer* buf, FILE* f, const eWriteFormat format);
+  // queue a filled buffer to replace the file at path as a whole;
+  // the old file stays intact until the new one is complete
+  void submitReplace(WriterBuffer* buf, const std::string& path);
+  // wait until everything queued has been written
+  void flush(void);
+  // count of failed writes so far
+  u32 errors(void);
+private:
+  static void* writer_thr(void* arg);
+  void write(WriterBuffer* buf);
+  int replace(WriterBuffer* buf);
+  pthread_t thread;
+  pthread_mutex_t lock;
+  // signalled when a buffer is queued, or when a buffer becomes free
+  pthread_cond_t queued;
+  pthread_cond_t freed;
+  std::deque<WriterBuffer*> queue;
+  std::deque<WriterBuffer*> pool;
+  // buffers handed out (to the caller or the writer) and not yet returned
+  u32 busy;
+  u32 numErrors;
+  u8 quit;
+};
+
+#endif // header guard
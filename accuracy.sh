@@ -0,0 +1,39 @@
+#! /bin/bash
+# accuracy report for the f32 build (make accuracy):
+# runs celldiff and celldiff-f32 on the same parameter sets and compares
+# their release curves. per run: the largest absolute difference of the
+# released fraction, the largest difference relative to the f64 value
+# (where it is above 1e-3), and the final released fraction of both.
+# curves are written with 6 decimals, so 1e-06 is the smallest difference seen.
+
+F64=./celldiff
+F32=./celldiff-f32
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+RUNS=(
+  "-c300"
+  "-c300 -e48"
+  "-c300 -p0.1"
+  "-c300 -p0.6"
+  "-c300 -g0.4"
+  "-c300 -f0.5"
+  "-c300 -d0"
+  "-c300 -n0.03"
+)
+
+printf "%-16s %8s %12s %12s %10s %10s\n" "parameters" "points" "max abs" "max rel" "final f64" "final f32"
+for args in "${RUNS[@]}"; do
+  $F64 -x1 $args -r "$TMP/f64.txt" > /dev/null 2>&1
+  $F32 -x1 $args -r "$TMP/f32.txt" > /dev/null 2>&1
+  # a curve may stop early if the run halts; compare the points both have
+  paste "$TMP/f64.txt" "$TMP/f32.txt" | awk -v args="$args" '
+    NF == 4 {
+      n++
+      d = $4 - $2; if (d < 0) { d = -d }
+      if (d > maxAbs) { maxAbs = d }
+      if ($2 > 0.001 && d / $2 > maxRel) { maxRel = d / $2 }
+      a = $2; b = $4
+    }
+    END { printf "%-16s %8d %12.3e %12.3e %10.6f %10.6f\n", args, n, maxAbs, maxRel, a, b }'
+done
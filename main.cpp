@@ -10,14 +10,24 @@
 #include <cstdlib>
 #include <ctime>
 #include <cstdarg>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
 
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include <ncurses.h>
 #include <getopt.h>
 
 #include "CellModel.hpp"
+#include "Snapshot.hpp"
+#include "Writer.hpp"
+#include "Checkpoint.hpp"
+#include "Ensemble.hpp"
+#include "Profile.hpp"
+#include "Slab.hpp"
 
 using namespace std;
 
@@ -56,6 +66,14 @@ static string statePath;
 static u32 statePeriod = 0;
 // state output step counter 
 static u32 stateStep = 0;
+// re-read each binary state frame after writing it and compare with the model
+static u8 checkState = 0;
+// state output in the old text format (default is binary)
+static u8 textState = 0;
+// output buffers that may be queued for the writer thread
+static u32 writeQueue = 4;
+// release curve text is handed to the writer in blocks of this size
+static const u32 releasedBlock = 1 << 16;
 // ascii output toggle
 static u32 asciiout = 1;
 // dissolution probability scale (drug)
@@ -82,6 +100,32 @@ static f64 dissScale = 1.0;
 static f64 cellsize = 0.001;
 // compression flag
 static u8 compress = 1;
+// number of iteration threads
+static u32 numThreads = 1;
+// diffusion kernel (0 == best available)
+static u8 simd = eSimdAuto;
+// checkpoint file path
+static string checkpointPath;
+// seconds between checkpoints (0 == no checkpoints)
+static u32 checkpointPeriod = 0;
+// checkpoint to resume from (empty == start a new run)
+static string resumePath;
+// replicas run together in ensemble mode (1 == single run)
+static u32 ensembleSize = 1;
+// order of cells in memory (eGridLayout)
+static u8 gridLayout = eLayoutLinear;
+// neighbors of each cell (eStencil)
+static u8 stencil = eStencil6;
+// change per step below which bricks of cells sleep (0 == never)
+static f64 sleepTol = 0.0;
+// explicit steps per implicit step (1 == explicit diffusion)
+static u32 stepMultiple = 1;
+// processes the cube is split between along z (1 == one process)
+static u32 numSlabs = 1;
+// seeds to compare the parallel compression with the serial one on (0 == run the model)
+static u32 compressCheck = 0;
+// print a per-phase timing report at exit
+static u8 profileFlag = 0;
 
 // ncurses window pointer
 static WINDOW* win;
@@ -94,6 +138,13 @@ static void start_graphics(void);
 static void end_graphics(void);
 static void print_frame(CellModel* model, u32 frame);
 static void print(const int x, const int y, const char* fmt, ...);
+static FILE* open_output(const string& path, const u8 resume, const u64 bytes);
+static void checkpoint_run(CheckpointRun* run);
+static void resume_run(const CheckpointRun* run);
+static int run_ensemble(void);
+static int run_slabs(void);
+static int check_compress(void);
+static u32 count_iterations(const f64 dt, const u32 k);
 
 //============== function definitions
 void print(const int x, const int y, const char* fmt, ...) {
@@ -111,6 +162,373 @@ void print(const int x, const int y, const char* fmt, ...) {
   va_end(args);
 }
 
+//------ open an output file; when resuming, keep only the first bytes written before
+FILE* open_output(const string& path, const u8 resume, const u64 bytes) {
+  if (!resume) {
+    return fopen(path.c_str(), "w");
+  }
+  FILE* f = fopen(path.c_str(), "r+");
+  if (f == NULL) { return NULL; }
+  if ((ftruncate(fileno(f), bytes) != 0) || (fseek(f, 0, SEEK_END) != 0)) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+//------ parameters of this run, for a checkpoint
+void checkpoint_run(CheckpointRun* run) {
+  memset(run, 0, sizeof(CheckpointRun));
+  run->diameter = diameter;
+  run->cellSize = cellsize;
+  run->height = h;
+  run->pDrug = pd;
+  run->pPoly = pp;
+  run->drugDiff = drugdiff;
+  run->exDiff = exdiff;
+  run->dissProbDrug = dissprobdrug;
+  run->dissProbEx = dissprobex;
+  run->polyShellBalance = polyShellBalance;
+  run->boundDiff = boundDiff;
+  run->dissScale = dissScale;
+  run->maxTime = maxtime;
+  run->sleepTol = sleepTol;
+  run->seed = seed;
+  run->polyShellWidth = polyShellWidth;
+  run->compress = compress;
+  run->statePeriod = statePeriod;
+  run->textState = textState;
+  run->layout = gridLayout;
+  run->stencil = stencil;
+  run->stepMultiple = stepMultiple;
+  strncpy(run->releasedPath, releasedPath.c_str(), CHECKPOINT_PATH_MAX - 1);
+  strncpy(run->statePath, statePath.c_str(), CHECKPOINT_PATH_MAX - 1);
+}
+
+//------ take the parameters of a checkpointed run
+void resume_run(const CheckpointRun* run) {
+  diameter = run->diameter;
+  cellsize = run->cellSize;
+  h = run->height;
+  pd = run->pDrug;
+  pp = run->pPoly;
+  drugdiff = run->drugDiff;
+  exdiff = run->exDiff;
+  dissprobdrug = run->dissProbDrug;
+  dissprobex = run->dissProbEx;
+  polyShellBalance = run->polyShellBalance;
+  boundDiff = run->boundDiff;
+  dissScale = run->dissScale;
+  maxtime = run->maxTime;
+  sleepTol = run->sleepTol;
+  seed = run->seed;
+  polyShellWidth = run->polyShellWidth;
+  compress = run->compress;
+  statePeriod = run->statePeriod;
+  textState = run->textState;
+  gridLayout = run->layout;
+  stencil = run->stencil;
+  stepMultiple = run->stepMultiple;
+  releasedPath = run->releasedPath;
+  statePath = run->statePath;
+}
+
+// steps to reach maxtime: as many explicit steps as fit, and with implicit
+// steps of k explicit ones, enough of them to cover those (the last one may
+// end up to k-1 explicit steps past maxtime)
+u32 count_iterations(const f64 dt, const u32 k) {
+  if (dt <= 0.0) { return 0; }
+  const u32 steps = (u32)(maxtime * k / dt);
+  return (steps + k - 1) / k;
+}
+
+//------ ensemble mode: replicas with seeds seed, seed+1, ... advanced in lockstep.
+// each replica writes its own release curve, named after its seed.
+int run_ensemble(void) {
+  if ((statePeriod > 0) || (checkpointPeriod > 0) || !resumePath.empty()) {
+    print(0, 0, "state export and checkpoints aren't available in ensemble mode; ignoring them.");
+  }
+  if (sleepTol > 0.0) {
+    print(0, 0, "sleeping bricks aren't available in ensemble mode; ignoring them.");
+  }
+  if (stepMultiple > 1) {
+    print(0, 0, "implicit steps aren't available in ensemble mode; ignoring them.");
+  }
+  if (numSlabs > 1) {
+    print(0, 0, "slabs aren't available in ensemble mode; ignoring them.");
+  }
+  print(0, 0, "cube width %i, pd: %f, pp: %f, %d replicas", (int)n, pd, pp, (int)ensembleSize);
+
+  vector<CellModel*> replicas(ensembleSize);
+  for(u32 r=0; r<ensembleSize; r++) {
+    replicas[r] = new CellModel(n, h, pd, pp, cellsize, drugdiff, exdiff, seed + r,
+                                dissprobdrug, dissprobex, polyShellWidth, polyShellBalance,
+                                boundDiff, dissScale, compress, 1, simd, gridLayout, stencil);
+    replicas[r]->setup();
+  }
+  CellEnsemble ensemble(&(replicas[0]), ensembleSize, numThreads, simd);
+  for(u32 r=0; r<ensembleSize; r++) {
+    delete replicas[r];
+  }
+
+  iterationCount = count_iterations(ensemble.dt, 1);
+  print(2, 0, "cell memory is %llu bytes", (unsigned long long)ensemble.cellMemory());
+  static const char* simdNames[] = { "auto", "scalar", "avx2", "avx512" };
+  print(0, 0, "diffusion kernel: %s", simdNames[ensemble.simdLevel]);
+  print(3, 0, "performing %d iterations on %d cells.", iterationCount, n*n*n);
+
+  // per replica: output, released mass (last, current), no-change count, halt
+  vector<FILE*> releasedOut(ensembleSize);
+  vector<string> releasedLines(ensembleSize, "0.0\t0.0");
+  vector<f64> released(ensembleSize, -1000.0);
+  vector<u64> noChangeCount(ensembleSize, 0);
+  vector<u8> halt(ensembleSize, 0);
+  const size_t dot = releasedPath.rfind('.');
+  const size_t slash = releasedPath.rfind('/');
+  const bool hasExt = (dot != string::npos) && ((slash == string::npos) || (dot > slash));
+  for(u32 r=0; r<ensembleSize; r++) {
+    ostringstream path;
+    path << (hasExt ? releasedPath.substr(0, dot) : releasedPath) << "_s" << (seed + r)
+         << (hasExt ? releasedPath.substr(dot) : "");
+    releasedOut[r] = fopen(path.str().c_str(), "w");
+    if (releasedOut[r] == NULL) {
+      printf("error opening release curve output file, exiting!\n");
+      return 1;
+    }
+  }
+
+  AsyncWriter writer(writeQueue);
+  char line[64];
+  u32 running = ensembleSize;
+  int step = 0;
+  while(running > 0) {
+    step++;
+    const f64* const rel = ensemble.iterate();
+    for(u32 r=0; r<ensembleSize; r++) {
+      if (halt[r]) { continue; }
+      if ( (u32)step == iterationCount ) {
+        halt[r] = HALT_MAX_ITERATIONS;
+      }
+      const f64 dr = rel[r] - released[r];
+      released[r] = rel[r];
+      if(dr < noChangeMassThresh) {
+        if (rel[r] > 0.01) {
+          noChangeCount[r]++;
+        }
+      }
+      else {
+        noChangeCount[r] = 0;
+      }
+      if(noChangeCount[r] == noChangeCountThresh) {
+        halt[r] = HALT_NO_CHANGE;
+      }
+      snprintf(line, sizeof(line), "\n%f\t%f", ensemble.dt * (float)step, rel[r] / ensemble.drugMassTotal[r]);
+      releasedLines[r] += line;
+      if ((releasedLines[r].size() >= releasedBlock) || halt[r]) {
+        WriterBuffer* buf = writer.acquire(releasedLines[r].size());
+        memcpy(buf->data, releasedLines[r].data(), releasedLines[r].size());
+        buf->size = releasedLines[r].size();
+        writer.submit(buf, releasedOut[r], eWriteRaw);
+        releasedLines[r].clear();
+      }
+      if (halt[r]) {
+        running--;
+      }
+    }
+    print(1, 0, "iteration %d of %d, %d of %d replicas running", step, iterationCount, (int)running, (int)ensembleSize);
+  }
+
+  writer.flush();
+  if (writer.errors() > 0) {
+    print(2, 0, "error writing output files!");
+  }
+  for(u32 r=0; r<ensembleSize; r++) {
+    fclose(releasedOut[r]);
+  }
+  print(2, 0, "all replicas halted.");
+  return 1;
+}
+
+//------ slab mode: the cube split along z between processes, one per slab
+// (see Slab.hpp). every slab gets the same released mass, so all of them halt
+// at the same step; slab 0 writes the release curve.
+int run_slabs(void) {
+  if (!nographics) {
+    nographics = 1;
+    print(0, 0, "graphics aren't available with slabs; ignoring them.");
+  }
+  if ((statePeriod > 0) || (checkpointPeriod > 0) || !resumePath.empty()) {
+    print(0, 0, "state export and checkpoints aren't available with slabs; ignoring them.");
+  }
+  if (sleepTol > 0.0) {
+    print(0, 0, "sleeping bricks aren't available with slabs; ignoring them.");
+  }
+  if (stepMultiple > 1) {
+    print(0, 0, "implicit steps aren't available with slabs; ignoring them.");
+  }
+  if (gridLayout != eLayoutLinear) {
+    print(0, 0, "slabs use the linear layout; ignoring the layout.");
+  }
+  if (numThreads > 1) {
+    print(0, 0, "slabs run one thread each; ignoring the thread count.");
+  }
+  print(0, 0, "cube width %i, pd: %f, pp: %f, %d slabs", (int)n, pd, pp, (int)numSlabs);
+
+  FILE* releasedOut = fopen(releasedPath.c_str(), "w");
+  if (releasedOut == NULL) {
+    printf("error opening release curve output file, exiting!\n");
+    return 1;
+  }
+  Profile* profile = profileFlag ? new Profile() : NULL;
+  CellModel model(n, h, pd, pp, cellsize, drugdiff, exdiff, seed,
+                  dissprobdrug, dissprobex, polyShellWidth, polyShellBalance,
+                  boundDiff, dissScale, compress, 1, simd, eLayoutLinear, stencil);
+  model.profile = profile;
+  model.setup();
+  if (model.splitSlabs(numSlabs)) {
+    printf("more slabs than planes of the tablet, exiting!\n");
+    return 1;
+  }
+  ShmTransport shm(numSlabs, model.slabPlaneBytes());
+  if (shm.open()) {
+    printf("error creating shared memory for the slabs, exiting!\n");
+    return 1;
+  }
+  iterationCount = count_iterations(model.dt, model.stepMultiple);
+  static const char* simdNames[] = { "auto", "scalar", "avx2", "avx512" };
+  print(0, 0, "diffusion kernel: %s", simdNames[model.simdLevel]);
+  print(3, 0, "performing %d iterations on %d cells.", iterationCount, n*n*n);
+
+  // from here on every slab runs this, in its own process
+  if (shm.spawn()) {
+    printf("error starting the slab processes, exiting!\n");
+    return 1;
+  }
+  model.setSlab(&shm);
+  AsyncWriter* writer = NULL;
+  if (shm.slab == 0) {
+    print(2, 0, "cell memory of slab 0 is %llu bytes", (unsigned long long)model.cellMemory());
+    writer = new AsyncWriter(writeQueue);
+  }
+
+  f64 released[2] = {-1000.0, 0.0};
+  u64 noChangeCount = 0;
+  string releasedLines = "0.0\t0.0";
+  char line[64];
+  int step = 0;
+  u8 halt = 0;
+  if (profile) { profile->endIteration(); }
+  f64 t0 = 0.0;
+  while(halt == 0) {
+    step++;
+    if ( (u32)step == iterationCount ) {
+      halt = HALT_MAX_ITERATIONS;
+    }
+    released[1] = model.iterate();
+    const f64 dr = released[1] - released[0];
+    released[0] = released[1];
+    if(dr < noChangeMassThresh) {
+      if (released[1] > 0.01) {
+        noChangeCount++;
+      }
+    }
+    else {
+      noChangeCount = 0;
+    }
+    if(noChangeCount == noChangeCountThresh) {
+      halt = HALT_NO_CHANGE;
+    }
+    if (writer == NULL) { continue; }
+
+    if (profile) { t0 = Profile::now(); }
+    const double r = released[1] / model.drugMassTotal;
+    print(1, 0, "iteration %d of %d, released %f of %f, ratio %f", step, iterationCount, released[1], model.drugMassTotal, r);
+    snprintf(line, sizeof(line), "\n%f\t%f", model.dt * (float)step, r);
+    releasedLines += line;
+    if ((releasedLines.size() >= releasedBlock) || halt) {
+      WriterBuffer* buf = writer->acquire(releasedLines.size());
+      memcpy(buf->data, releasedLines.data(), releasedLines.size());
+      buf->size = releasedLines.size();
+      writer->submit(buf, releasedOut, eWriteRaw);
+      releasedLines.clear();
+    }
+    if (profile) {
+      profile->add(eProfOutput, Profile::now() - t0);
+      profile->endIteration();
+    }
+  }
+  // the other slabs are done
+  if (writer == NULL) { _exit(0); }
+
+  writer->flush();
+  if (writer->errors() > 0) {
+    print(2, 0, "error writing output files!");
+  }
+  delete writer;
+  fclose(releasedOut);
+  if (shm.join()) {
+    print(2, 0, "a slab process failed!");
+  }
+  if (halt == HALT_MAX_ITERATIONS) {
+    print(2, 0, "finished maximum iterations; simulation halted.");
+  } else {
+    print(2, 0, "released mass appears stable; simulation halted.");
+  }
+  if (profile) {
+    profile->report(stdout);
+    delete profile;
+  }
+  return 1;
+}
+
+//------ compression check: tablets of seeds seed, seed+1, ... compressed by
+// parallel wavefronts and by the serial sweep. prints the mean histograms of
+// polymer face neighbors, and how far apart they are in standard errors
+int check_compress(void) {
+  const u32 bins = 2 * (NUM_FACES + 1);
+  vector<f64> sum[2], sum2[2];
+  vector<u64> hist(bins);
+  print(0, 0, "cube width %i, pd: %f, pp: %f, comparing compression on %d seeds", (int)n, pd, pp, (int)compressCheck);
+  for(u8 s=0; s<2; s++) {
+    sum[s].assign(bins, 0.0);
+    sum2[s].assign(bins, 0.0);
+  }
+  for(u32 r=0; r<compressCheck; r++) {
+    for(u8 s=0; s<2; s++) {
+      CellModel model(n, h, pd, pp, cellsize, drugdiff, exdiff, seed + r,
+                      dissprobdrug, dissprobex, polyShellWidth, polyShellBalance,
+                      boundDiff, dissScale, compress, numThreads, simd, gridLayout, stencil);
+      model.compressHistogram(s, &(hist[0]));
+      for(u32 b=0; b<bins; b++) {
+        sum[s][b] += (f64)hist[b];
+        sum2[s][b] += (f64)hist[b] * (f64)hist[b];
+      }
+    }
+  }
+
+  const f64 k = (f64)compressCheck;
+  f64 zMax = 0.0;
+  print(0, 0, "polymer face neighbors of tablet cells, mean per tablet:");
+  print(0, 0, "%-8s %2s %12s %12s %10s %7s", "cells", "np", "serial", "parallel", "diff", "z");
+  for(u32 b=0; b<bins; b++) {
+    const f64 ms = sum[1][b] / k;
+    const f64 mc = sum[0][b] / k;
+    // standard error of the difference, from the spread over seeds
+    f64 se = 0.0;
+    if (compressCheck > 1) {
+      const f64 vs = max(sum2[1][b] - k * ms * ms, 0.0) / (k - 1.0);
+      const f64 vc = max(sum2[0][b] - k * mc * mc, 0.0) / (k - 1.0);
+      se = sqrt((vs + vc) / k);
+    }
+    const f64 z = (se > 0.0) ? (mc - ms) / se : 0.0;
+    zMax = max(zMax, fabs(z));
+    print(0, 0, "%-8s %2d %12.1f %12.1f %10.1f %7.2f", (b <= NUM_FACES) ? "polymer" : "other",
+          (int)(b % (NUM_FACES + 1)), ms, mc, mc - ms, z);
+  }
+  print(0, 0, "largest |z| %.2f", zMax);
+  return 1;
+}
+
 //------ main
 int main (const int argc, char* const* argv) {
 	
@@ -131,10 +549,35 @@ int main (const int argc, char* const* argv) {
   
   // set default variables
   releasedPath = "diff_release_" + timetag.str() + ".txt";
-  statePath = "diff_state_" + timetag.str() + ".txt";
+  statePath = "";
 	
   // return something if --help passed?
   int parsed = parse_args(argc, argv);
+  if (statePath.empty()) {
+    statePath = "diff_state_" + timetag.str() + (textState ? ".txt" : ".bin");
+  }
+
+  // a resumed run takes its parameters and output files from the checkpoint
+  u8* resumeData = NULL;
+  const CheckpointHeader* resumeHdr = NULL;
+  if (!resumePath.empty()) {
+    if (checkpoint_read(resumePath.c_str(), &resumeData)) {
+      printf("error reading checkpoint file, exiting!\n");
+      return 1;
+    }
+    resumeHdr = (const CheckpointHeader*)resumeData;
+    resume_run(&(resumeHdr->run));
+    if (checkpointPath.empty()) {
+      checkpointPath = resumePath;
+    }
+  }
+  if (checkpointPath.empty()) {
+    checkpointPath = "diff_checkpoint_" + timetag.str() + ".bin";
+  }
+  if ((checkpointPeriod > 0) && ((releasedPath.size() >= CHECKPOINT_PATH_MAX) || (statePath.size() >= CHECKPOINT_PATH_MAX))) {
+    printf("output file names are too long for checkpoints, exiting!\n");
+    return 1;
+  }
   
   if(parsed) {
     // print help message and return
@@ -151,26 +594,42 @@ int main (const int argc, char* const* argv) {
   // }
   
   frameNum = n >> 1; // show center slice
+
+  if (compressCheck > 0) {
+    return check_compress();
+  }
+  if (ensembleSize > 1) {
+    return run_ensemble();
+  }
+  if (numSlabs > 1) {
+    return run_slabs();
+  }
   
   // finish setting up variables
   
-  FILE* releasedOut = fopen(releasedPath.c_str(), "w");
+  const u8 resume = (resumeHdr != NULL);
+  FILE* releasedOut = open_output(releasedPath, resume, resume ? resumeHdr->run.releasedBytes : 0);
   if (releasedOut == NULL) {
     printf("error opening release curve output file, exiting!\n");
     return 1;
   }
   
-  FILE* stateOut;
+  FILE* stateOut = NULL;
   if (statePeriod > 0) {
-    stateOut = fopen(statePath.c_str(), "w");
+    stateOut = open_output(statePath, resume, resume ? resumeHdr->run.stateBytes : 0);
     if (stateOut == NULL) { 
       printf("error opening state output file, exiting!\n");
       return 1;
     }
+    // binary frames are written plane by plane; let them go straight through
+    setvbuf(stateOut, NULL, _IOFBF, 1 << 22);
   }
   
   if(nographics) {} else { start_graphics(); }
   
+  // phase timing; NULL when off
+  Profile* profile = profileFlag ? new Profile() : NULL;
+  
   CellModel model(
                   n,      // cube width,
                   h,     // cylinder height
@@ -186,17 +645,35 @@ int main (const int argc, char* const* argv) {
                   polyShellBalance,  // shell balance
                   boundDiff,       // boundary diffusino factor (exponential)
                   dissScale,          // dissolution time scaling,
-		  compress  // compression flag
+		  compress,  // compression flag
+                  numThreads,  // iteration threads
+                  simd,  // diffusion kernel
+                  gridLayout,  // cell order in memory
+                  stencil,  // neighbors per cell
+                  sleepTol,  // change per step below which bricks sleep
+                  stepMultiple  // explicit steps per implicit step
                   );
 	
   print(0, 0, "cube width %i, pd: %f, pp: %f", (int)n, pd, pp);
   if(nographics) {} else { print(1, 0, "initializing..."); }
-  model.setup();
+  model.profile = profile;
+  if (resume) {
+    if (model.checkpointRestore(resumeData + resumeHdr->modelOffset, resumeHdr->modelSize)) {
+      printf("checkpoint doesn't match the model, exiting!\n");
+      return 1;
+    }
+  } else {
+    model.setup();
+  }
   
-  iterationCount = (u32)(maxtime / model.dt);
+  iterationCount = count_iterations(model.dt, model.stepMultiple);
   
   
-  print(2, 0, "cell memory is %d bytes", model.numCells * sizeof(Cell));
+  print(2, 0, "cell memory is %llu bytes", (unsigned long long)model.cellMemory());
+  if(nographics) {
+    static const char* simdNames[] = { "auto", "scalar", "avx2", "avx512" };
+    print(0, 0, "diffusion kernel: %s", simdNames[model.simdLevel]);
+  }
   if(nographics) {
     print(3, 0, "performing %d iterations on %d cells.", iterationCount, n*n*n);
   } else {
@@ -210,9 +687,37 @@ int main (const int argc, char* const* argv) {
   
   int step = 0;
   u32 frameStep = 0;
+  u64 stateFrames = 0;
   u8 halt = 0;
-  
-  fprintf(releasedOut, "0.0\t0.0");
+
+  // file output happens on a background thread
+  AsyncWriter writer(writeQueue);
+  string releasedLines = "0.0\t0.0";
+  char line[64];
+
+  if (resume) {
+    step = resumeHdr->run.step;
+    frameStep = resumeHdr->run.frameStep;
+    stateStep = resumeHdr->run.stateStep;
+    noChangeCount = resumeHdr->run.noChangeCount;
+    released[0] = resumeHdr->run.released[0];
+    released[1] = resumeHdr->run.released[1];
+    releasedLines.clear();
+    if ((statePeriod > 0) && !textState) {
+      // binary frames all have the same size
+      SnapshotHeader hdr;
+      snapshot_header(&hdr, &model, 0.0, 0.0);
+      stateFrames = resumeHdr->run.stateBytes / hdr.frameSize;
+    }
+    print(0, 0, "resuming at iteration %d", step);
+    free(resumeData);
+    resumeData = NULL;
+    resumeHdr = NULL;
+  }
+  time_t lastCheckpoint = time(NULL);
+  // everything up to here counts as setup
+  if (profile) { profile->endIteration(); }
+  f64 t0 = 0.0;
   
   while(halt == 0)    {
     step++;
@@ -224,18 +729,39 @@ int main (const int argc, char* const* argv) {
     }
     
     if( frameStep == framePeriod ) {
+      if (profile) { t0 = Profile::now(); }
       print_frame(&model, frameNum);
       frameStep = 0;
+      if (profile) { profile->add(eProfDraw, Profile::now() - t0); }
     }
   
 	  if( (stateStep == 1) && (statePeriod != 0) ) {
-		  // print model state data
-		  u64 cell;
-		  for(cell = 0; cell<model.numCells; cell++) {
-			  fprintf(stateOut, "\n%i", model.cells[cell]->state);
-			  fprintf(stateOut, "\t%f", model.cells[cell]->concentration[0]);
-			  fprintf(stateOut, "\t%f", model.cells[cell]->concentration[1]);
+		  if (profile) { t0 = Profile::now(); }
+		  // copy model state data and hand it to the writer
+		  SnapshotHeader hdr;
+		  snapshot_header(&hdr, &model, model.dt * (f64)model.iterationNum, released[1]);
+		  WriterBuffer* buf = writer.acquire(hdr.frameSize);
+		  snapshot_pack(buf->data, &hdr, &model);
+		  buf->size = hdr.frameSize;
+		  writer.submit(buf, stateOut, textState ? eWriteStateText : eWriteRaw);
+		  if (profile) { profile->add(eProfOutput, Profile::now() - t0); }
+		  if (checkState && !textState) {
+		    // wait for the frame to reach the file, map it back and compare
+		    SnapshotFile file;
+		    s64 bad = -1;
+		    writer.flush();
+		    fflush(stateOut);
+		    if (snapshot_map(statePath.c_str(), &file) == 0) {
+		      bad = snapshot_check(&file, stateFrames, &hdr, &model);
+		      snapshot_unmap(&file);
+		    }
+		    if (bad < 0) {
+		      print(2, 0, "state frame %llu could not be read back!", (unsigned long long)stateFrames);
+		    } else if (bad > 0) {
+		      print(2, 0, "state frame %llu does not match the model (%lld cells differ)!", (unsigned long long)stateFrames, (long long)bad);
+		    }
 		  }
+		  stateFrames++;
 	  }
 	  
     if( stateStep == statePeriod ) {
@@ -260,11 +786,66 @@ int main (const int argc, char* const* argv) {
     }
     
     const double r = released[1] / model.drugMassTotal;
+    if (profile) { t0 = Profile::now(); }
     print(1, 0, "iteration %d of %d, released %f of %f, ratio %f", step, iterationCount, released[1], model.drugMassTotal, r);
-    fprintf(releasedOut, "\n%f\t%f", model.dt * (float)step, r);
+    if (profile) {
+      const f64 t1 = Profile::now();
+      profile->add(eProfDraw, t1 - t0);
+      t0 = t1;
+    }
+    snprintf(line, sizeof(line), "\n%f\t%f", model.dt * (float)step, r);
+    releasedLines += line;
 //      fprintf(releasedOut, "\n%f", r);
+    if ((releasedLines.size() >= releasedBlock) || halt) {
+      WriterBuffer* buf = writer.acquire(releasedLines.size());
+      memcpy(buf->data, releasedLines.data(), releasedLines.size());
+      buf->size = releasedLines.size();
+      writer.submit(buf, releasedOut, eWriteRaw);
+      releasedLines.clear();
+    }
+
+    if ((checkpointPeriod > 0) && (halt == 0) && (time(NULL) - lastCheckpoint >= (time_t)checkpointPeriod)) {
+      // everything up to this step goes to the output files first
+      if (releasedLines.size() > 0) {
+        WriterBuffer* buf = writer.acquire(releasedLines.size());
+        memcpy(buf->data, releasedLines.data(), releasedLines.size());
+        buf->size = releasedLines.size();
+        writer.submit(buf, releasedOut, eWriteRaw);
+        releasedLines.clear();
+      }
+      writer.flush();
+      CheckpointRun run;
+      checkpoint_run(&run);
+      run.step = step;
+      run.frameStep = frameStep;
+      run.stateStep = stateStep;
+      run.noChangeCount = noChangeCount;
+      run.released[0] = released[0];
+      run.released[1] = released[1];
+      fflush(releasedOut);
+      run.releasedBytes = ftell(releasedOut);
+      if (statePeriod > 0) {
+        fflush(stateOut);
+        run.stateBytes = ftell(stateOut);
+      }
+      const u64 size = checkpoint_size(&model);
+      WriterBuffer* buf = writer.acquire(size);
+      checkpoint_pack(buf->data, &run, &model);
+      buf->size = size;
+      writer.submitReplace(buf, checkpointPath);
+      lastCheckpoint = time(NULL);
+    }
+    if (profile) {
+      profile->add(eProfOutput, Profile::now() - t0);
+      profile->endIteration();
+    }
     
   } // end main loop
+
+  writer.flush();
+  if (writer.errors() > 0) {
+    print(2, 0, "error writing output files!");
+  }
   
   print_frame(&model, frameNum); 
   
@@ -288,11 +869,26 @@ int main (const int argc, char* const* argv) {
   }
   
   
+  if (model.stepMultiple > 1) {
+    print(3, 0, "implicit steps of %d explicit steps: %.1f solver iterations per step",
+          (int)model.stepMultiple, model.implicitIterations());
+  }
+  if (model.sleepTol > 0.0) {
+    const f64 updates = (f64)(model.sleepSkipped + model.sleepVisited);
+    print(3, 0, "sleeping bricks skipped %.1f%% of cell updates; error bound %g of released ratio, %g per cell",
+          (updates > 0.0) ? (100.0 * model.sleepSkipped / updates) : 0.0,
+          model.sleepBound / model.drugMassTotal, model.sleepCellBound());
+  }
+  
   fclose(releasedOut);
   if(statePeriod > 0) {
     fclose(stateOut);
   }
   if (nographics) { } else { end_graphics(); }
+  if (profile) {
+    profile->report(stdout);
+    delete profile;
+  }
   return 1;
 }
 
@@ -352,13 +948,29 @@ int parse_args(const int argc, char* const* argv) {
     {"drugdiffusionrate", required_argument, 0, 'u'},
     {"exdiffusionrate",   required_argument, 0, 'k'},
     {"cellsize",          required_argument, 0, 'y'},
+    {"threads",           required_argument, 0, 'j'},
+    {"textstate",         required_argument, 0, 'q'},
+    {"writequeue",        required_argument, 0, 'v'},
+    {"simd",              required_argument, 0, 'm'},
+    {"checkstate",        required_argument, 0, 'C'},
+    {"checkpoint",        required_argument, 0, 'i'},
+    {"checkpointperiod",  required_argument, 0, 'z'},
+    {"resume",            required_argument, 0, 'R'},
+    {"ensemble",          required_argument, 0, 'E'},
+    {"profile",           required_argument, 0, 'P'},
+    {"layout",            required_argument, 0, 'L'},
+    {"stencil",           required_argument, 0, 'N'},
+    {"sleep",             required_argument, 0, 'S'},
+    {"implicit",          required_argument, 0, 'I'},
+    {"slabs",             required_argument, 0, 'D'},
+    {"checkcompress",     required_argument, 0, 'V'},
     {0, 0, 0, 0}
   };
   
   int opt = 0;
   int opt_idx = 0;
   while (1) {
-    opt = getopt_long(argc, argv, "n:c:p:g:h:r:s:t:d:e:a:o:l:w:b:f:x:u:k:y:",
+    opt = getopt_long(argc, argv, "n:c:p:g:h:r:s:t:d:e:a:o:l:w:b:f:x:u:k:y:j:m:q:v:i:z:R:E:P:L:N:S:I:D:V:C:",
                       long_options, &opt_idx);
     if (opt == -1) { break; }
     
@@ -425,32 +1037,79 @@ int parse_args(const int argc, char* const* argv) {
       case 'y':
         cellsize = atof(optarg);
         break;
+      case 'j':
+        numThreads = atoi(optarg);
+        break;
+      case 'm':
+        simd = atoi(optarg);
+        break;
+      case 'q':
+        textState = atoi(optarg);
+        break;
+      case 'v':
+        writeQueue = atoi(optarg);
+        break;
+      case 'C':
+        checkState = atoi(optarg);
+        break;
+      case 'i':
+        checkpointPath = optarg;
+        break;
+      case 'z':
+        checkpointPeriod = atoi(optarg);
+        break;
+      case 'R':
+        resumePath = optarg;
+        break;
+      case 'E':
+        ensembleSize = atoi(optarg);
+        break;
+      case 'P':
+        profileFlag = atoi(optarg);
+        break;
+      case 'L':
+        gridLayout = atoi(optarg);
+        break;
+      case 'N':
+        stencil = atoi(optarg);
+        break;
+      case 'S':
+        sleepTol = atof(optarg);
+        break;
+      case 'I':
+        stepMultiple = atoi(optarg);
+        break;
+      case 'D':
+        numSlabs = atoi(optarg);
+        break;
+      case 'V':
+        compressCheck = atoi(optarg);
+        break;
       default:
         break;
     }
   }
+  return 0;
 }
 
 // draw an animation frame
 void print_frame(CellModel* model, u32 slice) {
   u32 i = slice;
   u32 idx;
+  u8 state;
   
   for(u32 j=0; j<n; j++) {
     // print states
     for(u32 k=0; k<n; k++) {
-      idx = i*n*n + j*n + k;
-      attron(COLOR_PAIR(model->cells[idx]->state + 1));
-      if ((model->cells[idx]->state == eStateWet) || (model->cells[idx]->state == eStateBound) ) {
-        mvprintw(6+j, k * 2, "%d0", (int)(model->cells[idx]->concentration[eStateDrug] * 99.0));
+      idx = model->subToIdx(k, j, i);
+      state = model->cells.state[idx];
+      attron(COLOR_PAIR(state + 1));
+      if ((state == eStateWet) || (state == eStateBound) ) {
+        mvprintw(6+j, k * 2, "%d0", (int)(model->cells.concentration[eStateDrug][idx] * 99.0));
       } else {
-        // if(model->cells[idx]->state == eStateDummy) {
-        //   mvprintw(6+j, k * 2, "XX", model->cells[idx]->state);
-        // } else {
-        mvprintw(6+j, k * 2, "%d ", model->cells[idx]->state);
-        // }
+        mvprintw(6+j, k * 2, "%d ", state);
       }
-      attroff(COLOR_PAIR(model->cells[idx]->state + 1));
+      attroff(COLOR_PAIR(state + 1));
     }
   }
   refresh();